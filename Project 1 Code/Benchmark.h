@@ -0,0 +1,102 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "Profiler.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+//Results of one fixed-workload benchmark run
+struct BenchmarkResult {
+	std::string renderer;			//GL_RENDERER, so software and hardware runs aren't mixed up
+	unsigned int objects;			//rows in the scene table
+	unsigned int frames;			//measured frames, warmup not included
+	double seconds;					//wall time for the measured frames
+	SampleWindow::Stats submission;	//CPU time spent in Render() per frame, ms
+	size_t peakResidentBytes;
+};
+
+//Largest resident set the process has had, 0 where the platform can't say
+inline size_t PeakResidentBytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return counters.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		//reported in kilobytes on Linux
+		return (size_t)usage.ru_maxrss * 1024;
+	}
+	return 0;
+#endif
+}
+
+//escapes the characters JSON doesn't allow raw in a string
+inline std::string JsonString(const std::string& text) {
+	std::string escaped = "\"";
+	for (size_t i = 0; i < text.size(); i++) {
+		char c = text[i];
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+			escaped += c;
+		}
+		else if ((unsigned char)c < 0x20) {
+			char code[8];
+			snprintf(code, sizeof(code), "\\u%04x", (unsigned int)(unsigned char)c);
+			escaped += code;
+		}
+		else {
+			escaped += c;
+		}
+	}
+	return escaped + "\"";
+}
+
+//Writes the result as one JSON object, fileName "-" writes to stdout
+inline bool WriteBenchmarkJson(const BenchmarkResult& result, const std::string& fileName) {
+	double framesPerSecond = result.seconds > 0.0 ? result.frames / result.seconds : 0.0;
+
+	std::ostringstream json;
+	json << "{\n"
+		<< "  \"renderer\": " << JsonString(result.renderer) << ",\n"
+		<< "  \"objects\": " << result.objects << ",\n"
+		<< "  \"frames\": " << result.frames << ",\n"
+		<< "  \"seconds\": " << result.seconds << ",\n"
+		<< "  \"frames_per_second\": " << framesPerSecond << ",\n"
+		<< "  \"cpu_submit_ms\": { \"min\": " << result.submission.min << ", \"avg\": " << result.submission.avg
+		<< ", \"p99\": " << result.submission.p99 << " },\n"
+		<< "  \"peak_rss_bytes\": " << result.peakResidentBytes << "\n"
+		<< "}\n";
+
+	if (fileName == "-") {
+		std::cout << json.str();
+		return true;
+	}
+	std::ofstream file(fileName.c_str());
+	if (!file) {
+		std::cout << "Failed to write benchmark report " << fileName << std::endl;
+		return false;
+	}
+	file << json.str();
+	return true;
+}
+#endif
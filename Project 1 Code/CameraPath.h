@@ -0,0 +1,133 @@
+#ifndef CAMERAPATH_H
+#define CAMERAPATH_H
+
+#include "Camera.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//One leg of a scripted camera path, held for a number of frames
+//movement is a Camera_Movement or -1 to stand still, mouse offsets are applied every frame
+struct CameraStep {
+	unsigned int frames;
+	int movement;
+	float mouseX;
+	float mouseY;
+};
+
+//Scripted camera path that stands in for the keyboard and mouse
+//Steps go through Camera::ProcessKeyboard and Camera::ProcessMouseMovement with a fixed time step,
+//so the same path from the same start always gives the same frames
+//
+//File format is one step per line, blank lines and lines starting with # are skipped:
+//	frames movement mouseX mouseY
+//where movement is forward, backward, left, right, up, down or none
+class CameraPath {
+public:
+	std::vector<CameraStep> steps;
+
+	bool Load(const char* fileName) {
+		std::ifstream file(fileName);
+		if (!file) {
+			std::cout << "Failed to open camera path " << fileName << std::endl;
+			return false;
+		}
+		steps.clear();
+		std::string line;
+		unsigned int lineNumber = 0;
+		while (std::getline(file, line)) {
+			lineNumber++;
+			//blank line or comment
+			size_t first = line.find_first_not_of(" \t\r");
+			if (first == std::string::npos || line[first] == '#') {
+				continue;
+			}
+			std::istringstream fields(line);
+			std::string movement;
+			CameraStep step;
+			if (!(fields >> step.frames)) {
+				std::cout << "Camera path " << fileName << " line " << lineNumber << ": expected a frame count" << std::endl;
+				return false;
+			}
+			step.mouseX = step.mouseY = 0.0f;
+			fields >> movement >> step.mouseX >> step.mouseY;
+			step.movement = MovementFromName(movement);
+			if (step.movement == -2) {
+				std::cout << "Camera path " << fileName << " line " << lineNumber << ": unknown movement " << movement << std::endl;
+				return false;
+			}
+			steps.push_back(step);
+		}
+		return !steps.empty();
+	}
+
+	//Default path for runs without a file: dolly in, sweep around the board, rise and look down
+	void LoadDefault() {
+		steps.clear();
+		AddStep(60, FORWARD, 0.0f, 0.0f);
+		AddStep(90, LEFT, 4.0f, 0.0f);
+		AddStep(90, RIGHT, -4.0f, 0.0f);
+		AddStep(60, UP, 0.0f, -3.0f);
+		AddStep(60, BACKWARD, 0.0f, 3.0f);
+		AddStep(60, DOWN, 0.0f, 0.0f);
+	}
+
+	void AddStep(unsigned int frames, int movement, float mouseX, float mouseY) {
+		CameraStep step;
+		step.frames = frames;
+		step.movement = movement;
+		step.mouseX = mouseX;
+		step.mouseY = mouseY;
+		steps.push_back(step);
+	}
+
+	unsigned int TotalFrames() const {
+		unsigned int total = 0;
+		for (size_t i = 0; i < steps.size(); i++) {
+			total += steps[i].frames;
+		}
+		return total;
+	}
+
+	//Moves the camera for one frame, frames past the end of the path wrap to the start
+	//has to be called for every frame in order since each step moves relative to the last
+	void Apply(Camera& camera, unsigned int frame, float deltaTime) const {
+		unsigned int total = TotalFrames();
+		if (total == 0) {
+			return;
+		}
+		frame %= total;
+		for (size_t i = 0; i < steps.size(); i++) {
+			if (frame < steps[i].frames) {
+				if (steps[i].movement >= 0) {
+					camera.ProcessKeyboard((Camera_Movement)steps[i].movement, deltaTime);
+				}
+				if (steps[i].mouseX != 0.0f || steps[i].mouseY != 0.0f) {
+					camera.ProcessMouseMovement(steps[i].mouseX, steps[i].mouseY);
+				}
+				return;
+			}
+			frame -= steps[i].frames;
+		}
+	}
+
+private:
+	//-1 for none, -2 for anything unrecognized
+	static int MovementFromName(const std::string& name) {
+		if (name.empty() || name == "none") {
+			return -1;
+		}
+		const char* names[] = { "forward", "backward", "left", "right", "up", "down" };
+		const Camera_Movement movements[] = { FORWARD, BACKWARD, LEFT, RIGHT, UP, DOWN };
+		for (int i = 0; i < 6; i++) {
+			if (name == names[i]) {
+				return movements[i];
+			}
+		}
+		return -2;
+	}
+};
+#endif
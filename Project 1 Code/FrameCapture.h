@@ -0,0 +1,248 @@
+#ifndef FRAMECAPTURE_H
+#define FRAMECAPTURE_H
+
+#include <GL/glew.h>
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Offscreen render target with asynchronous readback to disk
+//Frames render into an FBO, Capture() starts a glReadPixels into one of a ring of pixel buffers
+//and only maps a buffer again once its fence has passed, so the GPU keeps rendering while older
+//frames are copied out. Files are written on a separate thread as binary PPM.
+class FrameCapture {
+public:
+	//frames written to disk so far
+	unsigned int framesWritten;
+
+	FrameCapture() : framesWritten(0), fbo(0), colorBuffer(0), depthBuffer(0), width(0), height(0),
+		next(0), writeFailed(false), stopping(false) {}
+
+	~FrameCapture() {
+		StopWriter();
+	}
+
+	//Creates the FBO and readback buffers, directory is where frames go or empty to render without saving
+	bool Create(int frameWidth, int frameHeight, const std::string& directory, unsigned int bufferCount = 3) {
+		width = frameWidth;
+		height = frameHeight;
+		outputDirectory = directory;
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glGenRenderbuffers(1, &colorBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+		glGenRenderbuffers(1, &depthBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			std::cout << "Error: offscreen framebuffer incomplete (0x" << std::hex << status << std::dec << ")" << std::endl;
+			return false;
+		}
+
+		if (outputDirectory.empty()) {
+			return true;
+		}
+		readbacks.resize(bufferCount > 0 ? bufferCount : 1);
+		for (size_t i = 0; i < readbacks.size(); i++) {
+			glGenBuffers(1, &readbacks[i].pbo);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, readbacks[i].pbo);
+			glBufferData(GL_PIXEL_PACK_BUFFER, FrameBytes(), NULL, GL_STREAM_READ);
+			readbacks[i].fence = 0;
+			readbacks[i].frame = 0;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		stopping = false;
+		writer = std::thread(&FrameCapture::WriterLoop, this);
+		return true;
+	}
+
+	//Makes the FBO the target for everything drawn until the next Bind()
+	void Bind() {
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glViewport(0, 0, width, height);
+	}
+
+	//Queues a readback of the frame just rendered, tagged with its frame number for the file name
+	//The oldest buffer in the ring is drained first, which only waits if the GPU is a full ring behind
+	void Capture(unsigned int frame) {
+		if (readbacks.empty()) {
+			return;
+		}
+		Readback& readback = readbacks[next];
+		Collect(readback);
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		readback.frame = frame;
+
+		next = (next + 1) % readbacks.size();
+	}
+
+	//Drains every readback and waits for the writer thread to finish the queue
+	void Finish() {
+		for (size_t i = 0; i < readbacks.size(); i++) {
+			Collect(readbacks[(next + i) % readbacks.size()]);
+		}
+		StopWriter();
+	}
+
+	//frees the GL objects, call while the context is still current
+	void Destroy() {
+		Finish();
+		for (size_t i = 0; i < readbacks.size(); i++) {
+			glDeleteBuffers(1, &readbacks[i].pbo);
+		}
+		readbacks.clear();
+		glDeleteRenderbuffers(1, &colorBuffer);
+		glDeleteRenderbuffers(1, &depthBuffer);
+		glDeleteFramebuffers(1, &fbo);
+		fbo = colorBuffer = depthBuffer = 0;
+	}
+
+private:
+	//one pixel buffer in the readback ring
+	struct Readback {
+		GLuint pbo;
+		GLsync fence;		//0 when the buffer holds nothing waiting to be written
+		unsigned int frame;
+	};
+
+	//finished frame waiting on the writer thread
+	struct FrameImage {
+		unsigned int frame;
+		std::vector<unsigned char> pixels;
+	};
+
+	GLuint fbo;
+	GLuint colorBuffer;
+	GLuint depthBuffer;
+	int width;
+	int height;
+	std::string outputDirectory;
+	std::vector<Readback> readbacks;
+	size_t next;
+	bool writeFailed;
+
+	//writer thread
+	std::thread writer;
+	std::mutex queueMutex;
+	std::condition_variable queueReady;
+	std::deque<FrameImage> writeQueue;
+	bool stopping;
+
+	size_t FrameBytes() const {
+		return (size_t)width * height * 3;
+	}
+
+	//waits on the buffer's fence if it has one, then copies the pixels out for the writer
+	void Collect(Readback& readback) {
+		if (readback.fence == 0) {
+			return;
+		}
+		//the flush makes sure the fence is actually submitted before waiting on it
+		GLenum waited = glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+		glDeleteSync(readback.fence);
+		readback.fence = 0;
+		if (waited == GL_TIMEOUT_EXPIRED || waited == GL_WAIT_FAILED) {
+			std::cout << "Failed to read back frame " << readback.frame << std::endl;
+			return;
+		}
+
+		FrameImage image;
+		image.frame = readback.frame;
+		image.pixels.resize(FrameBytes());
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+		void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, FrameBytes(), GL_MAP_READ_BIT);
+		if (mapped != nullptr) {
+			memcpy(image.pixels.data(), mapped, FrameBytes());
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		if (mapped == nullptr) {
+			std::cout << "Failed to map readback for frame " << readback.frame << std::endl;
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			writeQueue.push_back(std::move(image));
+		}
+		queueReady.notify_one();
+	}
+
+	void StopWriter() {
+		if (!writer.joinable()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			stopping = true;
+		}
+		queueReady.notify_all();
+		writer.join();
+	}
+
+	//Writer thread, drains the queue before stopping so no captured frame is lost
+	void WriterLoop() {
+		while (true) {
+			FrameImage image;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueReady.wait(lock, [this] { return stopping || !writeQueue.empty(); });
+				if (writeQueue.empty()) {
+					return;
+				}
+				image = std::move(writeQueue.front());
+				writeQueue.pop_front();
+			}
+			WriteFrame(image);
+		}
+	}
+
+	//binary PPM, rows flipped since GL reads bottom to top
+	void WriteFrame(const FrameImage& image) {
+		char fileName[32];
+		snprintf(fileName, sizeof(fileName), "frame_%05u.ppm", image.frame);
+		std::string path = outputDirectory + "/" + fileName;
+
+		FILE* file = fopen(path.c_str(), "wb");
+		if (file == NULL) {
+			//one message is enough, usually the directory doesn't exist
+			if (!writeFailed) {
+				std::cout << "Failed to write " << path << std::endl;
+				writeFailed = true;
+			}
+			return;
+		}
+		fprintf(file, "P6\n%d %d\n255\n", width, height);
+		size_t rowBytes = (size_t)width * 3;
+		for (int row = height - 1; row >= 0; row--) {
+			fwrite(image.pixels.data() + row * rowBytes, 1, rowBytes, file);
+		}
+		fclose(file);
+		framesWritten++;
+	}
+};
+#endif
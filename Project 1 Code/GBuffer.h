@@ -0,0 +1,99 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <GL/glew.h>
+
+#include <iostream>
+
+//texture units the lighting pass reads the G-buffer from, clear of the scene's unit 0
+const GLuint GBUFFER_ALBEDO_UNIT = 2;
+const GLuint GBUFFER_NORMAL_UNIT = 3;
+const GLuint GBUFFER_DEPTH_UNIT = 4;
+
+//Geometry buffer for deferred shading, 12 bytes a pixel
+//	albedo	RGBA8, the texture color, a is 1 for fragments that skip lighting (lamp, fill, background)
+//	normal	RGB10_A2, world space normal scaled into 0-1
+//	depth	32 bit float, world positions are rebuilt from it in the lighting pass
+//The geometry pass draws into it in place of the frame's target, the lighting pass then shades
+//each pixel once no matter how many fragments were drawn over it
+class GBuffer {
+public:
+	GBuffer() : fbo(0), albedoTexture(0), normalTexture(0), depthTexture(0), width(0), height(0) {}
+
+	//(re)creates the attachments when the size changes, false if the framebuffer is incomplete
+	bool Resize(int bufferWidth, int bufferHeight) {
+		if (fbo != 0 && bufferWidth == width && bufferHeight == height) {
+			return true;
+		}
+		Destroy();
+		width = bufferWidth;
+		height = bufferHeight;
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		albedoTexture = CreateTexture(GL_RGBA8);
+		normalTexture = CreateTexture(GL_RGB10_A2);
+		depthTexture = CreateTexture(GL_DEPTH_COMPONENT32F);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedoTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normalTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+		const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		glDrawBuffers(2, drawBuffers);
+
+		GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			std::cout << "Error: G-buffer incomplete (0x" << std::hex << status << std::dec << ")" << std::endl;
+			//nothing kept, or the next Resize() to this size would report the broken buffer as ready
+			Destroy();
+			return false;
+		}
+		return true;
+	}
+
+	//Makes the G-buffer the target of the geometry pass
+	void Bind() const {
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	}
+
+	//binds the attachments to the GBUFFER_*_UNIT units for the lighting pass
+	void BindTextures() const {
+		glActiveTexture(GL_TEXTURE0 + GBUFFER_ALBEDO_UNIT);
+		glBindTexture(GL_TEXTURE_2D, albedoTexture);
+		glActiveTexture(GL_TEXTURE0 + GBUFFER_NORMAL_UNIT);
+		glBindTexture(GL_TEXTURE_2D, normalTexture);
+		glActiveTexture(GL_TEXTURE0 + GBUFFER_DEPTH_UNIT);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void Destroy() {
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &albedoTexture);
+		glDeleteTextures(1, &normalTexture);
+		glDeleteTextures(1, &depthTexture);
+		fbo = albedoTexture = normalTexture = depthTexture = 0;
+		width = height = 0;
+	}
+
+private:
+	GLuint fbo;
+	GLuint albedoTexture;
+	GLuint normalTexture;
+	GLuint depthTexture;
+	int width;
+	int height;
+
+	//one immutable level, the lighting pass reads it with texelFetch so no filtering is needed
+	GLuint CreateTexture(GLenum format) const {
+		GLuint texture = 0;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return texture;
+	}
+};
+#endif
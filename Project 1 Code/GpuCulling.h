@@ -0,0 +1,430 @@
+#ifndef GPUCULLING_H
+#define GPUCULLING_H
+
+#include <GL/glew.h>
+
+#include "ProgramCache.h"
+#include "Scene.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+//most levels of detail the cull shader can pick from, matches MAX_LODS in the shader
+const unsigned int GPU_CULL_MAX_LODS = 4;
+
+//One scene row as the cull shader sees it, std430 layout
+struct GpuCullObject {
+	glm::vec4 sphere;		//world space center, radius in w
+	glm::vec4 boxMin;		//world space box, w unused
+	glm::vec4 boxMax;
+	GLuint mesh;			//index into the LOD table, GPU_CULL_MAX_LODS entries per mesh
+	GLuint lodCount;
+	GLuint pass;			//draw count the object adds to
+	GLuint commandBase;		//first command of the object's pass, where its visible commands are compacted to
+};
+
+//One LOD level of a mesh in the shared buffers, std430 layout
+struct GpuCullLod {
+	GLuint count;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint padding;
+};
+
+//Run of objects drawn with the same program, texture and index type, one indirect count draw each
+struct GpuCullPass {
+	GLuint program;
+	GLuint texture;
+	GLenum indexType;
+	unsigned int firstObject;		//objects, instances and the pass's command region all start here
+	unsigned int objectCount;
+};
+
+//Packs every row of the scene in draw order, visible or not, the GPU decides what gets drawn
+//instances[i] belongs to objects[i], so a command's baseInstance is just the object's index
+inline void BuildCullObjects(SceneTable& scene, std::vector<GpuCullObject>& objects,
+	std::vector<InstanceData>& instances, std::vector<GpuCullPass>& passes) {
+	objects.clear();
+	instances.clear();
+	passes.clear();
+	const std::vector<unsigned int>& order = scene.DrawOrder();
+	for (size_t i = 0; i < order.size(); i++) {
+		unsigned int row = order[i];
+		if (passes.empty() || passes.back().program != scene.programs[row] || passes.back().texture != scene.textures[row] ||
+			passes.back().indexType != scene.indexTypes[row]) {
+			GpuCullPass pass;
+			pass.program = scene.programs[row];
+			pass.texture = scene.textures[row];
+			pass.indexType = scene.indexTypes[row];
+			pass.firstObject = (unsigned int)i;
+			pass.objectCount = 0;
+			passes.push_back(pass);
+		}
+		passes.back().objectCount++;
+
+		GpuCullObject object;
+		object.sphere = glm::vec4(scene.worldCenterX[row], scene.worldCenterY[row], scene.worldCenterZ[row], scene.worldRadii[row]);
+		object.boxMin = glm::vec4(scene.worldMins[row], 0.0f);
+		object.boxMax = glm::vec4(scene.worldMaxs[row], 0.0f);
+		object.mesh = scene.meshes[row];
+		object.lodCount = scene.lodCounts[row];
+		object.pass = (GLuint)(passes.size() - 1);
+		object.commandBase = passes.back().firstObject;
+		objects.push_back(object);
+
+		InstanceData instance;
+		instance.model = scene.models[row];
+		instance.color = glm::vec4(scene.colors[row], scene.layers[row]);
+		instance.normalMatrix = scene.normalMatrices[row];
+		instance.mesh = scene.meshes[row];
+		instances.push_back(instance);
+	}
+}
+
+//GPU driven culling
+//A compute pass tests every object against the frustum, and optionally against a depth pyramid
+//built from the previous frame, and picks its LOD. A second pass compacts the visible commands
+//to the front of each pass's region in draw order, so the result doesn't depend on thread timing.
+//The per-pass counts stay on the GPU and go straight to glMultiDrawElementsIndirectCount, so the
+//CPU never reads back what was visible.
+class GpuCuller {
+public:
+	GpuCuller() : cullProgram(0), compactProgram(0), pyramidProgram(0), sourceLevelLocation(-1), reduceLocation(-1), objectBuffer(0),
+		lodBuffer(0), culledBuffer(0), commandBuffer(0), countBuffer(0), passBuffer(0), commandCapacity(0), passCapacity(0), depthTexture(0), pyramidTexture(0), pyramidWidth(0),
+		pyramidHeight(0), pyramidLevels(0), pyramidValid(false) {}
+
+	//true when the driver has compute shaders and indirect count draws (GL 4.6 or ARB_indirect_parameters)
+	static bool Supported() {
+		return (GLEW_VERSION_4_3 || GLEW_ARB_compute_shader) && (GLEW_VERSION_4_6 || GLEW_ARB_indirect_parameters);
+	}
+
+	//compiles the compute shaders, or loads them from cache when one is given
+	//pyramidSource can be null when occlusion culling isn't used
+	bool Create(const char* cullSource, const char* compactSource, const char* pyramidSource, ProgramCache* cache = nullptr) {
+		cullProgram = CreateComputeProgram(cullSource, cache);
+		if (cullProgram == 0) {
+			return false;
+		}
+		compactProgram = CreateComputeProgram(compactSource, cache);
+		if (compactProgram == 0) {
+			return false;
+		}
+		if (pyramidSource != nullptr) {
+			pyramidProgram = CreateComputeProgram(pyramidSource, cache);
+			if (pyramidProgram == 0) {
+				return false;
+			}
+		}
+
+		//uniform locations are looked up once here, Cull() and BuildDepthPyramid() run every frame
+		cullUniforms.objectCount = glGetUniformLocation(cullProgram, "objectCount");
+		cullUniforms.planes = glGetUniformLocation(cullProgram, "planes");
+		cullUniforms.viewZ = glGetUniformLocation(cullProgram, "viewZ");
+		cullUniforms.projectionW = glGetUniformLocation(cullProgram, "projectionW");
+		cullUniforms.lodSizes = glGetUniformLocation(cullProgram, "lodSizes");
+		cullUniforms.useOcclusion = glGetUniformLocation(cullProgram, "useOcclusion");
+		cullUniforms.pyramidViewProjection = glGetUniformLocation(cullProgram, "pyramidViewProjection");
+		cullUniforms.pyramidSize = glGetUniformLocation(cullProgram, "pyramidSize");
+		cullUniforms.pyramidLevels = glGetUniformLocation(cullProgram, "pyramidLevels");
+		//samplers never move off their unit, so they're set once too
+		glUseProgram(cullProgram);
+		glUniform1i(glGetUniformLocation(cullProgram, "depthPyramid"), PYRAMID_TEXTURE_UNIT);
+		if (pyramidProgram != 0) {
+			sourceLevelLocation = glGetUniformLocation(pyramidProgram, "sourceLevel");
+			reduceLocation = glGetUniformLocation(pyramidProgram, "reduce");
+			glUseProgram(pyramidProgram);
+			glUniform1i(glGetUniformLocation(pyramidProgram, "source"), PYRAMID_TEXTURE_UNIT);
+		}
+		glUseProgram(0);
+
+		glGenBuffers(1, &objectBuffer);
+		glGenBuffers(1, &lodBuffer);
+		glGenBuffers(1, &culledBuffer);
+		glGenBuffers(1, &commandBuffer);
+		glGenBuffers(1, &countBuffer);
+		glGenBuffers(1, &passBuffer);
+		return true;
+	}
+
+	//LOD ranges for every mesh, GPU_CULL_MAX_LODS entries per mesh, only needed once
+	void SetLods(const std::vector<GpuCullLod>& lods) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lodBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, lods.size() * sizeof(GpuCullLod), lods.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	//Writes this frame's commands and counts, objects are only re-uploaded when one of them changed
+	//screenSizes are the LOD thresholds SceneTable::SelectLods() uses, MAX_LODS - 1 of them
+	void Cull(const std::vector<GpuCullObject>& objects, size_t passCount, const Frustum& frustum,
+		const glm::mat4& view, const glm::mat4& projection, const float* screenSizes, bool occlusion) {
+		if (objects.size() != uploadedObjects.size() ||
+			(!objects.empty() && memcmp(objects.data(), uploadedObjects.data(), objects.size() * sizeof(GpuCullObject)) != 0)) {
+			uploadedObjects = objects;
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, objectBuffer);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, objects.size() * sizeof(GpuCullObject), objects.data(), GL_DYNAMIC_DRAW);
+			//each pass's object range for the compaction, the objects are packed pass by pass
+			std::vector<GLuint> ranges(passCount * 2, 0);
+			for (size_t i = 0; i < objects.size(); i++) {
+				ranges[objects[i].pass * 2] = objects[i].commandBase;
+				ranges[objects[i].pass * 2 + 1]++;
+			}
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, passBuffer);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, ranges.size() * sizeof(GLuint), ranges.data(), GL_DYNAMIC_DRAW);
+		}
+		//one command slot per object in both buffers, a pass never writes past its own objects
+		if (objects.size() > commandCapacity) {
+			commandCapacity = objects.size() * 2;
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, culledBuffer);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, commandCapacity * sizeof(DrawCommand), NULL, GL_DYNAMIC_DRAW);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+			glBufferData(GL_DRAW_INDIRECT_BUFFER, commandCapacity * sizeof(DrawCommand), NULL, GL_DYNAMIC_DRAW);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		}
+		//the compaction writes every pass's count, nothing to clear
+		if (passCount > passCapacity) {
+			passCapacity = passCount;
+			glBindBuffer(GL_PARAMETER_BUFFER_ARB, countBuffer);
+			glBufferData(GL_PARAMETER_BUFFER_ARB, passCount * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+			glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+		}
+		if (objects.empty()) {
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+			return;
+		}
+
+		glUseProgram(cullProgram);
+		glUniform1ui(cullUniforms.objectCount, (GLuint)objects.size());
+		glm::vec4 planes[6];
+		for (int p = 0; p < 6; p++) {
+			planes[p] = glm::vec4(frustum.a[p], frustum.b[p], frustum.c[p], frustum.d[p]);
+		}
+		glUniform4fv(cullUniforms.planes, 6, glm::value_ptr(planes[0]));
+		//same projected size estimate as SelectLods(), row 2 of the view gives depth
+		glm::vec4 viewZ(view[0][2], view[1][2], view[2][2], view[3][2]);
+		glUniform4fv(cullUniforms.viewZ, 1, glm::value_ptr(viewZ));
+		glUniform3f(cullUniforms.projectionW, projection[2][3], projection[3][3], projection[1][1]);
+		glUniform3fv(cullUniforms.lodSizes, 1, screenSizes);
+
+		//occlusion against last frame's depth, tested with the matrix that depth was drawn with
+		bool useOcclusion = occlusion && pyramidValid;
+		glUniform1i(cullUniforms.useOcclusion, useOcclusion ? 1 : 0);
+		if (useOcclusion) {
+			glUniformMatrix4fv(cullUniforms.pyramidViewProjection, 1, GL_FALSE, glm::value_ptr(pyramidViewProjection));
+			glUniform2f(cullUniforms.pyramidSize, (float)pyramidWidth, (float)pyramidHeight);
+			glUniform1i(cullUniforms.pyramidLevels, pyramidLevels);
+			glActiveTexture(GL_TEXTURE0 + PYRAMID_TEXTURE_UNIT);
+			glBindTexture(GL_TEXTURE_2D, pyramidTexture);
+			glActiveTexture(GL_TEXTURE0);
+		}
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, objectBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, lodBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, culledBuffer);
+		glDispatchCompute((GLuint)((objects.size() + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE), 1, 1);
+		//the compaction reads what the cull pass wrote
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		glUseProgram(compactProgram);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, passBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, culledBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, commandBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, countBuffer);
+		glDispatchCompute((GLuint)passCount, 1, 1);
+		//draws read the commands and counts as indirect parameters
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	//Draws one pass from the commands Cull() wrote, the caller binds the program, texture and vao
+	void Draw(const GpuCullPass& pass, GLuint passIndex) {
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+		glBindBuffer(GL_PARAMETER_BUFFER_ARB, countBuffer);
+		const void* commands = (const void*)(pass.firstObject * sizeof(DrawCommand));
+		GLintptr count = passIndex * sizeof(GLuint);
+		//same entry point under its core and extension names
+		if (GLEW_VERSION_4_6) {
+			glMultiDrawElementsIndirectCount(GL_TRIANGLES, pass.indexType, commands, count, pass.objectCount, 0);
+		}
+		else {
+			glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, pass.indexType, commands, count, pass.objectCount, 0);
+		}
+		glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+
+	//Copies the depth of the frame just drawn from the read framebuffer and reduces it to a
+	//max depth pyramid for next frame's occlusion test, viewProjection is what the frame used
+	void BuildDepthPyramid(int width, int height, const glm::mat4& viewProjection) {
+		if (pyramidProgram == 0) {
+			return;
+		}
+		if (width != pyramidWidth || height != pyramidHeight) {
+			CreatePyramid(width, height);
+		}
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glUseProgram(pyramidProgram);
+		int levelWidth = width;
+		int levelHeight = height;
+		for (int level = 0; level < pyramidLevels; level++) {
+			//level 0 copies the depth texture, every later level takes the max of the one above
+			glActiveTexture(GL_TEXTURE0 + PYRAMID_TEXTURE_UNIT);
+			glBindTexture(GL_TEXTURE_2D, level == 0 ? depthTexture : pyramidTexture);
+			glActiveTexture(GL_TEXTURE0);
+			glUniform1i(sourceLevelLocation, level == 0 ? 0 : level - 1);
+			glUniform1i(reduceLocation, level == 0 ? 0 : 1);
+			glBindImageTexture(0, pyramidTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+			glDispatchCompute((levelWidth + PYRAMID_GROUP_SIZE - 1) / PYRAMID_GROUP_SIZE,
+				(levelHeight + PYRAMID_GROUP_SIZE - 1) / PYRAMID_GROUP_SIZE, 1);
+			//next level samples this one
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+			levelWidth = levelWidth > 1 ? levelWidth / 2 : 1;
+			levelHeight = levelHeight > 1 ? levelHeight / 2 : 1;
+		}
+		glActiveTexture(GL_TEXTURE0 + PYRAMID_TEXTURE_UNIT);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glActiveTexture(GL_TEXTURE0);
+		pyramidViewProjection = viewProjection;
+		pyramidValid = true;
+	}
+
+	void Destroy() {
+		glDeleteProgram(cullProgram);
+		glDeleteProgram(compactProgram);
+		glDeleteProgram(pyramidProgram);
+		glDeleteBuffers(1, &objectBuffer);
+		glDeleteBuffers(1, &lodBuffer);
+		glDeleteBuffers(1, &culledBuffer);
+		glDeleteBuffers(1, &commandBuffer);
+		glDeleteBuffers(1, &countBuffer);
+		glDeleteBuffers(1, &passBuffer);
+		glDeleteTextures(1, &depthTexture);
+		glDeleteTextures(1, &pyramidTexture);
+		cullProgram = compactProgram = pyramidProgram = 0;
+		objectBuffer = lodBuffer = culledBuffer = commandBuffer = countBuffer = passBuffer = 0;
+		depthTexture = pyramidTexture = 0;
+		commandCapacity = passCapacity = 0;
+		uploadedObjects.clear();
+		pyramidWidth = pyramidHeight = pyramidLevels = 0;
+		pyramidValid = false;
+	}
+
+private:
+	//work group sizes, match local_size in the shaders
+	static const unsigned int CULL_GROUP_SIZE = 64;
+	static const int PYRAMID_GROUP_SIZE = 8;
+	//unit the depth textures are bound to while the compute passes run, clear of the scene's unit 0
+	static const int PYRAMID_TEXTURE_UNIT = 1;
+
+	//locations of the cull shader's per-frame uniforms
+	struct CullUniforms {
+		GLint objectCount;
+		GLint planes;
+		GLint viewZ;
+		GLint projectionW;
+		GLint lodSizes;
+		GLint useOcclusion;
+		GLint pyramidViewProjection;
+		GLint pyramidSize;
+		GLint pyramidLevels;
+	};
+
+	GLuint cullProgram;
+	GLuint compactProgram;
+	GLuint pyramidProgram;
+	CullUniforms cullUniforms;
+	GLint sourceLevelLocation;
+	GLint reduceLocation;
+	GLuint objectBuffer;
+	GLuint lodBuffer;
+	GLuint culledBuffer;		//every object's command, no instances when it was culled
+	GLuint commandBuffer;		//the visible ones compacted, what the draws read
+	GLuint countBuffer;
+	GLuint passBuffer;			//first object and object count of each pass
+	size_t commandCapacity;
+	size_t passCapacity;
+	std::vector<GpuCullObject> uploadedObjects;
+	//occlusion
+	GLuint depthTexture;
+	GLuint pyramidTexture;
+	int pyramidWidth;
+	int pyramidHeight;
+	int pyramidLevels;
+	bool pyramidValid;
+	glm::mat4 pyramidViewProjection;
+
+	void CreatePyramid(int width, int height) {
+		glDeleteTextures(1, &depthTexture);
+		glDeleteTextures(1, &pyramidTexture);
+		pyramidWidth = width;
+		pyramidHeight = height;
+		pyramidLevels = 1;
+		while ((width >> pyramidLevels) > 0 || (height >> pyramidLevels) > 0) {
+			pyramidLevels++;
+		}
+
+		glGenTextures(1, &depthTexture);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, width, height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		glGenTextures(1, &pyramidTexture);
+		glBindTexture(GL_TEXTURE_2D, pyramidTexture);
+		glTexStorage2D(GL_TEXTURE_2D, pyramidLevels, GL_R32F, width, height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		pyramidValid = false;
+	}
+
+	//compiles and links one compute shader, 0 on failure with the log printed
+	static GLuint CreateComputeProgram(const char* source, ProgramCache* cache) {
+		uint32_t key = cache != nullptr ? cache->Key(&source, 1) : 0;
+		if (cache != nullptr) {
+			GLuint cached = cache->Load(key);
+			if (cached != 0) {
+				return cached;
+			}
+		}
+		GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+		glShaderSource(shader, 1, &source, NULL);
+		glCompileShader(shader);
+		int success = 0;
+		char infoLog[512];
+		glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+		if (!success) {
+			glGetShaderInfoLog(shader, sizeof(infoLog), NULL, infoLog);
+			std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n" << infoLog << std::endl;
+			glDeleteShader(shader);
+			return 0;
+		}
+		GLuint program = glCreateProgram();
+		glAttachShader(program, shader);
+		if (cache != nullptr) {
+			cache->PrepareLink(program);
+		}
+		glLinkProgram(program);
+		glDeleteShader(shader);
+		glGetProgramiv(program, GL_LINK_STATUS, &success);
+		if (!success) {
+			glGetProgramInfoLog(program, sizeof(infoLog), NULL, infoLog);
+			std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+			glDeleteProgram(program);
+			return 0;
+		}
+		if (cache != nullptr) {
+			cache->Save(program, key);
+		}
+		return program;
+	}
+};
+#endif
@@ -0,0 +1,336 @@
+#ifndef LIGHTCLUSTERS_H
+#define LIGHTCLUSTERS_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+//cluster grid, tiles across and down the screen and slices through the depth range
+//matches the counts ClusterData hands the fragment shader
+const unsigned int CLUSTER_TILES_X = 16;
+const unsigned int CLUSTER_TILES_Y = 12;
+const unsigned int CLUSTER_SLICES = 24;
+const unsigned int CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+
+//binding points of the light buffers, clear of the ones GpuCuller's compute passes use
+const GLuint CLUSTER_UBO_BINDING = 2;
+const GLuint CLUSTER_LIGHT_BINDING = 4;
+const GLuint CLUSTER_CELL_BINDING = 5;
+const GLuint CLUSTER_INDEX_BINDING = 6;
+
+//One point light as the shaders read it, std430 layout
+struct ClusterLight {
+	glm::vec4 positionRange;	//world space position, w is the distance the light reaches
+	glm::vec4 color;			//rgb, a unused
+};
+
+//Per-frame grid parameters, layout matches ClusterData in the shaders (std140)
+struct ClusterData {
+	GLuint gridSize[4];			//tiles across, tiles down, depth slices, lights
+	glm::vec4 sliceScale;		//xy pixels to tiles, z and w turn log(view depth) into a slice
+};
+
+//Clustered light culling for forward+ shading
+//Every light's sphere is binned into the screen tile x depth slice clusters it touches, each cluster
+//keeps a range of the index list naming its lights, so a fragment only loops over the lights near it.
+//Slices are spaced exponentially between the near and far planes so they stay roughly cube shaped.
+//Lights are kept as columns like SceneTable so the view transform runs as one branch free loop
+class LightClusters {
+public:
+	//columns, one entry per light
+	std::vector<float> positionX;
+	std::vector<float> positionY;
+	std::vector<float> positionZ;
+	std::vector<float> ranges;
+	std::vector<glm::vec3> colors;
+
+	//light references written by the last Build(), a light in several clusters counts once per cluster
+	size_t lightReferences;
+
+	LightClusters() : lightReferences(0), clusterUbo(0), lightBuffer(0), cellBuffer(0), indexBuffer(0),
+		boundsWidth(0), boundsHeight(0), boundsNear(0.0f), boundsFar(0.0f), boundsProjection(0.0f),
+		emptyUploaded(false), uploadedWidth(0), uploadedHeight(0) {}
+
+	unsigned int AddLight(glm::vec3 position, glm::vec3 color, float range) {
+		positionX.push_back(position.x);
+		positionY.push_back(position.y);
+		positionZ.push_back(position.z);
+		ranges.push_back(range);
+		colors.push_back(color);
+		return (unsigned int)(ranges.size() - 1);
+	}
+
+	void SetPosition(unsigned int light, glm::vec3 position) {
+		positionX[light] = position.x;
+		positionY[light] = position.y;
+		positionZ[light] = position.z;
+	}
+
+	size_t Size() const {
+		return ranges.size();
+	}
+
+	void Create() {
+		glGenBuffers(1, &clusterUbo);
+		glGenBuffers(1, &lightBuffer);
+		glGenBuffers(1, &cellBuffer);
+		glGenBuffers(1, &indexBuffer);
+	}
+
+	//Bins every light for this frame's camera and uploads the grid
+	//width and height are the viewport's, nearPlane and farPlane the projection's
+	void Build(const glm::mat4& view, const glm::mat4& projection, int width, int height,
+		float nearPlane, float farPlane) {
+		if (width != boundsWidth || height != boundsHeight || nearPlane != boundsNear || farPlane != boundsFar ||
+			projection != boundsProjection) {
+			BuildClusterBounds(projection, width, height, nearPlane, farPlane);
+		}
+		size_t count = ranges.size();
+		//an empty grid only has to go up once per viewport
+		if (count == 0 && emptyUploaded && width == uploadedWidth && height == uploadedHeight) {
+			lightReferences = 0;
+			return;
+		}
+		float logRatio = std::log(farPlane / nearPlane);
+		float sliceScale = (float)CLUSTER_SLICES / logRatio;
+		float sliceBias = -(float)CLUSTER_SLICES * std::log(nearPlane) / logRatio;
+
+		//view space centers, one pass over the columns
+		viewX.resize(count);
+		viewY.resize(count);
+		viewZ.resize(count);
+		const float* px = positionX.data();
+		const float* py = positionY.data();
+		const float* pz = positionZ.data();
+		for (size_t i = 0; i < count; i++) {
+			viewX[i] = view[0][0] * px[i] + view[1][0] * py[i] + view[2][0] * pz[i] + view[3][0];
+			viewY[i] = view[0][1] * px[i] + view[1][1] * py[i] + view[2][1] * pz[i] + view[3][1];
+			viewZ[i] = view[0][2] * px[i] + view[1][2] * py[i] + view[2][2] * pz[i] + view[3][2];
+		}
+
+		//cluster and light of every overlap, in light order
+		pairClusters.clear();
+		pairLights.clear();
+		for (size_t i = 0; i < count; i++) {
+			float radius = ranges[i];
+			float depth = -viewZ[i];
+			if (depth + radius < nearPlane || depth - radius > farPlane) {
+				continue;
+			}
+			//slices covered by the sphere's depth range
+			unsigned int firstSlice = Slice(std::max(depth - radius, nearPlane), sliceScale, sliceBias);
+			unsigned int lastSlice = Slice(std::min(depth + radius, farPlane), sliceScale, sliceBias);
+
+			//tiles under the projected box around the sphere, the whole screen when it reaches the near plane
+			unsigned int firstX = 0, lastX = CLUSTER_TILES_X - 1, firstY = 0, lastY = CLUSTER_TILES_Y - 1;
+			if (depth - radius > nearPlane) {
+				glm::vec2 ndcMin(1.0f), ndcMax(-1.0f);
+				for (int c = 0; c < 8; c++) {
+					glm::vec4 corner(viewX[i] + ((c & 1) ? radius : -radius), viewY[i] + ((c & 2) ? radius : -radius),
+						viewZ[i] + ((c & 4) ? radius : -radius), 1.0f);
+					glm::vec4 clip = projection * corner;
+					glm::vec2 ndc(clip.x / clip.w, clip.y / clip.w);
+					ndcMin = glm::min(ndcMin, ndc);
+					ndcMax = glm::max(ndcMax, ndc);
+				}
+				if (ndcMax.x < -1.0f || ndcMin.x > 1.0f || ndcMax.y < -1.0f || ndcMin.y > 1.0f) {
+					continue;
+				}
+				firstX = Tile(ndcMin.x, CLUSTER_TILES_X);
+				lastX = Tile(ndcMax.x, CLUSTER_TILES_X);
+				firstY = Tile(ndcMin.y, CLUSTER_TILES_Y);
+				lastY = Tile(ndcMax.y, CLUSTER_TILES_Y);
+			}
+
+			//each candidate cluster's box against the sphere, the rectangle alone is loose at the corners
+			for (unsigned int z = firstSlice; z <= lastSlice; z++) {
+				for (unsigned int y = firstY; y <= lastY; y++) {
+					for (unsigned int x = firstX; x <= lastX; x++) {
+						unsigned int cluster = (z * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x;
+						glm::vec3 center(viewX[i], viewY[i], viewZ[i]);
+						glm::vec3 closest = glm::clamp(center, clusterMins[cluster], clusterMaxs[cluster]);
+						glm::vec3 offset = closest - center;
+						if (glm::dot(offset, offset) <= radius * radius) {
+							pairClusters.push_back(cluster);
+							pairLights.push_back((GLuint)i);
+						}
+					}
+				}
+			}
+		}
+
+		//counting sort of the overlaps by cluster, each cell is an offset and count into the index list
+		cells.assign(CLUSTER_COUNT * 2, 0);
+		for (size_t p = 0; p < pairClusters.size(); p++) {
+			cells[pairClusters[p] * 2 + 1]++;
+		}
+		GLuint offset = 0;
+		for (unsigned int cluster = 0; cluster < CLUSTER_COUNT; cluster++) {
+			cells[cluster * 2] = offset;
+			offset += cells[cluster * 2 + 1];
+		}
+		indices.resize(pairLights.size());
+		fill.assign(CLUSTER_COUNT, 0);
+		for (size_t p = 0; p < pairClusters.size(); p++) {
+			unsigned int cluster = pairClusters[p];
+			indices[cells[cluster * 2] + fill[cluster]++] = pairLights[p];
+		}
+		lightReferences = indices.size();
+
+		lights.resize(count);
+		for (size_t i = 0; i < count; i++) {
+			lights[i].positionRange = glm::vec4(positionX[i], positionY[i], positionZ[i], ranges[i]);
+			lights[i].color = glm::vec4(colors[i], 0.0f);
+		}
+		ClusterData data;
+		data.gridSize[0] = CLUSTER_TILES_X;
+		data.gridSize[1] = CLUSTER_TILES_Y;
+		data.gridSize[2] = CLUSTER_SLICES;
+		data.gridSize[3] = (GLuint)count;
+		data.sliceScale = glm::vec4((float)CLUSTER_TILES_X / (float)width, (float)CLUSTER_TILES_Y / (float)height,
+			sliceScale, sliceBias);
+		Upload(data);
+		emptyUploaded = count == 0;
+		uploadedWidth = width;
+		uploadedHeight = height;
+	}
+
+	//binds the grid to the points the shaders read it from
+	void Bind() const {
+		glBindBufferBase(GL_UNIFORM_BUFFER, CLUSTER_UBO_BINDING, clusterUbo);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHT_BINDING, lightBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_CELL_BINDING, cellBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDEX_BINDING, indexBuffer);
+	}
+
+	void Destroy() {
+		glDeleteBuffers(1, &clusterUbo);
+		glDeleteBuffers(1, &lightBuffer);
+		glDeleteBuffers(1, &cellBuffer);
+		glDeleteBuffers(1, &indexBuffer);
+		clusterUbo = lightBuffer = cellBuffer = indexBuffer = 0;
+	}
+
+	void Clear() {
+		positionX.clear();
+		positionY.clear();
+		positionZ.clear();
+		ranges.clear();
+		colors.clear();
+		lightReferences = 0;
+	}
+
+private:
+	GLuint clusterUbo;
+	GLuint lightBuffer;
+	GLuint cellBuffer;
+	GLuint indexBuffer;
+	//view space box of every cluster, only rebuilt when the projection or viewport changes
+	std::vector<glm::vec3> clusterMins;
+	std::vector<glm::vec3> clusterMaxs;
+	int boundsWidth;
+	int boundsHeight;
+	float boundsNear;
+	float boundsFar;
+	glm::mat4 boundsProjection;
+	bool emptyUploaded;
+	int uploadedWidth;
+	int uploadedHeight;
+	//per-frame working space, kept to avoid reallocating
+	std::vector<float> viewX;
+	std::vector<float> viewY;
+	std::vector<float> viewZ;
+	std::vector<unsigned int> pairClusters;
+	std::vector<GLuint> pairLights;
+	std::vector<GLuint> fill;
+	//what goes to the GPU
+	std::vector<ClusterLight> lights;
+	std::vector<GLuint> cells;
+	std::vector<GLuint> indices;
+
+	static unsigned int Slice(float depth, float sliceScale, float sliceBias) {
+		float slice = std::log(depth) * sliceScale + sliceBias;
+		return (unsigned int)std::min(std::max(slice, 0.0f), (float)(CLUSTER_SLICES - 1));
+	}
+
+	static unsigned int Tile(float ndc, unsigned int tiles) {
+		float tile = (ndc * 0.5f + 0.5f) * (float)tiles;
+		return (unsigned int)std::min(std::max(tile, 0.0f), (float)(tiles - 1));
+	}
+
+	//Each cluster's box from the rays through its tile's corners, cut at its slice's depths
+	//a ray is the line between a corner on the near and far planes, so orthographic works too
+	void BuildClusterBounds(const glm::mat4& projection, int width, int height, float nearPlane, float farPlane) {
+		boundsWidth = width;
+		boundsHeight = height;
+		boundsNear = nearPlane;
+		boundsFar = farPlane;
+		boundsProjection = projection;
+		clusterMins.resize(CLUSTER_COUNT);
+		clusterMaxs.resize(CLUSTER_COUNT);
+		glm::mat4 inverseProjection = glm::inverse(projection);
+
+		//view space points of every tile corner on the near and far planes
+		std::vector<glm::vec3> nearCorners((CLUSTER_TILES_X + 1) * (CLUSTER_TILES_Y + 1));
+		std::vector<glm::vec3> farCorners(nearCorners.size());
+		for (unsigned int y = 0; y <= CLUSTER_TILES_Y; y++) {
+			for (unsigned int x = 0; x <= CLUSTER_TILES_X; x++) {
+				float ndcX = (float)x / CLUSTER_TILES_X * 2.0f - 1.0f;
+				float ndcY = (float)y / CLUSTER_TILES_Y * 2.0f - 1.0f;
+				glm::vec4 a = inverseProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+				glm::vec4 b = inverseProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+				nearCorners[y * (CLUSTER_TILES_X + 1) + x] = glm::vec3(a) / a.w;
+				farCorners[y * (CLUSTER_TILES_X + 1) + x] = glm::vec3(b) / b.w;
+			}
+		}
+
+		for (unsigned int z = 0; z < CLUSTER_SLICES; z++) {
+			float sliceNear = nearPlane * std::pow(farPlane / nearPlane, (float)z / CLUSTER_SLICES);
+			float sliceFar = nearPlane * std::pow(farPlane / nearPlane, (float)(z + 1) / CLUSTER_SLICES);
+			for (unsigned int y = 0; y < CLUSTER_TILES_Y; y++) {
+				for (unsigned int x = 0; x < CLUSTER_TILES_X; x++) {
+					glm::vec3 low(1.0e30f), high(-1.0e30f);
+					for (int c = 0; c < 4; c++) {
+						unsigned int corner = (y + (c >> 1)) * (CLUSTER_TILES_X + 1) + x + (c & 1);
+						glm::vec3 a = nearCorners[corner];
+						glm::vec3 b = farCorners[corner];
+						//where the ray reaches each of the slice's depths, depth runs down -z
+						float tNear = (-sliceNear - a.z) / (b.z - a.z);
+						float tFar = (-sliceFar - a.z) / (b.z - a.z);
+						glm::vec3 pointNear = a + (b - a) * tNear;
+						glm::vec3 pointFar = a + (b - a) * tFar;
+						low = glm::min(low, glm::min(pointNear, pointFar));
+						high = glm::max(high, glm::max(pointNear, pointFar));
+					}
+					unsigned int cluster = (z * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x;
+					clusterMins[cluster] = low;
+					clusterMaxs[cluster] = high;
+				}
+			}
+		}
+	}
+
+	//whole buffers are replaced every frame, their sizes follow the light count
+	void Upload(const ClusterData& data) {
+		glBindBuffer(GL_UNIFORM_BUFFER, clusterUbo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(ClusterData), &data, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		//empty buffers still get one element, a zero sized binding is an error
+		ClusterLight noLight = { glm::vec4(0.0f), glm::vec4(0.0f) };
+		GLuint noIndex = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(lights.size(), (size_t)1) * sizeof(ClusterLight),
+			lights.empty() ? &noLight : lights.data(), GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, cellBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, cells.size() * sizeof(GLuint), cells.data(), GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, indexBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(indices.size(), (size_t)1) * sizeof(GLuint),
+			indices.empty() ? &noIndex : indices.data(), GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+};
+#endif
@@ -0,0 +1,290 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <GL/glew.h>
+
+#include "MeshGen.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//Binary mesh cache file
+//	header | vertex block | index block | LOD table
+//Blocks start on 16 byte boundaries and hold exactly what goes to the GPU: interleaved
+//position/normal/uv floats, packed 16 or 32 bit indices and MeshLod ranges, so loading is a map and a copy
+//Everything is stored after MeshOptimizer has reordered it, a cache hit skips that pass too
+const char MESH_CACHE_MAGIC[4] = { 'S', 'M', 'S', 'H' };
+const uint32_t MESH_CACHE_VERSION = 3;
+
+struct MeshCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t key;				//hash of the inputs the mesh was generated from, see MeshCacheKey()
+	uint32_t floatsPerVertex;
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	uint32_t indexSize;			//bytes per index, 2 or 4 as MeshBuilder::IndexType() picked
+	uint32_t lodCount;
+	float boundsMin[3];
+	float boundsMax[3];
+	uint64_t vertexOffset;		//byte offsets from the start of the file
+	uint64_t indexOffset;
+	uint64_t lodOffset;
+};
+
+//FNV-1a over raw bytes, chain calls by passing the previous result as the seed
+inline uint32_t MeshCacheKey(const void* data, size_t bytes, uint32_t seed = 2166136261u) {
+	const unsigned char* bytePtr = (const unsigned char*)data;
+	uint32_t hash = seed;
+	for (size_t i = 0; i < bytes; i++) {
+		hash ^= bytePtr[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+//zero fill from the current position up to the next block
+inline bool WriteMeshCachePadding(FILE* file, uint64_t position, uint64_t blockStart) {
+	const unsigned char padding[16] = { 0 };
+	size_t count = (size_t)(blockStart - position);
+	return fwrite(padding, 1, count, file) == count;
+}
+
+//Writes a builder's buffers as a cache file, returns false if the file can't be written
+inline bool WriteMeshCache(const char* fileName, uint32_t key, const MeshBuilder& builder) {
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+	header.version = MESH_CACHE_VERSION;
+	header.key = key;
+	header.floatsPerVertex = FLOATS_PER_VERTEX;
+	header.vertexCount = (uint32_t)builder.VertexCount();
+	//indices go in exactly as they're uploaded, already narrowed and rebased per level
+	std::vector<unsigned char> packedIndices;
+	std::vector<MeshLod> ranges;
+	GLenum indexType = builder.PackIndices(packedIndices, ranges);
+	header.indexCount = (uint32_t)builder.indices.size();
+	header.indexSize = indexType == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort);
+	header.lodCount = (uint32_t)ranges.size();
+	glm::vec3 boundsMin, boundsMax;
+	builder.GetBounds(boundsMin, boundsMax);
+	for (int i = 0; i < 3; i++) {
+		header.boundsMin[i] = boundsMin[i];
+		header.boundsMax[i] = boundsMax[i];
+	}
+
+	//each block padded out to 16 bytes
+	size_t vertexBytes = builder.vertices.size() * sizeof(GLfloat);
+	size_t indexBytes = packedIndices.size();
+	header.vertexOffset = (sizeof(header) + 15) & ~(uint64_t)15;
+	header.indexOffset = (header.vertexOffset + vertexBytes + 15) & ~(uint64_t)15;
+	header.lodOffset = (header.indexOffset + indexBytes + 15) & ~(uint64_t)15;
+
+	FILE* file = fopen(fileName, "wb");
+	if (file == NULL) {
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && WriteMeshCachePadding(file, sizeof(header), header.vertexOffset);
+	ok = ok && fwrite(builder.vertices.data(), 1, vertexBytes, file) == vertexBytes;
+	ok = ok && WriteMeshCachePadding(file, header.vertexOffset + vertexBytes, header.indexOffset);
+	ok = ok && fwrite(packedIndices.data(), 1, indexBytes, file) == indexBytes;
+	ok = ok && WriteMeshCachePadding(file, header.indexOffset + indexBytes, header.lodOffset);
+	ok = ok && fwrite(ranges.data(), sizeof(MeshLod), ranges.size(), file) == ranges.size();
+	fclose(file);
+	if (!ok) {
+		remove(fileName);
+	}
+	return ok;
+}
+
+//Read-only memory map of a whole file
+class MappedFile {
+public:
+	MappedFile() : data(nullptr), size(0) {
+#ifdef _WIN32
+		file = INVALID_HANDLE_VALUE;
+		mapping = NULL;
+#endif
+	}
+
+	~MappedFile() {
+		Close();
+	}
+
+	bool Open(const char* fileName) {
+		Close();
+#ifdef _WIN32
+		file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+			Close();
+			return false;
+		}
+		size = (size_t)fileSize.QuadPart;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) {
+			Close();
+			return false;
+		}
+		data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		int fd = open(fileName, O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0) {
+			close(fd);
+			return false;
+		}
+		size = (size_t)info.st_size;
+		void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		//the mapping keeps the file alive on its own
+		close(fd);
+		data = mapped != MAP_FAILED ? (const unsigned char*)mapped : nullptr;
+		if (data != nullptr) {
+			//whole file is about to be read, start paging it in now
+			madvise(mapped, size, MADV_WILLNEED);
+		}
+#endif
+		if (data == nullptr) {
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close() {
+#ifdef _WIN32
+		if (data != nullptr) {
+			UnmapViewOfFile(data);
+		}
+		if (mapping != NULL) {
+			CloseHandle(mapping);
+			mapping = NULL;
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+			file = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (data != nullptr) {
+			munmap((void*)data, size);
+		}
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	const unsigned char* Data() const {
+		return data;
+	}
+
+	size_t Size() const {
+		return size;
+	}
+
+private:
+	const unsigned char* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+
+	//owns the mapping, so no copies
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
+
+//Mapped cache file, the accessors point straight into the mapped pages
+class MeshCacheFile {
+public:
+	const MeshCacheHeader* header;
+
+	MeshCacheFile() : header(nullptr) {}
+
+	//maps the file and checks it fits this build and the given key, false means regenerate
+	bool Open(const char* fileName, uint32_t key) {
+		header = nullptr;
+		if (!file.Open(fileName)) {
+			return false;
+		}
+		const MeshCacheHeader* candidate = (const MeshCacheHeader*)file.Data();
+		if (file.Size() < sizeof(MeshCacheHeader) ||
+			memcmp(candidate->magic, MESH_CACHE_MAGIC, sizeof(candidate->magic)) != 0 ||
+			candidate->version != MESH_CACHE_VERSION || candidate->key != key ||
+			candidate->floatsPerVertex != FLOATS_PER_VERTEX ||
+			(candidate->indexSize != sizeof(GLushort) && candidate->indexSize != sizeof(GLuint))) {
+			file.Close();
+			return false;
+		}
+		//every block has to lie inside the file
+		uint64_t vertexEnd = candidate->vertexOffset + (uint64_t)candidate->vertexCount * FLOATS_PER_VERTEX * sizeof(GLfloat);
+		uint64_t indexEnd = candidate->indexOffset + (uint64_t)candidate->indexCount * candidate->indexSize;
+		uint64_t lodEnd = candidate->lodOffset + (uint64_t)candidate->lodCount * sizeof(MeshLod);
+		if (vertexEnd > file.Size() || indexEnd > file.Size() || lodEnd > file.Size()) {
+			std::cout << "Mesh cache " << fileName << " is truncated" << std::endl;
+			file.Close();
+			return false;
+		}
+		header = candidate;
+		return true;
+	}
+
+	void Close() {
+		header = nullptr;
+		file.Close();
+	}
+
+	const GLfloat* Vertices() const {
+		return (const GLfloat*)(file.Data() + header->vertexOffset);
+	}
+
+	//indexCount indices, each IndexType() wide
+	const void* Indices() const {
+		return file.Data() + header->indexOffset;
+	}
+
+	GLenum IndexType() const {
+		return header->indexSize == sizeof(GLuint) ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+	}
+
+	const MeshLod* Lods() const {
+		return (const MeshLod*)(file.Data() + header->lodOffset);
+	}
+
+	size_t VertexBytes() const {
+		return (size_t)header->vertexCount * FLOATS_PER_VERTEX * sizeof(GLfloat);
+	}
+
+	size_t IndexBytes() const {
+		return (size_t)header->indexCount * header->indexSize;
+	}
+
+private:
+	MappedFile file;
+};
+#endif
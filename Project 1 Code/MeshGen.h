@@ -0,0 +1,441 @@
+#ifndef MESHGEN_H
+#define MESHGEN_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <vector>
+
+//Vertex layout shared by every mesh: position, normal, texture coordinate
+const unsigned int FLOATS_PER_POSITION = 3;
+const unsigned int FLOATS_PER_NORMAL = 3;
+const unsigned int FLOATS_PER_UV = 2;
+const unsigned int FLOATS_PER_VERTEX = FLOATS_PER_POSITION + FLOATS_PER_NORMAL + FLOATS_PER_UV;
+
+//Packed layout, 16 bytes instead of 32, decoded in the vertex shader
+//position: unsigned normalized 16 bit across the mesh's bounds, the mesh's offset and scale turn it back
+//normal: octahedral encoding in two signed normalized 16 bit values
+//uv: unsigned normalized 16 bit, the generated and hand-written meshes all keep uvs inside 0-1
+struct PackedVertex {
+	GLushort position[3];
+	GLushort padding;		//keeps the normal 4 byte aligned
+	GLshort normal[2];
+	GLushort uv[2];
+};
+
+//0-1 to a 16 bit unsigned normalized value, clamped
+inline GLushort PackUnorm16(float value) {
+	value = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+	return (GLushort)(value * 65535.0f + 0.5f);
+}
+
+//-1-1 to a 16 bit signed normalized value, clamped
+inline GLshort PackSnorm16(float value) {
+	value = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+	return (GLshort)std::floor(value * 32767.0f + 0.5f);
+}
+
+//Unit vector onto the octahedron and folded into the -1-1 square, the vertex shader undoes the fold
+inline glm::vec2 OctahedralEncode(glm::vec3 normal) {
+	float sum = std::fabs(normal.x) + std::fabs(normal.y) + std::fabs(normal.z);
+	glm::vec2 encoded = sum > 0.0f ? glm::vec2(normal.x, normal.y) / sum : glm::vec2(0.0f);
+	if (normal.z < 0.0f) {
+		glm::vec2 folded(1.0f - std::fabs(encoded.y), 1.0f - std::fabs(encoded.x));
+		encoded.x = encoded.x >= 0.0f ? folded.x : -folded.x;
+		encoded.y = encoded.y >= 0.0f ? folded.y : -folded.y;
+	}
+	return encoded;
+}
+
+//Packs interleaved float vertices, positions relative to boundsMin over boundsMax - boundsMin
+inline void PackVertices(const GLfloat* vertices, size_t vertexCount, glm::vec3 boundsMin, glm::vec3 boundsMax,
+	PackedVertex* packed) {
+	glm::vec3 extent = boundsMax - boundsMin;
+	//flat axes (the plane's y) have nothing to spread across
+	glm::vec3 inverseExtent(extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+		extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+	for (size_t v = 0; v < vertexCount; v++) {
+		const GLfloat* source = vertices + v * FLOATS_PER_VERTEX;
+		glm::vec3 position = (glm::vec3(source[0], source[1], source[2]) - boundsMin) * inverseExtent;
+		glm::vec2 normal = OctahedralEncode(glm::vec3(source[3], source[4], source[5]));
+		PackedVertex& out = packed[v];
+		out.position[0] = PackUnorm16(position.x);
+		out.position[1] = PackUnorm16(position.y);
+		out.position[2] = PackUnorm16(position.z);
+		out.padding = 0;
+		out.normal[0] = PackSnorm16(normal.x);
+		out.normal[1] = PackSnorm16(normal.y);
+		out.uv[0] = PackUnorm16(source[6]);
+		out.uv[1] = PackUnorm16(source[7]);
+	}
+}
+
+//most vertices a 16 bit index can reach from its base vertex
+const size_t MAX_SHORT_INDEX_VERTICES = 65536;
+
+//Index range of one level of detail inside a builder's index buffer
+struct MeshLod {
+	GLuint firstIndex;
+	GLuint indexCount;
+	GLint baseVertex;		//once packed, the level's indices count from this vertex of the mesh
+};
+
+//Builds interleaved vertex and index data for parametric shapes
+//Every Add* call works out its vertex and index counts first, grows the buffers once and then
+//writes straight into them, so there is no allocation per vertex. Several shapes can go into
+//one builder (the game piece is a sphere on a cone) and they share one vertex buffer.
+//Indices are built 32 bit and only narrowed by PackIndices(), so a finely tessellated shape can pass
+//65535 vertices while the small ones still end up 16 bit.
+class MeshBuilder {
+public:
+	std::vector<GLfloat> vertices;
+	std::vector<GLuint> indices;		//into vertices, not rebased per level
+	//closed off with EndLod(), finest level first
+	std::vector<MeshLod> lods;
+
+	MeshBuilder() : lodStart(0) {}
+
+	//optional, avoids regrowing when the final size is known up front
+	void Reserve(size_t vertexCount, size_t indexCount) {
+		vertices.reserve(vertexCount * FLOATS_PER_VERTEX);
+		indices.reserve(indexCount);
+	}
+
+	size_t VertexCount() const {
+		return vertices.size() / FLOATS_PER_VERTEX;
+	}
+
+	//Vertex and index counts for each shape, used to size buffers before generating
+	static size_t SphereVertexCount(unsigned int segments, unsigned int rings) {
+		return (size_t)(segments + 1) * (rings + 1);
+	}
+	static size_t SphereIndexCount(unsigned int segments, unsigned int rings) {
+		//one triangle per quad at each pole, two everywhere else
+		return (size_t)segments * (rings - 1) * 6;
+	}
+	static size_t ConeVertexCount(unsigned int segments, bool capped) {
+		return (size_t)(segments + 1) * 2 + (capped ? segments + 2 : 0);
+	}
+	static size_t ConeIndexCount(unsigned int segments, bool capped) {
+		return (size_t)segments * 3 * (capped ? 2 : 1);
+	}
+	static size_t CylinderVertexCount(unsigned int segments) {
+		return (size_t)(segments + 1) * 2 + (size_t)(segments + 2) * 2;
+	}
+	static size_t CylinderIndexCount(unsigned int segments) {
+		return (size_t)segments * 6 + (size_t)segments * 3 * 2;
+	}
+	static size_t PlaneVertexCount(unsigned int divisions) {
+		return (size_t)(divisions + 1) * (divisions + 1);
+	}
+	static size_t PlaneIndexCount(unsigned int divisions) {
+		return (size_t)divisions * divisions * 6;
+	}
+
+	//UV sphere, rings run pole to pole and segments run around the y axis
+	void AddSphere(glm::vec3 center, float radius, unsigned int segments, unsigned int rings) {
+		GLuint base = (GLuint)VertexCount();
+		GLfloat* v = GrowVertices(SphereVertexCount(segments, rings));
+		for (unsigned int r = 0; r <= rings; r++) {
+			float theta = PI_F * r / rings;
+			for (unsigned int s = 0; s <= segments; s++) {
+				float phi = 2.0f * PI_F * s / segments;
+				glm::vec3 normal(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+				v = WriteVertex(v, center + normal * radius, normal, (float)s / segments, 1.0f - (float)r / rings);
+			}
+		}
+
+		GLuint* i = GrowIndices(SphereIndexCount(segments, rings));
+		for (unsigned int r = 0; r < rings; r++) {
+			for (unsigned int s = 0; s < segments; s++) {
+				GLuint i0 = (GLuint)(base + r * (segments + 1) + s);
+				GLuint i1 = (GLuint)(i0 + segments + 1);
+				//the triangle touching a pole collapses, skip it
+				if (r != 0) {
+					i = WriteTriangle(i, i0, i0 + 1, i1 + 1);
+				}
+				if (r != rings - 1) {
+					i = WriteTriangle(i, i0, i1 + 1, i1);
+				}
+			}
+		}
+	}
+
+	//Cone standing on its base, apex at baseCenter + height on y
+	void AddCone(glm::vec3 baseCenter, float radius, float height, unsigned int segments, bool capped) {
+		GLuint base = (GLuint)VertexCount();
+		GLfloat* v = GrowVertices(ConeVertexCount(segments, capped));
+		glm::vec3 apex = baseCenter + glm::vec3(0.0f, height, 0.0f);
+		for (unsigned int s = 0; s <= segments; s++) {
+			float phi = 2.0f * PI_F * s / segments;
+			glm::vec3 dir(cosf(phi), 0.0f, sinf(phi));
+			//side normal tilts up by the slope of the cone
+			glm::vec3 normal = glm::normalize(glm::vec3(dir.x * height, radius, dir.z * height));
+			float u = (float)s / segments;
+			v = WriteVertex(v, baseCenter + dir * radius, normal, u, 0.0f);
+			v = WriteVertex(v, apex, normal, u, 1.0f);
+		}
+
+		GLuint* i = GrowIndices(ConeIndexCount(segments, capped));
+		for (unsigned int s = 0; s < segments; s++) {
+			GLuint b0 = (GLuint)(base + s * 2);
+			i = WriteTriangle(i, b0, b0 + 1, b0 + 2);
+		}
+		if (capped) {
+			AddDisc(v, i, base + (segments + 1) * 2, baseCenter, radius, segments, false);
+		}
+	}
+
+	//Capped cylinder, base at baseCenter and top at baseCenter + height on y
+	void AddCylinder(glm::vec3 baseCenter, float radius, float height, unsigned int segments) {
+		GLuint base = (GLuint)VertexCount();
+		GLfloat* v = GrowVertices(CylinderVertexCount(segments));
+		glm::vec3 top = baseCenter + glm::vec3(0.0f, height, 0.0f);
+		for (unsigned int s = 0; s <= segments; s++) {
+			float phi = 2.0f * PI_F * s / segments;
+			glm::vec3 dir(cosf(phi), 0.0f, sinf(phi));
+			float u = (float)s / segments;
+			v = WriteVertex(v, baseCenter + dir * radius, dir, u, 0.0f);
+			v = WriteVertex(v, top + dir * radius, dir, u, 1.0f);
+		}
+
+		GLuint* i = GrowIndices(CylinderIndexCount(segments));
+		for (unsigned int s = 0; s < segments; s++) {
+			GLuint b0 = (GLuint)(base + s * 2);
+			i = WriteTriangle(i, b0, b0 + 1, b0 + 3);
+			i = WriteTriangle(i, b0, b0 + 3, b0 + 2);
+		}
+		GLuint capBase = (GLuint)(base + (segments + 1) * 2);
+		AddDisc(v, i, capBase, top, radius, segments, true);
+		v += (segments + 2) * FLOATS_PER_VERTEX;
+		i += segments * 3;
+		AddDisc(v, i, capBase + segments + 2, baseCenter, radius, segments, false);
+	}
+
+	//Axis aligned box, each face gets its own four vertices so normals stay flat
+	void AddBox(glm::vec3 center, glm::vec3 halfExtents) {
+		static const float faces[6][3][3] = {
+			//normal				u axis					v axis
+			{ { 1, 0, 0 },		{ 0, 0, -1 },		{ 0, 1, 0 } },
+			{ { -1, 0, 0 },		{ 0, 0, 1 },		{ 0, 1, 0 } },
+			{ { 0, 1, 0 },		{ 1, 0, 0 },		{ 0, 0, -1 } },
+			{ { 0, -1, 0 },		{ 1, 0, 0 },		{ 0, 0, 1 } },
+			{ { 0, 0, 1 },		{ 1, 0, 0 },		{ 0, 1, 0 } },
+			{ { 0, 0, -1 },		{ -1, 0, 0 },		{ 0, 1, 0 } },
+		};
+
+		GLuint base = (GLuint)VertexCount();
+		GLfloat* v = GrowVertices(24);
+		for (int f = 0; f < 6; f++) {
+			glm::vec3 n(faces[f][0][0], faces[f][0][1], faces[f][0][2]);
+			glm::vec3 du(faces[f][1][0], faces[f][1][1], faces[f][1][2]);
+			glm::vec3 dv(faces[f][2][0], faces[f][2][1], faces[f][2][2]);
+			for (int corner = 0; corner < 4; corner++) {
+				float u = (float)(corner & 1);
+				float w = (float)(corner >> 1);
+				glm::vec3 p = n + du * (u * 2.0f - 1.0f) + dv * (w * 2.0f - 1.0f);
+				v = WriteVertex(v, center + p * halfExtents, n, u, w);
+			}
+		}
+
+		GLuint* i = GrowIndices(36);
+		for (int f = 0; f < 6; f++) {
+			GLuint q = (GLuint)(base + f * 4);
+			i = WriteTriangle(i, q, q + 1, q + 3);
+			i = WriteTriangle(i, q, q + 3, q + 2);
+		}
+	}
+
+	//Flat plane facing up, divisions splits each side into a grid
+	void AddPlane(glm::vec3 center, float width, float depth, unsigned int divisions) {
+		GLuint base = (GLuint)VertexCount();
+		GLfloat* v = GrowVertices(PlaneVertexCount(divisions));
+		glm::vec3 up(0.0f, 1.0f, 0.0f);
+		for (unsigned int z = 0; z <= divisions; z++) {
+			for (unsigned int x = 0; x <= divisions; x++) {
+				float u = (float)x / divisions;
+				float w = (float)z / divisions;
+				glm::vec3 p = center + glm::vec3((u - 0.5f) * width, 0.0f, (w - 0.5f) * depth);
+				v = WriteVertex(v, p, up, u, w);
+			}
+		}
+
+		GLuint* i = GrowIndices(PlaneIndexCount(divisions));
+		for (unsigned int z = 0; z < divisions; z++) {
+			for (unsigned int x = 0; x < divisions; x++) {
+				GLuint i0 = (GLuint)(base + z * (divisions + 1) + x);
+				GLuint i1 = (GLuint)(i0 + divisions + 1);
+				i = WriteTriangle(i, i0, i1, i1 + 1);
+				i = WriteTriangle(i, i0, i1 + 1, i0 + 1);
+			}
+		}
+	}
+
+	//Copies already interleaved vertices and their indices in, for meshes laid out by hand
+	void AddRaw(const GLfloat* rawVertices, size_t vertexCount, const GLushort* rawIndices, size_t indexCount) {
+		GLuint base = (GLuint)VertexCount();
+		GLfloat* v = GrowVertices(vertexCount);
+		for (size_t n = 0; n < vertexCount * FLOATS_PER_VERTEX; n++) {
+			v[n] = rawVertices[n];
+		}
+		GLuint* i = GrowIndices(indexCount);
+		for (size_t n = 0; n < indexCount; n++) {
+			i[n] = (GLuint)(base + rawIndices[n]);
+		}
+	}
+
+	//Axis aligned bounds of every vertex added so far
+	void GetBounds(glm::vec3& boundsMin, glm::vec3& boundsMax) const {
+		boundsMin = glm::vec3(0.0f);
+		boundsMax = glm::vec3(0.0f);
+		for (size_t n = 0; n < vertices.size(); n += FLOATS_PER_VERTEX) {
+			glm::vec3 p(vertices[n], vertices[n + 1], vertices[n + 2]);
+			boundsMin = n == 0 ? p : glm::min(boundsMin, p);
+			boundsMax = n == 0 ? p : glm::max(boundsMax, p);
+		}
+	}
+
+	//Closes the indices added since the last EndLod() as one level of detail
+	//build the same shape at falling tessellation and call this after each one to get a chain
+	void EndLod() {
+		MeshLod lod;
+		lod.firstIndex = lodStart;
+		lod.indexCount = (GLuint)indices.size() - lodStart;
+		lod.baseVertex = 0;
+		lods.push_back(lod);
+		lodStart = (GLuint)indices.size();
+	}
+
+	//Levels as they'll be drawn, each one a draw range based on the lowest vertex it uses
+	//a builder without EndLod() calls is one level covering every index
+	std::vector<MeshLod> DrawRanges() const {
+		std::vector<MeshLod> ranges = lods;
+		if (ranges.empty()) {
+			MeshLod whole;
+			whole.firstIndex = 0;
+			whole.indexCount = (GLuint)indices.size();
+			whole.baseVertex = 0;
+			ranges.push_back(whole);
+		}
+		for (size_t r = 0; r < ranges.size(); r++) {
+			GLuint lowest, highest;
+			VertexSpan(ranges[r], lowest, highest);
+			ranges[r].baseVertex = (GLint)lowest;
+		}
+		return ranges;
+	}
+
+	//GL_UNSIGNED_SHORT unless some level reaches across more than MAX_SHORT_INDEX_VERTICES vertices
+	//levels are rebased separately, so a LOD chain only goes 32 bit when one level alone needs it
+	GLenum IndexType() const {
+		std::vector<MeshLod> ranges = DrawRanges();
+		for (size_t r = 0; r < ranges.size(); r++) {
+			GLuint lowest, highest;
+			VertexSpan(ranges[r], lowest, highest);
+			if (highest - lowest >= MAX_SHORT_INDEX_VERTICES) {
+				return GL_UNSIGNED_INT;
+			}
+		}
+		return GL_UNSIGNED_SHORT;
+	}
+
+	//Index bytes for the GPU at IndexType(), every level minus its range's baseVertex
+	//ranges gets DrawRanges() to go with them
+	GLenum PackIndices(std::vector<unsigned char>& packed, std::vector<MeshLod>& ranges) const {
+		GLenum type = IndexType();
+		ranges = DrawRanges();
+		packed.resize(indices.size() * (type == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort)));
+		GLuint* wide = (GLuint*)packed.data();
+		GLushort* narrow = (GLushort*)packed.data();
+		for (size_t r = 0; r < ranges.size(); r++) {
+			GLuint base = (GLuint)ranges[r].baseVertex;
+			GLuint end = ranges[r].firstIndex + ranges[r].indexCount;
+			for (GLuint n = ranges[r].firstIndex; n < end; n++) {
+				if (type == GL_UNSIGNED_INT) {
+					wide[n] = indices[n] - base;
+				}
+				else {
+					narrow[n] = (GLushort)(indices[n] - base);
+				}
+			}
+		}
+		return type;
+	}
+
+	void Clear() {
+		vertices.clear();
+		indices.clear();
+		lods.clear();
+		lodStart = 0;
+	}
+
+private:
+	static constexpr float PI_F = 3.1415927f;
+	GLuint lodStart;
+
+	//lowest and highest vertex a level's indices touch, both 0 for an empty level
+	void VertexSpan(const MeshLod& lod, GLuint& lowest, GLuint& highest) const {
+		lowest = 0;
+		highest = 0;
+		for (GLuint n = lod.firstIndex; n < lod.firstIndex + lod.indexCount; n++) {
+			lowest = n == lod.firstIndex || indices[n] < lowest ? indices[n] : lowest;
+			highest = n == lod.firstIndex || indices[n] > highest ? indices[n] : highest;
+		}
+	}
+
+	//grows the vertex buffer by count vertices and returns where to write them
+	GLfloat* GrowVertices(size_t count) {
+		size_t start = vertices.size();
+		vertices.resize(start + count * FLOATS_PER_VERTEX);
+		return vertices.data() + start;
+	}
+
+	GLuint* GrowIndices(size_t count) {
+		size_t start = indices.size();
+		indices.resize(start + count);
+		return indices.data() + start;
+	}
+
+	static GLfloat* WriteVertex(GLfloat* v, glm::vec3 position, glm::vec3 normal, float u, float w) {
+		v[0] = position.x;
+		v[1] = position.y;
+		v[2] = position.z;
+		v[3] = normal.x;
+		v[4] = normal.y;
+		v[5] = normal.z;
+		v[6] = u;
+		v[7] = w;
+		return v + FLOATS_PER_VERTEX;
+	}
+
+	static GLuint* WriteTriangle(GLuint* i, GLuint a, GLuint b, GLuint c) {
+		i[0] = a;
+		i[1] = b;
+		i[2] = c;
+		return i + 3;
+	}
+
+	//Triangle fan cap: center vertex, then segments + 1 rim vertices, written at v and i
+	static void AddDisc(GLfloat* v, GLuint* i, GLuint base, glm::vec3 center, float radius,
+		unsigned int segments, bool facingUp) {
+		glm::vec3 normal(0.0f, facingUp ? 1.0f : -1.0f, 0.0f);
+		v = WriteVertex(v, center, normal, 0.5f, 0.5f);
+		for (unsigned int s = 0; s <= segments; s++) {
+			float phi = 2.0f * PI_F * s / segments;
+			glm::vec3 dir(cosf(phi), 0.0f, sinf(phi));
+			v = WriteVertex(v, center + dir * radius, normal, 0.5f + dir.x * 0.5f, 0.5f + dir.z * 0.5f);
+		}
+		for (unsigned int s = 0; s < segments; s++) {
+			GLuint rim = (GLuint)(base + 1 + s);
+			if (facingUp) {
+				i = WriteTriangle(i, base, rim + 1, rim);
+			}
+			else {
+				i = WriteTriangle(i, base, rim, rim + 1);
+			}
+		}
+	}
+};
+#endif
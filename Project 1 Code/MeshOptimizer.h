@@ -0,0 +1,293 @@
+#ifndef MESHOPTIMIZER_H
+#define MESHOPTIMIZER_H
+
+#include <GL/glew.h>
+
+#include "MeshGen.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <vector>
+
+//Post-transform cache the optimizer targets and measures against, FIFO like most hardware
+const unsigned int VERTEX_CACHE_SIZE = 16;
+//overdraw ordering may cost this much ACMR inside a cluster before the cluster is split
+const float OVERDRAW_CACHE_THRESHOLD = 1.05f;
+
+//Vertex cache efficiency of an index list
+//acmr: vertices transformed per triangle, 0.5 is the floor for a large grid, 3 is no reuse at all
+//atvr: vertices transformed per vertex used, 1 means every vertex is transformed exactly once
+struct VertexCacheStats {
+	float acmr;
+	float atvr;
+};
+
+//Transforms a FIFO cache of VERTEX_CACHE_SIZE would run for the indices
+//timestamps holds one entry per vertex, a vertex is cached while stamp - its entry <= cache size
+inline size_t CountCacheMisses(const GLuint* indices, size_t indexCount, std::vector<unsigned int>& timestamps,
+	unsigned int& stamp) {
+	size_t misses = 0;
+	for (size_t n = 0; n < indexCount; n++) {
+		unsigned int& entry = timestamps[indices[n]];
+		if (stamp - entry > VERTEX_CACHE_SIZE) {
+			entry = stamp++;
+			misses++;
+		}
+	}
+	return misses;
+}
+
+//ACMR and ATVR of indices into vertexCount vertices, starting from an empty cache
+inline VertexCacheStats AnalyzeVertexCache(const GLuint* indices, size_t indexCount, size_t vertexCount) {
+	VertexCacheStats stats = { 0.0f, 0.0f };
+	if (indexCount < 3) {
+		return stats;
+	}
+	std::vector<unsigned int> timestamps(vertexCount, 0);
+	unsigned int stamp = VERTEX_CACHE_SIZE + 1;
+	size_t misses = CountCacheMisses(indices, indexCount, timestamps, stamp);
+
+	std::vector<unsigned char> used(vertexCount, 0);
+	size_t usedCount = 0;
+	for (size_t n = 0; n < indexCount; n++) {
+		usedCount += used[indices[n]] ? 0 : 1;
+		used[indices[n]] = 1;
+	}
+	stats.acmr = (float)misses / (indexCount / 3);
+	stats.atvr = (float)misses / usedCount;
+	return stats;
+}
+
+//Tipsify (Sander, Nehab and Barczak, "Fast triangle reordering for vertex locality and reduced overdraw")
+//Fans out around one vertex at a time and moves on to the neighbour that's still in the cache and has
+//the fewest triangles left, so most vertices are transformed once. Rewrites indices in place.
+//clusters gets the first index of every run that started from a dead end, the overdraw pass
+//can reorder those runs without hurting cache reuse inside them.
+inline void OptimizeVertexCache(GLuint* indices, size_t indexCount, size_t vertexCount, std::vector<size_t>& clusters) {
+	clusters.clear();
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount == 0) {
+		return;
+	}
+
+	//triangles around each vertex, as offsets into one flat list
+	std::vector<unsigned int> liveCount(vertexCount, 0);
+	for (size_t n = 0; n < triangleCount * 3; n++) {
+		liveCount[indices[n]]++;
+	}
+	std::vector<size_t> adjacencyStart(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; v++) {
+		adjacencyStart[v + 1] = adjacencyStart[v] + liveCount[v];
+	}
+	std::vector<unsigned int> adjacency(triangleCount * 3);
+	std::vector<size_t> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+	for (size_t t = 0; t < triangleCount; t++) {
+		for (int corner = 0; corner < 3; corner++) {
+			adjacency[fill[indices[t * 3 + corner]]++] = (unsigned int)t;
+		}
+	}
+
+	std::vector<GLuint> output;
+	output.reserve(triangleCount * 3);
+	std::vector<unsigned int> timestamps(vertexCount, 0);
+	std::vector<unsigned char> emitted(triangleCount, 0);
+	std::vector<GLuint> deadEnds;
+	std::vector<GLuint> candidates;
+	unsigned int stamp = VERTEX_CACHE_SIZE + 1;
+	size_t cursor = 0;
+	long long fanning = indices[0];
+	clusters.push_back(0);
+
+	while (fanning >= 0) {
+		//emit every triangle left around the fanning vertex
+		candidates.clear();
+		GLuint f = (GLuint)fanning;
+		for (size_t a = adjacencyStart[f]; a < adjacencyStart[f + 1]; a++) {
+			unsigned int t = adjacency[a];
+			if (emitted[t]) {
+				continue;
+			}
+			for (int corner = 0; corner < 3; corner++) {
+				GLuint v = indices[t * 3 + corner];
+				output.push_back(v);
+				deadEnds.push_back(v);
+				candidates.push_back(v);
+				liveCount[v]--;
+				if (stamp - timestamps[v] > VERTEX_CACHE_SIZE) {
+					timestamps[v] = stamp++;
+				}
+			}
+			emitted[t] = 1;
+		}
+
+		//next fan: the candidate that will still be cached after its own triangles go out, oldest first
+		fanning = -1;
+		long long best = -1;
+		for (size_t c = 0; c < candidates.size(); c++) {
+			GLuint v = candidates[c];
+			if (liveCount[v] == 0) {
+				continue;
+			}
+			long long priority = 0;
+			if (stamp - timestamps[v] + 2 * liveCount[v] <= VERTEX_CACHE_SIZE) {
+				priority = stamp - timestamps[v];
+			}
+			if (priority > best) {
+				best = priority;
+				fanning = v;
+			}
+		}
+		if (fanning >= 0) {
+			continue;
+		}
+
+		//dead end: back up to a recently used vertex, otherwise take the next one in input order
+		while (!deadEnds.empty() && fanning < 0) {
+			GLuint v = deadEnds.back();
+			deadEnds.pop_back();
+			if (liveCount[v] > 0) {
+				fanning = v;
+			}
+		}
+		while (fanning < 0 && cursor < vertexCount) {
+			if (liveCount[cursor] > 0) {
+				fanning = (long long)cursor;
+			}
+			cursor++;
+		}
+		if (fanning >= 0 && output.size() < triangleCount * 3) {
+			clusters.push_back(output.size());
+		}
+	}
+	std::copy(output.begin(), output.end(), indices);
+}
+
+//Sander et al.'s linear overdraw ordering
+//Splits each cache cluster again wherever its running ACMR is already within OVERDRAW_CACHE_THRESHOLD
+//of the whole cluster's, then draws the clusters facing out from the mesh's center first, so for
+//most views the near surfaces go down before the ones behind them fail the depth test.
+inline void OptimizeOverdraw(GLuint* indices, size_t indexCount, const GLfloat* vertices, size_t vertexCount,
+	const std::vector<size_t>& hardClusters) {
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount < 2 || hardClusters.empty()) {
+		return;
+	}
+
+	//soft boundaries inside each hard cluster
+	std::vector<size_t> clusters;
+	std::vector<unsigned int> timestamps(vertexCount, 0);
+	unsigned int stamp = VERTEX_CACHE_SIZE + 1;
+	for (size_t c = 0; c < hardClusters.size(); c++) {
+		size_t start = hardClusters[c];
+		size_t end = c + 1 < hardClusters.size() ? hardClusters[c + 1] : triangleCount * 3;
+		stamp += VERTEX_CACHE_SIZE + 1;
+		size_t clusterMisses = CountCacheMisses(indices + start, end - start, timestamps, stamp);
+		float threshold = OVERDRAW_CACHE_THRESHOLD * clusterMisses / ((end - start) / 3);
+
+		clusters.push_back(start);
+		stamp += VERTEX_CACHE_SIZE + 1;
+		size_t misses = 0;
+		size_t faces = 0;
+		for (size_t n = start; n < end; n += 3) {
+			misses += CountCacheMisses(indices + n, 3, timestamps, stamp);
+			faces++;
+			if ((float)misses / faces <= threshold && n + 3 < end) {
+				clusters.push_back(n + 3);
+				stamp += VERTEX_CACHE_SIZE + 1;
+				misses = 0;
+				faces = 0;
+			}
+		}
+	}
+
+	//center of every vertex reference, the same point the clusters are sorted around
+	glm::vec3 meshCenter(0.0f);
+	for (size_t n = 0; n < triangleCount * 3; n++) {
+		const GLfloat* p = vertices + (size_t)indices[n] * FLOATS_PER_VERTEX;
+		meshCenter += glm::vec3(p[0], p[1], p[2]);
+	}
+	meshCenter /= (float)(triangleCount * 3);
+
+	//area weighted centroid and normal of each cluster, outward facing ones sort first
+	std::vector<std::pair<float, size_t> > order(clusters.size());
+	for (size_t c = 0; c < clusters.size(); c++) {
+		size_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount * 3;
+		glm::vec3 centroid(0.0f);
+		glm::vec3 normal(0.0f);
+		float area = 0.0f;
+		for (size_t n = clusters[c]; n < end; n += 3) {
+			const GLfloat* a = vertices + (size_t)indices[n] * FLOATS_PER_VERTEX;
+			const GLfloat* b = vertices + (size_t)indices[n + 1] * FLOATS_PER_VERTEX;
+			const GLfloat* d = vertices + (size_t)indices[n + 2] * FLOATS_PER_VERTEX;
+			glm::vec3 p0(a[0], a[1], a[2]);
+			glm::vec3 p1(b[0], b[1], b[2]);
+			glm::vec3 p2(d[0], d[1], d[2]);
+			glm::vec3 faceNormal = glm::cross(p1 - p0, p2 - p0);
+			float faceArea = glm::length(faceNormal);
+			centroid += (p0 + p1 + p2) * (faceArea / 3.0f);
+			normal += faceNormal;
+			area += faceArea;
+		}
+		centroid = area > 0.0f ? centroid / area : centroid;
+		float normalLength = glm::length(normal);
+		normal = normalLength > 0.0f ? normal / normalLength : normal;
+		order[c] = std::make_pair(-glm::dot(centroid - meshCenter, normal), c);
+	}
+	std::stable_sort(order.begin(), order.end());
+
+	std::vector<GLuint> output;
+	output.reserve(triangleCount * 3);
+	for (size_t o = 0; o < order.size(); o++) {
+		size_t c = order[o].second;
+		size_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount * 3;
+		output.insert(output.end(), indices + clusters[c], indices + end);
+	}
+	std::copy(output.begin(), output.end(), indices);
+}
+
+//Renumbers vertices in the order the indices first use them and moves their data to match,
+//so vertex fetch walks the buffer forwards. Vertices no index uses keep their order at the end
+inline void OptimizeVertexFetch(std::vector<GLfloat>& vertices, std::vector<GLuint>& indices) {
+	size_t vertexCount = vertices.size() / FLOATS_PER_VERTEX;
+	const GLuint UNUSED = 0xFFFFFFFFu;
+	std::vector<GLuint> remap(vertexCount, UNUSED);
+	GLuint next = 0;
+	for (size_t n = 0; n < indices.size(); n++) {
+		if (remap[indices[n]] == UNUSED) {
+			remap[indices[n]] = next++;
+		}
+		indices[n] = remap[indices[n]];
+	}
+	for (size_t v = 0; v < vertexCount; v++) {
+		if (remap[v] == UNUSED) {
+			remap[v] = next++;
+		}
+	}
+
+	std::vector<GLfloat> reordered(vertices.size());
+	for (size_t v = 0; v < vertexCount; v++) {
+		std::copy(vertices.begin() + v * FLOATS_PER_VERTEX, vertices.begin() + (v + 1) * FLOATS_PER_VERTEX,
+			reordered.begin() + (size_t)remap[v] * FLOATS_PER_VERTEX);
+	}
+	vertices.swap(reordered);
+}
+
+//Runs every pass over a builder: cache then overdraw order inside each LOD level, so level ranges
+//don't move, then fetch order over the whole vertex buffer. before and after cover all levels
+inline void OptimizeMesh(MeshBuilder& builder, VertexCacheStats& before, VertexCacheStats& after) {
+	size_t vertexCount = builder.VertexCount();
+	before = AnalyzeVertexCache(builder.indices.data(), builder.indices.size(), vertexCount);
+
+	std::vector<MeshLod> ranges = builder.DrawRanges();
+	std::vector<size_t> clusters;
+	for (size_t r = 0; r < ranges.size(); r++) {
+		GLuint* levelIndices = builder.indices.data() + ranges[r].firstIndex;
+		OptimizeVertexCache(levelIndices, ranges[r].indexCount, vertexCount, clusters);
+		OptimizeOverdraw(levelIndices, ranges[r].indexCount, builder.vertices.data(), vertexCount, clusters);
+	}
+	OptimizeVertexFetch(builder.vertices, builder.indices);
+
+	after = AnalyzeVertexCache(builder.indices.data(), builder.indices.size(), vertexCount);
+}
+#endif
@@ -0,0 +1,315 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+//Fixed size window of the most recent samples for one timing, in milliseconds
+class SampleWindow {
+public:
+	struct Stats {
+		float min;
+		float avg;
+		float p99;
+		size_t count;
+	};
+
+	SampleWindow(size_t windowSize = 240) : values(windowSize > 0 ? windowSize : 1, 0.0f), next(0), count(0) {}
+
+	void Add(float value) {
+		values[next] = value;
+		next = (next + 1) % values.size();
+		count = count < values.size() ? count + 1 : count;
+	}
+
+	//min, average and 99th percentile of everything in the window, zeros when empty
+	Stats Compute() const {
+		Stats stats = { 0.0f, 0.0f, 0.0f, count };
+		if (count == 0) {
+			return stats;
+		}
+		std::vector<float> sorted(values.begin(), values.begin() + count);
+		std::sort(sorted.begin(), sorted.end());
+		float sum = 0.0f;
+		for (size_t i = 0; i < sorted.size(); i++) {
+			sum += sorted[i];
+		}
+		stats.min = sorted.front();
+		stats.avg = sum / (float)sorted.size();
+		//nearest rank, the smallest sample with at least 99% of the window at or below it
+		stats.p99 = sorted[(sorted.size() * 99 + 99) / 100 - 1];
+		return stats;
+	}
+
+	void Clear() {
+		next = 0;
+		count = 0;
+	}
+
+private:
+	std::vector<float> values;
+	size_t next;
+	size_t count;
+};
+
+//Frame profiler with named zones, each zone times the CPU and optionally the GPU
+//GPU times come from GL_TIME_ELAPSED queries kept in a ring of QUERY_FRAMES per zone, a result
+//is only read once the driver says it's available so the CPU never waits on the GPU
+//Elapsed queries can't overlap, so GPU zones must not nest, CPU-only zones can
+//Zones can also count the fragments that pass the depth test (GL_SAMPLES_PASSED) while they're
+//timed on the GPU, against the frame's pixels that shows how much shading was overdraw
+class FrameProfiler {
+public:
+	//frames of queries in flight before a slot is reused
+	static const unsigned int QUERY_FRAMES = 4;
+
+	//GPU samples dropped because their result wasn't ready by the time the slot came round again
+	unsigned int droppedQueries;
+	//pixels in the frame, fragment counts are also reported per pixel when this is set
+	unsigned int pixelCount;
+
+	FrameProfiler(size_t windowSize = 240) : droppedQueries(0), pixelCount(0), window(windowSize), frame(0), frameStarted(false) {
+		//zone 0 is always the whole frame, measured between BeginFrame() calls
+		AddZone("frame");
+	}
+
+	//registers a zone and returns its id, registering the same name again returns the same id
+	//countFragments only has an effect while the zone is timed on the GPU
+	unsigned int AddZone(const char* name, bool countFragments = false) {
+		for (size_t i = 0; i < zones.size(); i++) {
+			if (zones[i].name == name) {
+				return (unsigned int)i;
+			}
+		}
+		Zone zone(name, window);
+		zone.countFragments = countFragments;
+		zones.push_back(zone);
+		return (unsigned int)(zones.size() - 1);
+	}
+
+	//Call once at the top of every frame
+	//collects GPU results from the slot about to be reused and records the last frame's time
+	void BeginFrame() {
+		Clock::time_point now = Clock::now();
+		if (frameStarted) {
+			zones[0].cpu.Add(Milliseconds(frameStart, now));
+		}
+		frameStart = now;
+		frameStarted = true;
+
+		frame++;
+		unsigned int slot = frame % QUERY_FRAMES;
+		for (size_t i = 0; i < zones.size(); i++) {
+			Zone& zone = zones[i];
+			if (!zone.issued[slot]) {
+				continue;
+			}
+			GLint available = 0;
+			glGetQueryObjectiv(zone.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available) {
+				GLuint64 elapsed = 0;
+				glGetQueryObjectui64v(zone.queries[slot], GL_QUERY_RESULT, &elapsed);
+				zone.gpu.Add((float)(elapsed / 1.0e6));
+			}
+			else {
+				droppedQueries++;
+			}
+			if (zone.countFragments) {
+				glGetQueryObjectiv(zone.fragmentQueries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+				if (available) {
+					GLuint64 passed = 0;
+					glGetQueryObjectui64v(zone.fragmentQueries[slot], GL_QUERY_RESULT, &passed);
+					zone.fragments.Add((float)passed);
+				}
+				else {
+					droppedQueries++;
+				}
+			}
+			zone.issued[slot] = false;
+		}
+	}
+
+	//starts timing a zone, gpu adds an elapsed query around the GL work issued until End()
+	void Begin(unsigned int id, bool gpu) {
+		Zone& zone = zones[id];
+		zone.start = Clock::now();
+		zone.timingGpu = gpu;
+		if (gpu) {
+			unsigned int slot = frame % QUERY_FRAMES;
+			if (zone.queries[0] == 0) {
+				glGenQueries(QUERY_FRAMES, zone.queries);
+				if (zone.countFragments) {
+					glGenQueries(QUERY_FRAMES, zone.fragmentQueries);
+				}
+			}
+			glBeginQuery(GL_TIME_ELAPSED, zone.queries[slot]);
+			if (zone.countFragments) {
+				glBeginQuery(GL_SAMPLES_PASSED, zone.fragmentQueries[slot]);
+			}
+			zone.issued[slot] = true;
+		}
+	}
+
+	void End(unsigned int id) {
+		Zone& zone = zones[id];
+		if (zone.timingGpu) {
+			glEndQuery(GL_TIME_ELAPSED);
+			if (zone.countFragments) {
+				glEndQuery(GL_SAMPLES_PASSED);
+			}
+			zone.timingGpu = false;
+		}
+		zone.cpu.Add(Milliseconds(zone.start, Clock::now()));
+	}
+
+	size_t ZoneCount() const {
+		return zones.size();
+	}
+
+	const std::string& ZoneName(unsigned int id) const {
+		return zones[id].name;
+	}
+
+	SampleWindow::Stats CpuStats(unsigned int id) const {
+		return zones[id].cpu.Compute();
+	}
+
+	SampleWindow::Stats GpuStats(unsigned int id) const {
+		return zones[id].gpu.Compute();
+	}
+
+	//fragments per frame rather than milliseconds, empty for zones that don't count them
+	SampleWindow::Stats FragmentStats(unsigned int id) const {
+		return zones[id].fragments.Compute();
+	}
+
+	//table of every zone over the current window
+	void Print(std::ostream& out) const {
+		out << "INFO: Frame profile over the last " << window << " frames (ms, min/avg/p99)" << std::endl;
+		out << std::fixed << std::setprecision(3);
+		for (size_t i = 0; i < zones.size(); i++) {
+			SampleWindow::Stats cpu = zones[i].cpu.Compute();
+			SampleWindow::Stats gpu = zones[i].gpu.Compute();
+			out << "  " << std::left << std::setw(10) << zones[i].name << std::right
+				<< " cpu " << cpu.min << " / " << cpu.avg << " / " << cpu.p99;
+			if (gpu.count > 0) {
+				out << "   gpu " << gpu.min << " / " << gpu.avg << " / " << gpu.p99;
+			}
+			SampleWindow::Stats fragments = zones[i].fragments.Compute();
+			if (fragments.count > 0) {
+				out << std::setprecision(0) << "   fragments " << fragments.avg << std::setprecision(3);
+				if (pixelCount > 0) {
+					out << " (" << fragments.avg / pixelCount << " per pixel)";
+				}
+			}
+			out << std::endl;
+		}
+		out << std::defaultfloat;
+		if (droppedQueries > 0) {
+			out << "  " << droppedQueries << " GPU samples dropped waiting on results" << std::endl;
+		}
+	}
+
+	//one row per zone, GPU columns are empty for CPU-only zones
+	bool WriteCsv(const char* fileName) const {
+		std::ofstream file(fileName);
+		if (!file) {
+			std::cout << "Failed to write profile " << fileName << std::endl;
+			return false;
+		}
+		file << "zone,cpu_min_ms,cpu_avg_ms,cpu_p99_ms,cpu_samples,gpu_min_ms,gpu_avg_ms,gpu_p99_ms,gpu_samples,fragments_avg\n";
+		for (size_t i = 0; i < zones.size(); i++) {
+			SampleWindow::Stats cpu = zones[i].cpu.Compute();
+			SampleWindow::Stats gpu = zones[i].gpu.Compute();
+			file << zones[i].name << ',' << cpu.min << ',' << cpu.avg << ',' << cpu.p99 << ',' << cpu.count << ',';
+			if (gpu.count > 0) {
+				file << gpu.min << ',' << gpu.avg << ',' << gpu.p99;
+			}
+			else {
+				file << ",,";
+			}
+			file << ',' << gpu.count << ',';
+			SampleWindow::Stats fragments = zones[i].fragments.Compute();
+			if (fragments.count > 0) {
+				file << fragments.avg;
+			}
+			file << '\n';
+		}
+		return true;
+	}
+
+	//deletes every query object, call while the context is still current
+	void Clear() {
+		for (size_t i = 0; i < zones.size(); i++) {
+			if (zones[i].queries[0] != 0) {
+				glDeleteQueries(QUERY_FRAMES, zones[i].queries);
+			}
+			if (zones[i].fragmentQueries[0] != 0) {
+				glDeleteQueries(QUERY_FRAMES, zones[i].fragmentQueries);
+			}
+		}
+		zones.clear();
+		AddZone("frame");
+		frameStarted = false;
+		droppedQueries = 0;
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Zone {
+		std::string name;
+		SampleWindow cpu;
+		SampleWindow gpu;
+		SampleWindow fragments;
+		Clock::time_point start;
+		bool timingGpu;
+		bool countFragments;
+		GLuint queries[QUERY_FRAMES];
+		GLuint fragmentQueries[QUERY_FRAMES];	//GL_SAMPLES_PASSED, in step with queries
+		bool issued[QUERY_FRAMES];
+
+		Zone(const char* zoneName, size_t windowSize) : name(zoneName), cpu(windowSize), gpu(windowSize),
+			fragments(windowSize), timingGpu(false), countFragments(false) {
+			for (unsigned int i = 0; i < QUERY_FRAMES; i++) {
+				queries[i] = 0;
+				fragmentQueries[i] = 0;
+				issued[i] = false;
+			}
+		}
+	};
+
+	size_t window;
+	std::vector<Zone> zones;
+	unsigned int frame;
+	Clock::time_point frameStart;
+	bool frameStarted;
+
+	static float Milliseconds(Clock::time_point start, Clock::time_point end) {
+		return std::chrono::duration<float, std::milli>(end - start).count();
+	}
+};
+
+//Times the enclosing scope as one zone
+class ProfileScope {
+public:
+	ProfileScope(FrameProfiler& frameProfiler, unsigned int zone, bool gpu = false) : profiler(frameProfiler), id(zone) {
+		profiler.Begin(id, gpu);
+	}
+
+	~ProfileScope() {
+		profiler.End(id);
+	}
+
+private:
+	FrameProfiler& profiler;
+	unsigned int id;
+};
+#endif
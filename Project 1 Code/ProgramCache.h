@@ -0,0 +1,175 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#include <GL/glew.h>
+
+#include "MeshCache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+//Program binary cache file, one per linked program
+//	header | glGetProgramBinary() output
+//named after the program's key, see ProgramCache::Key()
+const char PROGRAM_CACHE_MAGIC[4] = { 'S', 'P', 'R', 'G' };
+const uint32_t PROGRAM_CACHE_VERSION = 1;
+
+struct ProgramCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t key;
+	uint32_t format;		//binary format the driver reported, handed back to glProgramBinary()
+	uint64_t length;		//bytes of binary after the header
+};
+
+//Caches linked programs on disk so later runs skip GLSL compilation
+//A program's key hashes every stage's full source, #version line included (the GLSL macro
+//bakes any defines into the text), and the driver's vendor, renderer and version strings.
+//Any edit to a shader or a driver update gives a new key, so a stale binary is never even opened.
+//The driver can still reject a binary it wrote (glProgramBinary() fails to link), then
+//the caller compiles from source and the file is written again.
+class ProgramCache {
+public:
+	bool enabled;
+	unsigned int hits;
+	unsigned int misses;
+
+	ProgramCache() : enabled(true), hits(0), misses(0), driverKey(0) {}
+
+	//true when the driver can hand program binaries back (GL 4.1 or ARB_get_program_binary)
+	//and has at least one format to write them in
+	static bool Supported() {
+		if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary) {
+			return false;
+		}
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		return formats > 0;
+	}
+
+	//call once the context is current, turns the cache off when the driver can't use it
+	void Create() {
+		if (enabled && !Supported()) {
+			std::cout << "INFO: Driver can't return program binaries, shaders compile every run" << std::endl;
+			enabled = false;
+		}
+		const GLenum strings[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		driverKey = MeshCacheKey(&PROGRAM_CACHE_VERSION, sizeof(PROGRAM_CACHE_VERSION));
+		for (int i = 0; i < 3; i++) {
+			const char* text = (const char*)glGetString(strings[i]);
+			if (text != nullptr) {
+				driverKey = MeshCacheKey(text, strlen(text) + 1, driverKey);
+			}
+		}
+	}
+
+	//key of a program built from count stages, in the order they're attached
+	uint32_t Key(const char* const* sources, size_t count) const {
+		uint32_t key = driverKey;
+		for (size_t i = 0; i < count; i++) {
+			//the terminator goes in too, so moving text between stages changes the key
+			key = MeshCacheKey(sources[i], strlen(sources[i]) + 1, key);
+		}
+		return key;
+	}
+
+	//Program made from a cached binary, 0 when there's no usable file and the caller has to compile
+	GLuint Load(uint32_t key) {
+		if (!enabled) {
+			misses++;
+			return 0;
+		}
+		char fileName[32];
+		FileName(key, fileName, sizeof(fileName));
+		MappedFile file;
+		if (!file.Open(fileName)) {
+			misses++;
+			return 0;
+		}
+		const ProgramCacheHeader* header = (const ProgramCacheHeader*)file.Data();
+		if (file.Size() < sizeof(ProgramCacheHeader) ||
+			memcmp(header->magic, PROGRAM_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != PROGRAM_CACHE_VERSION || header->key != key ||
+			header->length > file.Size() - sizeof(ProgramCacheHeader)) {
+			misses++;
+			return 0;
+		}
+
+		GLuint program = glCreateProgram();
+		glProgramBinary(program, header->format, file.Data() + sizeof(ProgramCacheHeader), (GLsizei)header->length);
+		GLint success = 0;
+		glGetProgramiv(program, GL_LINK_STATUS, &success);
+		if (!success) {
+			std::cout << "INFO: Driver rejected program binary " << fileName << ", compiling" << std::endl;
+			glDeleteProgram(program);
+			misses++;
+			return 0;
+		}
+		hits++;
+		return program;
+	}
+
+	//call before glLinkProgram() on a program that will be saved, some drivers only keep a
+	//retrievable binary when asked up front
+	void PrepareLink(GLuint program) const {
+		if (enabled) {
+			glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		}
+	}
+
+	//Writes a linked program's binary under key, false if the driver gave nothing or the file can't be written
+	bool Save(GLuint program, uint32_t key) {
+		if (!enabled) {
+			return false;
+		}
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0) {
+			return false;
+		}
+		std::vector<unsigned char> binary((size_t)length);
+		GLenum format = 0;
+		GLsizei written = 0;
+		glGetProgramBinary(program, length, &written, &format, binary.data());
+		if (written <= 0) {
+			return false;
+		}
+
+		ProgramCacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+		header.version = PROGRAM_CACHE_VERSION;
+		header.key = key;
+		header.format = format;
+		header.length = (uint64_t)written;
+
+		char fileName[32];
+		FileName(key, fileName, sizeof(fileName));
+		FILE* file = fopen(fileName, "wb");
+		if (file == NULL) {
+			return false;
+		}
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+		ok = ok && fwrite(binary.data(), 1, (size_t)written, file) == (size_t)written;
+		fclose(file);
+		if (!ok) {
+			remove(fileName);
+		}
+		return ok;
+	}
+
+	void PrintStats() const {
+		std::cout << "INFO: Program cache: " << hits << " hits, " << misses << " compiled" << std::endl;
+	}
+
+private:
+	uint32_t driverKey;		//hash of the driver strings, every program's key starts from it
+
+	static void FileName(uint32_t key, char* fileName, size_t size) {
+		snprintf(fileName, size, "program_%08x.bin", (unsigned int)key);
+	}
+};
+#endif
@@ -0,0 +1,483 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+//View frustum as six planes facing inward, stored plane component by component so the
+//culling loop can test one object against all six without gathering
+struct Frustum {
+	float a[6];
+	float b[6];
+	float c[6];
+	float d[6];
+
+	//Gribb/Hartmann extraction from projection * view, planes come out normalized
+	//so a signed distance can be compared against a radius
+	void Extract(const glm::mat4& viewProjection) {
+		//rows of the matrix, glm stores columns
+		glm::vec4 rows[4];
+		for (int r = 0; r < 4; r++) {
+			rows[r] = glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+		}
+		glm::vec4 planes[6] = {
+			rows[3] + rows[0],		//left
+			rows[3] - rows[0],		//right
+			rows[3] + rows[1],		//bottom
+			rows[3] - rows[1],		//top
+			rows[3] + rows[2],		//near
+			rows[3] - rows[2],		//far
+		};
+		for (int p = 0; p < 6; p++) {
+			float length = std::sqrt(planes[p].x * planes[p].x + planes[p].y * planes[p].y + planes[p].z * planes[p].z);
+			a[p] = planes[p].x / length;
+			b[p] = planes[p].y / length;
+			c[p] = planes[p].z / length;
+			d[p] = planes[p].w / length;
+		}
+	}
+};
+
+//Per-instance data streamed to the instance buffer, one entry per drawn object
+//layout matches the instance attributes set up in UploadMeshBuffers() (locations 3-11)
+struct InstanceData {
+	glm::mat4 model;
+	glm::vec4 color;		//rgb object color, a is the texture array layer
+	glm::mat3 normalMatrix;	//inverse transpose of the model's upper 3x3
+	GLuint mesh;			//picks the mesh's entry in the shaders' dequantization table
+};
+
+//Run of instances drawn by one indirect draw command
+struct InstanceBatch {
+	GLuint program;
+	unsigned int mesh;
+	GLuint texture;
+	GLenum indexType;				//the mesh's, a multi-draw only covers one index type
+	unsigned int lod;
+	unsigned int firstInstance;		//offset into the instance buffer
+	unsigned int instanceCount;
+};
+
+//Indirect draw command, layout fixed by GL (DrawElementsIndirectCommand)
+struct DrawCommand {
+	GLuint count;			//indices in the LOD level
+	GLuint instanceCount;
+	GLuint firstIndex;		//mesh's first index plus the level's, counted in the mesh's index type
+	GLint baseVertex;		//mesh's first vertex in the shared vertex buffer plus the level's
+	GLuint baseInstance;	//batch's first entry in the instance buffer
+};
+
+//Structure-of-arrays table of every object in the scene
+//Each column is its own contiguous array so the draw loop walks memory in order,
+//adding an object is one more row rather than another block in Render()
+class SceneTable {
+public:
+	//columns, one entry per object
+	std::vector<GLuint> programs;			//shader program the object is drawn with
+	std::vector<unsigned int> meshes;		//handle into the mesh list owned by Source.cpp
+	std::vector<GLenum> indexTypes;			//GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, how the mesh's indices are stored
+	std::vector<GLuint> textures;			//texture array the object samples, 0 for objects without a texture
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> scales;
+	std::vector<glm::vec3> colors;
+	std::vector<float> layers;				//layer of the texture array, goes to the shader with the instance
+	std::vector<glm::mat4> models;			//translate * scale, rebuilt when a transform changes
+	std::vector<glm::mat3> normalMatrices;	//rebuilt by UpdateNormalMatrices() after transforms change
+	std::vector<glm::vec3> localMins;		//mesh bounding box in model space
+	std::vector<glm::vec3> localMaxs;
+	std::vector<glm::vec3> worldMins;		//bounding box after the object's transform
+	std::vector<glm::vec3> worldMaxs;
+	//bounding sphere after the transform, one float column per component for the culling loop
+	std::vector<float> worldCenterX;
+	std::vector<float> worldCenterY;
+	std::vector<float> worldCenterZ;
+	std::vector<float> worldRadii;
+	std::vector<unsigned char> visible;		//result of the last Cull(), 1 when the object is drawn
+	std::vector<unsigned int> lodCounts;	//levels the object's mesh carries
+	std::vector<unsigned int> lodLevels;	//level picked by SelectLods(), 0 is finest
+
+	//objects rejected by the last Cull()
+	unsigned int culledCount;
+	//bumped by every SetTransform(), caches built from the transforms compare it to know they're stale
+	unsigned int transformVersion;
+
+	SceneTable() : culledCount(0), transformVersion(0), orderDirty(false), normalsDirty(false), frontToBack(false), distancesDirty(false) {}
+
+	//adds a row and returns its index
+	//boundsMin/boundsMax are the mesh's bounding box before the transform
+	unsigned int AddObject(GLuint program, unsigned int mesh, GLuint texture, float layer,
+		glm::vec3 position, glm::vec3 scale, glm::vec3 color,
+		glm::vec3 boundsMin = glm::vec3(0.0f), glm::vec3 boundsMax = glm::vec3(0.0f), unsigned int lodCount = 1,
+		GLenum indexType = GL_UNSIGNED_SHORT) {
+		programs.push_back(program);
+		meshes.push_back(mesh);
+		indexTypes.push_back(indexType);
+		textures.push_back(texture);
+		positions.push_back(position);
+		scales.push_back(scale);
+		colors.push_back(color);
+		layers.push_back(layer);
+		models.push_back(glm::mat4(1.0f));
+		normalMatrices.push_back(glm::mat3(1.0f));
+		localMins.push_back(boundsMin);
+		localMaxs.push_back(boundsMax);
+		worldMins.push_back(glm::vec3(0.0f));
+		worldMaxs.push_back(glm::vec3(0.0f));
+		worldCenterX.push_back(0.0f);
+		worldCenterY.push_back(0.0f);
+		worldCenterZ.push_back(0.0f);
+		worldRadii.push_back(0.0f);
+		visible.push_back(1);
+		lodCounts.push_back(lodCount > 0 ? lodCount : 1);
+		lodLevels.push_back(0);
+
+		viewDistances.push_back(0.0f);
+
+		unsigned int row = (unsigned int)(programs.size() - 1);
+		SetTransform(row, position, scale);
+		orderDirty = true;
+		return row;
+	}
+
+	//moves an object, only its model matrix and world bounds are rebuilt
+	void SetTransform(unsigned int row, glm::vec3 position, glm::vec3 scale) {
+		positions[row] = position;
+		scales[row] = scale;
+		models[row] = glm::translate(position) * glm::scale(scale);
+		normalsDirty = true;
+		distancesDirty = true;
+		transformVersion++;
+
+		//a negative scale flips the box, so sort the corners again
+		glm::vec3 cornerA = position + localMins[row] * scale;
+		glm::vec3 cornerB = position + localMaxs[row] * scale;
+		worldMins[row] = glm::min(cornerA, cornerB);
+		worldMaxs[row] = glm::max(cornerA, cornerB);
+
+		glm::vec3 center = (worldMins[row] + worldMaxs[row]) * 0.5f;
+		worldCenterX[row] = center.x;
+		worldCenterY[row] = center.y;
+		worldCenterZ[row] = center.z;
+		worldRadii[row] = glm::length(worldMaxs[row] - center);
+	}
+
+	//Rebuilds every normal matrix in one pass, does nothing when no transform changed
+	//A model whose axes are perpendicular (rotation and scale, uniform or not) skips the inverse:
+	//its inverse transpose is the same axes divided by their squared lengths. The first loop
+	//finds those rows without branching, only the rest go through a full 3x3 inverse
+	void UpdateNormalMatrices() {
+		if (!normalsDirty) {
+			return;
+		}
+		size_t count = models.size();
+		normalScratch.resize(count * 3);
+		orthogonal.resize(count);
+		float* inverseLengths = normalScratch.data();
+		unsigned char* simple = orthogonal.data();
+
+		for (size_t row = 0; row < count; row++) {
+			const glm::mat4& m = models[row];
+			float xx = m[0][0] * m[0][0] + m[0][1] * m[0][1] + m[0][2] * m[0][2];
+			float yy = m[1][0] * m[1][0] + m[1][1] * m[1][1] + m[1][2] * m[1][2];
+			float zz = m[2][0] * m[2][0] + m[2][1] * m[2][1] + m[2][2] * m[2][2];
+			float xy = m[0][0] * m[1][0] + m[0][1] * m[1][1] + m[0][2] * m[1][2];
+			float xz = m[0][0] * m[2][0] + m[0][1] * m[2][1] + m[0][2] * m[2][2];
+			float yz = m[1][0] * m[2][0] + m[1][1] * m[2][1] + m[1][2] * m[2][2];
+			//axes count as perpendicular when their cosines are tiny
+			float tolerance = 1.0e-6f * (xx * yy + xx * zz + yy * zz);
+			simple[row] = (xy * xy + xz * xz + yz * yz <= tolerance) ? 1 : 0;
+			inverseLengths[row * 3 + 0] = xx > 0.0f ? 1.0f / xx : 0.0f;
+			inverseLengths[row * 3 + 1] = yy > 0.0f ? 1.0f / yy : 0.0f;
+			inverseLengths[row * 3 + 2] = zz > 0.0f ? 1.0f / zz : 0.0f;
+		}
+
+		for (size_t row = 0; row < count; row++) {
+			glm::mat3 upper(models[row]);
+			if (simple[row]) {
+				normalMatrices[row][0] = upper[0] * inverseLengths[row * 3 + 0];
+				normalMatrices[row][1] = upper[1] * inverseLengths[row * 3 + 1];
+				normalMatrices[row][2] = upper[2] * inverseLengths[row * 3 + 2];
+			}
+			else {
+				normalMatrices[row] = glm::transpose(glm::inverse(upper));
+			}
+		}
+		normalsDirty = false;
+	}
+
+	//Marks which objects are inside the frustum and returns how many were culled
+	//First pass tests every bounding sphere against all six planes without branching so the
+	//compiler can vectorize it, the second pass tightens the survivors with their boxes
+	unsigned int Cull(const Frustum& frustum) {
+		size_t count = programs.size();
+		const float* cx = worldCenterX.data();
+		const float* cy = worldCenterY.data();
+		const float* cz = worldCenterZ.data();
+		const float* radius = worldRadii.data();
+		unsigned char* inside = visible.data();
+
+		for (size_t row = 0; row < count; row++) {
+			//smallest signed distance to any plane, the sphere is out once it's below -radius
+			float nearest = 1.0e30f;
+			for (int p = 0; p < 6; p++) {
+				float distance = frustum.a[p] * cx[row] + frustum.b[p] * cy[row] + frustum.c[p] * cz[row] + frustum.d[p];
+				nearest = distance < nearest ? distance : nearest;
+			}
+			inside[row] = nearest >= -radius[row] ? 1 : 0;
+		}
+
+		culledCount = 0;
+		for (size_t row = 0; row < count; row++) {
+			if (inside[row]) {
+				//box corner furthest along each plane normal, if even that is outside so is the box
+				for (int p = 0; p < 6; p++) {
+					float x = frustum.a[p] >= 0.0f ? worldMaxs[row].x : worldMins[row].x;
+					float y = frustum.b[p] >= 0.0f ? worldMaxs[row].y : worldMins[row].y;
+					float z = frustum.c[p] >= 0.0f ? worldMaxs[row].z : worldMins[row].z;
+					if (frustum.a[p] * x + frustum.b[p] * y + frustum.c[p] * z + frustum.d[p] < 0.0f) {
+						inside[row] = 0;
+						break;
+					}
+				}
+			}
+			culledCount += inside[row] ? 0 : 1;
+		}
+		return culledCount;
+	}
+
+	//Picks each object's level of detail from how big its bounding sphere is on screen
+	//screenSizes[i] is the projected size (fraction of half the screen height) below which level i
+	//drops to level i + 1, a level only changes once the size is hysteresis past the threshold
+	void SelectLods(const glm::mat4& view, const glm::mat4& projection,
+		const float* screenSizes, float hysteresis) {
+		//only the view space depth of each center is needed, so take row 2 of the view matrix
+		glm::vec4 viewZ(view[0][2], view[1][2], view[2][2], view[3][2]);
+		//w of a projected point is projection[2][3] * z + projection[3][3], -z for perspective and 1 for ortho
+		float wFromZ = projection[2][3];
+		float wConstant = projection[3][3];
+		float yScale = projection[1][1];
+
+		for (size_t row = 0; row < programs.size(); row++) {
+			unsigned int count = lodCounts[row];
+			if (count == 1 || !visible[row]) {
+				continue;
+			}
+			float z = viewZ.x * worldCenterX[row] + viewZ.y * worldCenterY[row] + viewZ.z * worldCenterZ[row] + viewZ.w;
+			float w = wFromZ * z + wConstant;
+			//camera inside or behind the sphere, use the finest level
+			float size = w > worldRadii[row] * std::fabs(wFromZ) ? worldRadii[row] * yScale / w : 1.0e30f;
+
+			unsigned int level = lodLevels[row];
+			while (level + 1 < count && size < screenSizes[level] * (1.0f - hysteresis)) {
+				level++;
+			}
+			while (level > 0 && size > screenSizes[level - 1] * (1.0f + hysteresis)) {
+				level--;
+			}
+			lodLevels[row] = level;
+		}
+	}
+
+	size_t Size() const {
+		return programs.size();
+	}
+
+	//Switches DrawOrder() to front to back within each program, texture and index type, nearest
+	//center first, so early depth testing rejects more of what's behind. Neighbouring rows rarely
+	//share a mesh after that, so batches get smaller, but a run is still one multi-draw.
+	//Call every frame, the order is only rebuilt when the eye or a transform moved
+	void SortFrontToBack(glm::vec3 eye) {
+		if (frontToBack && !distancesDirty && eye == sortedEye) {
+			return;
+		}
+		float* distance = viewDistances.data();
+		for (size_t row = 0; row < programs.size(); row++) {
+			float dx = worldCenterX[row] - eye.x;
+			float dy = worldCenterY[row] - eye.y;
+			float dz = worldCenterZ[row] - eye.z;
+			distance[row] = dx * dx + dy * dy + dz * dz;
+		}
+		frontToBack = true;
+		distancesDirty = false;
+		sortedEye = eye;
+		orderDirty = true;
+	}
+
+	//rows sorted by program, then mesh, then texture so neighbouring draws share state
+	//or front to back after SortFrontToBack(), only re-sorted when rows are added or the order changes
+	const std::vector<unsigned int>& DrawOrder() {
+		if (orderDirty) {
+			drawOrder.resize(programs.size());
+			for (size_t i = 0; i < drawOrder.size(); i++) {
+				drawOrder[i] = (unsigned int)i;
+			}
+			std::sort(drawOrder.begin(), drawOrder.end(), StateLess(*this));
+			orderDirty = false;
+		}
+		return drawOrder;
+	}
+
+	//Packs every visible object into instances and groups them into batches
+	//objects sharing program, mesh, texture and LOD level end up next to each other so each
+	//group is a single instanced draw, rows come from DrawOrder() so batches are already state sorted
+	void BuildInstances(std::vector<InstanceData>& instances, std::vector<InstanceBatch>& batches) {
+		instances.clear();
+		batches.clear();
+		const std::vector<unsigned int>& order = DrawOrder();
+
+		size_t start = 0;
+		while (start < order.size()) {
+			//run of rows with the same program, mesh and texture
+			unsigned int first = order[start];
+			size_t end = start + 1;
+			while (end < order.size() && programs[order[end]] == programs[first] &&
+				meshes[order[end]] == meshes[first] && textures[order[end]] == textures[first]) {
+				end++;
+			}
+
+			//one batch per LOD level used in the run
+			for (unsigned int lod = 0; lod < lodCounts[first]; lod++) {
+				InstanceBatch batch;
+				batch.program = programs[first];
+				batch.mesh = meshes[first];
+				batch.texture = textures[first];
+				batch.indexType = indexTypes[first];
+				batch.lod = lod;
+				batch.firstInstance = (unsigned int)instances.size();
+				for (size_t i = start; i < end; i++) {
+					unsigned int row = order[i];
+					if (!visible[row] || lodLevels[row] != lod) {
+						continue;
+					}
+					InstanceData instance;
+					instance.model = models[row];
+					instance.color = glm::vec4(colors[row], layers[row]);
+					instance.normalMatrix = normalMatrices[row];
+					instance.mesh = meshes[row];
+					instances.push_back(instance);
+				}
+				batch.instanceCount = (unsigned int)instances.size() - batch.firstInstance;
+				if (batch.instanceCount > 0) {
+					batches.push_back(batch);
+				}
+			}
+			start = end;
+		}
+	}
+
+	//Packs every object drawn with program at its finest level, culled or not, for passes that
+	//look from somewhere other than the camera like the lamp's shadow map
+	//each run of rows sharing a mesh in DrawOrder() is one batch
+	void BuildCasterInstances(GLuint program, std::vector<InstanceData>& instances, std::vector<InstanceBatch>& batches) {
+		instances.clear();
+		batches.clear();
+		const std::vector<unsigned int>& order = DrawOrder();
+		for (size_t i = 0; i < order.size(); i++) {
+			unsigned int row = order[i];
+			if (programs[row] != program) {
+				continue;
+			}
+			if (batches.empty() || batches.back().mesh != meshes[row]) {
+				InstanceBatch batch;
+				batch.program = program;
+				batch.mesh = meshes[row];
+				batch.texture = textures[row];
+				batch.indexType = indexTypes[row];
+				batch.lod = 0;
+				batch.firstInstance = (unsigned int)instances.size();
+				batch.instanceCount = 0;
+				batches.push_back(batch);
+			}
+			InstanceData instance;
+			instance.model = models[row];
+			instance.color = glm::vec4(colors[row], layers[row]);
+			instance.normalMatrix = normalMatrices[row];
+			instance.mesh = meshes[row];
+			instances.push_back(instance);
+			batches.back().instanceCount++;
+		}
+	}
+
+	void Clear() {
+		programs.clear();
+		meshes.clear();
+		indexTypes.clear();
+		textures.clear();
+		positions.clear();
+		scales.clear();
+		colors.clear();
+		layers.clear();
+		models.clear();
+		normalMatrices.clear();
+		localMins.clear();
+		localMaxs.clear();
+		worldMins.clear();
+		worldMaxs.clear();
+		worldCenterX.clear();
+		worldCenterY.clear();
+		worldCenterZ.clear();
+		worldRadii.clear();
+		visible.clear();
+		lodCounts.clear();
+		lodLevels.clear();
+		viewDistances.clear();
+		drawOrder.clear();
+		culledCount = 0;
+		transformVersion++;
+		orderDirty = false;
+		normalsDirty = false;
+		frontToBack = false;
+		distancesDirty = false;
+	}
+
+private:
+	std::vector<unsigned int> drawOrder;
+	bool orderDirty;
+	bool normalsDirty;
+	//squared distance from the eye to each center, only filled in by SortFrontToBack()
+	std::vector<float> viewDistances;
+	bool frontToBack;
+	bool distancesDirty;
+	glm::vec3 sortedEye;
+	//per-row working space for UpdateNormalMatrices(), kept to avoid reallocating
+	std::vector<float> normalScratch;
+	std::vector<unsigned char> orthogonal;
+
+	//orders rows by the GL state they need, most expensive switch first
+	struct StateLess {
+		const SceneTable& table;
+		StateLess(const SceneTable& sceneTable) : table(sceneTable) {}
+		bool operator()(unsigned int a, unsigned int b) const {
+			if (table.programs[a] != table.programs[b]) {
+				return table.programs[a] < table.programs[b];
+			}
+			//only what splits a multi-draw comes before the distance
+			if (table.frontToBack) {
+				if (table.textures[a] != table.textures[b]) {
+					return table.textures[a] < table.textures[b];
+				}
+				if (table.indexTypes[a] != table.indexTypes[b]) {
+					return table.indexTypes[a] < table.indexTypes[b];
+				}
+				if (table.viewDistances[a] != table.viewDistances[b]) {
+					return table.viewDistances[a] < table.viewDistances[b];
+				}
+			}
+			if (table.meshes[a] != table.meshes[b]) {
+				return table.meshes[a] < table.meshes[b];
+			}
+			if (table.textures[a] != table.textures[b]) {
+				return table.textures[a] < table.textures[b];
+			}
+			//keep insertion order for identical state
+			return a < b;
+		}
+	};
+};
+#endif
@@ -0,0 +1,178 @@
+#ifndef SHADOWMAP_H
+#define SHADOWMAP_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+//texture unit the lit shaders read the shadow map from, after the G-buffer's units
+const GLuint SHADOW_MAP_UNIT = 5;
+//widest the fitted frustum gets, casters outside it are left unshadowed
+const float SHADOW_MAX_HALF_ANGLE = 1.0471976f;
+
+//Depth map from the lamp, drawn only when it goes stale
+//The lamp is a point light off to one side of the scene, so a single perspective frustum
+//fitted to the casters' bounds covers them all. Nothing is drawn for frames where neither the
+//light nor a caster moved, the lit shaders just sample the last map with PCF
+class ShadowMap {
+public:
+	//times the map has been drawn
+	unsigned int renders;
+
+	ShadowMap() : renders(0), fbo(0), depthTexture(0), size(0), drawn(false), drawnVersion(0),
+		viewProjection(1.0f), savedTarget(0) {}
+
+	//depth only target of resolution x resolution texels, false if the framebuffer is incomplete
+	bool Create(int resolution) {
+		Destroy();
+		size = resolution;
+		glGenTextures(1, &depthTexture);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, size, size);
+		//sampled through a shadow sampler, linear filtering blends the four nearest comparisons
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		//outside the map counts as lit
+		const GLfloat border[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			std::cout << "Error: shadow map incomplete (0x" << std::hex << status << std::dec << ")" << std::endl;
+			Destroy();
+			return false;
+		}
+		return true;
+	}
+
+	bool Created() const {
+		return fbo != 0;
+	}
+
+	//true once the map holds something the shaders can sample
+	bool Drawn() const {
+		return drawn;
+	}
+
+	//true when the light moved or the casters' transforms changed since the last draw
+	//casterVersion is anything that changes whenever a caster moves, like SceneTable::transformVersion
+	bool Stale(glm::vec3 light, unsigned int casterVersion) const {
+		return !drawn || light != drawnLight || casterVersion != drawnVersion;
+	}
+
+	//Points the frustum from the light at the middle of the casters' box and widens it until
+	//every corner is inside, near and far planes hug the box so depth precision goes to the casters
+	void Fit(glm::vec3 light, glm::vec3 boundsMin, glm::vec3 boundsMax) {
+		glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+		glm::vec3 direction = center - light;
+		if (glm::length(direction) < 1.0e-4f) {
+			direction = glm::vec3(0.0f, -1.0f, 0.0f);
+		}
+		direction = glm::normalize(direction);
+		//any up works as long as it isn't along the direction
+		glm::vec3 up = std::fabs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+		glm::mat4 view = glm::lookAt(light, light + direction, up);
+
+		float maxTan = std::tan(SHADOW_MAX_HALF_ANGLE);
+		float tanHalf = 0.0f;
+		float nearest = 1.0e30f;
+		float farthest = 0.0f;
+		for (int i = 0; i < 8; i++) {
+			glm::vec3 corner((i & 1) ? boundsMax.x : boundsMin.x, (i & 2) ? boundsMax.y : boundsMin.y,
+				(i & 4) ? boundsMax.z : boundsMin.z);
+			glm::vec4 viewCorner = view * glm::vec4(corner, 1.0f);
+			float depth = -viewCorner.z;
+			farthest = std::max(farthest, depth);
+			//a corner level with or behind the light can't be covered, take the widest frustum
+			if (depth <= 1.0e-3f) {
+				tanHalf = maxTan;
+				continue;
+			}
+			nearest = std::min(nearest, depth);
+			tanHalf = std::max(tanHalf, std::max(std::fabs(viewCorner.x), std::fabs(viewCorner.y)) / depth);
+		}
+		tanHalf = std::min(tanHalf, maxTan);
+		farthest = std::max(farthest, 1.0e-2f);
+		nearest = std::max(std::min(nearest, farthest * 0.5f), farthest * 1.0e-3f);
+		viewProjection = glm::perspective(2.0f * std::atan(tanHalf), 1.0f, nearest, farthest) * view;
+	}
+
+	//light space projection * view from the last Fit()
+	const glm::mat4& ViewProjection() const {
+		return viewProjection;
+	}
+
+	//one texel in texture coordinates, the spacing of the PCF taps
+	float TexelSize() const {
+		return size > 0 ? 1.0f / (float)size : 0.0f;
+	}
+
+	//Makes the map the draw target and clears it, slope scaled offset keeps surfaces from shadowing themselves
+	//saves the caller's target and viewport for End()
+	void Begin() {
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &savedTarget);
+		glGetIntegerv(GL_VIEWPORT, savedViewport);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glViewport(0, 0, size, size);
+		glEnable(GL_DEPTH_TEST);
+		glDepthMask(GL_TRUE);
+		glDepthFunc(GL_LESS);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glEnable(GL_POLYGON_OFFSET_FILL);
+		glPolygonOffset(2.0f, 4.0f);
+	}
+
+	//restores what Begin() changed and records what the map was drawn for
+	void End(glm::vec3 light, unsigned int casterVersion) {
+		glDisable(GL_POLYGON_OFFSET_FILL);
+		glBindFramebuffer(GL_FRAMEBUFFER, savedTarget);
+		glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+		drawn = true;
+		drawnLight = light;
+		drawnVersion = casterVersion;
+		renders++;
+	}
+
+	//binds the map to SHADOW_MAP_UNIT, it stays there for every frame after
+	void BindTexture() const {
+		glActiveTexture(GL_TEXTURE0 + SHADOW_MAP_UNIT);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void Destroy() {
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &depthTexture);
+		fbo = depthTexture = 0;
+		size = 0;
+		drawn = false;
+	}
+
+private:
+	GLuint fbo;
+	GLuint depthTexture;
+	int size;
+	bool drawn;
+	glm::vec3 drawnLight;
+	unsigned int drawnVersion;
+	glm::mat4 viewProjection;
+	GLint savedTarget;
+	GLint savedViewport[4];
+};
+#endif
@@ -6,6 +6,8 @@
 //Texture loading
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+//TextureCache.h includes stb_image.h again, only for the declarations
+#undef STB_IMAGE_IMPLEMENTATION
 
 //glm math headers for 3d calculations
 #include <glm/glm.hpp>
@@ -13,8 +15,28 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <math.h>
+#include <cstddef>
+#include <cstdio>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <unordered_map>
 
 #include "Camera.h"
+#include "TextureCache.h"
+#include "Scene.h"
+#include "MeshGen.h"
+#include "MeshCache.h"
+#include "ProgramCache.h"
+#include "MeshOptimizer.h"
+#include "Profiler.h"
+#include "CameraPath.h"
+#include "FrameCapture.h"
+#include "Benchmark.h"
+#include "GpuCulling.h"
+#include "LightClusters.h"
+#include "GBuffer.h"
+#include "ShadowMap.h"
 
 //GLSL shader macro
 #ifndef GLSL
@@ -30,13 +52,75 @@ const float PI = 3.1415927f;
 const char* WINDOW_TITLE = "CS330 Project";
 const int SCREEN_H = 600;
 const int SCREEN_W = 800;
+//depth range of both projections, the light clusters are sliced across it
+const float NEAR_PLANE = 0.1f;
+const float FAR_PLANE = 100.0f;
 
-//GL mesh struct for vbo and vaos
+//most levels of detail a mesh can carry
+const unsigned int MAX_MESH_LODS = 4;
+
+//Mesh stored in the shared vertex and index buffers
 struct GLMesh {
-	GLuint vao;			//vertex array
-	GLuint vbos[2];		//vertex buffer for vertices and indices
+	GLint baseVertex;	//first vertex in the shared vertex buffer, added to every index
+	GLenum indexType;	//GL_UNSIGNED_SHORT unless a level needs more than 16 bits
+	GLuint firstIndex;	//first index in the shared index buffer, counted in indexType
 	GLuint nIndices;
+	//index ranges relative to firstIndex, finest first, meshes without a chain have one level covering everything
+	//each level's indices count from baseVertex plus the level's own baseVertex
+	MeshLod lods[MAX_MESH_LODS];
+	GLuint nLods;
+	//local space bounds for culling and LOD selection
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	glm::vec3 boundCenter;
+	float boundRadius;
+};
+
+//Uniform locations for a shader program, looked up once when the program is linked
+struct UniformCache {
+	std::unordered_map<std::string, GLint> locations;	//every active uniform outside a block
+	GLint textureScale;
+	GLint uTexture;
+
+	//-1 for names the program doesn't use, same as glGetUniformLocation
+	GLint Get(const char* name) const {
+		std::unordered_map<std::string, GLint>::const_iterator found = locations.find(name);
+		return found != locations.end() ? found->second : -1;
+	}
+};
+
+//Per-frame uniform block, layout matches FrameData in the shaders (std140)
+//vec3s are stored as vec4 since std140 pads them to 16 bytes
+struct FrameData {
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::vec4 lightPos;
+	glm::vec4 lightColor;
+	glm::vec4 fillLightPos;
+	glm::vec4 fillColor;
+	glm::vec4 viewPos;
+	glm::mat4 shadowViewProjection;	//lamp's shadow map projection * view
+	glm::vec4 shadowParams;			//x 1 when the lamp casts shadows, y depth bias, z one texel of the map
+};
+//binding point shared by every program's FrameData block
+const GLuint FRAME_UBO_BINDING = 0;
+//instance attributes, the model matrix takes one location per column
+const GLuint INSTANCE_MODEL_LOCATION = 3;
+const GLuint INSTANCE_COLOR_LOCATION = 7;
+const GLuint INSTANCE_NORMAL_LOCATION = 8;
+const GLuint INSTANCE_MESH_LOCATION = 11;
+
+//most meshes the shaders' dequantization table holds, matches MAX_MESHES in the vertex shaders
+const unsigned int MESH_TABLE_SIZE = 16;
+//Per-mesh uniform block, layout matches MeshData in the vertex shaders (std140)
+//packed positions are 0-1 across the mesh's bounds, offset + position * scale puts them back
+struct MeshData {
+	glm::vec4 positionOffsets[MESH_TABLE_SIZE];
+	glm::vec4 positionScales[MESH_TABLE_SIZE];
+	GLint octahedralNormals;	//1 when normals are the packed two component encoding
+	GLint padding[3];			//std140 rounds the block up to 16 bytes
 };
+const GLuint MESH_UBO_BINDING = 1;
 
 //GL initialization
 GLFWwindow* window = nullptr;
@@ -47,12 +131,51 @@ GLMesh meshCube;
 GLMesh meshPyr;
 GLMesh meshCyl;
 
-//Textures
-GLuint textureIdSphere;
-GLuint textureIdPlane;
-GLuint textureIdCube;
-GLuint textureIdPyr;
-GLuint textureIdCyl;
+//Tessellation for the generated meshes, raise for smoother curves or lower for fewer vertices
+//each array is a LOD chain, finest first
+const unsigned int PIECE_LOD_COUNT = 3;
+const unsigned int PIECE_SEGMENTS[PIECE_LOD_COUNT] = { 24, 12, 6 };
+const unsigned int PIECE_RINGS[PIECE_LOD_COUNT] = { 16, 8, 4 };
+const unsigned int CYLINDER_LOD_COUNT = 3;
+const unsigned int CYLINDER_SEGMENTS[CYLINDER_LOD_COUNT] = { 32, 16, 8 };
+const unsigned int PLANE_DIVISIONS = 1;
+
+//Generated meshes are saved as binary cache files in the working directory and mapped straight
+//back in on later runs, a cache whose key doesn't match the tessellation above is rebuilt
+bool meshCacheEnabled = true;
+//upload through a mapped immutable buffer (GL 4.4 buffer storage) instead of glBufferData
+bool mappedMeshUpload = false;
+//16 byte PackedVertex layout instead of 8 floats, the float layout stays the default for debugging
+bool packedVertices = false;
+
+//Projected bounding sphere size, as a fraction of half the screen height, below which each
+//level hands over to the next coarser one
+const float LOD_SCREEN_SIZES[MAX_MESH_LODS - 1] = { 0.25f, 0.1f, 0.04f };
+//fraction a threshold has to be crossed by before the level changes, stops popping at the boundary
+const float LOD_HYSTERESIS = 0.15f;
+
+//Mesh handles stored in the scene table
+enum MeshHandle {
+	MESH_PIECE,
+	MESH_PLANE,
+	MESH_CUBE,
+	MESH_PYRAMID,
+	MESH_CYLINDER,
+	MESH_COUNT
+};
+GLMesh* meshes[MESH_COUNT] = { &gMesh, &meshPlane, &meshCube, &meshPyr, &meshCyl };
+static_assert(MESH_COUNT <= MESH_TABLE_SIZE, "the shaders' mesh table is too small");
+
+//Textures, every lit object samples one layer of the cache's texture array
+unsigned int textureLayerSphere;
+unsigned int textureLayerPlane;
+unsigned int textureLayerCube;
+unsigned int textureLayerPyr;
+unsigned int textureLayerCyl;
+//width and height of every array layer, decoded images are resampled to it and cooked files
+//only go into the array when they were cooked at it (TextureCooker --size 1024)
+const int TEXTURE_LAYER_SIZE = 1024;
+const unsigned int TEXTURE_LAYER_COUNT = 5;
 glm::vec2 textureScale(1.0f, 1.0f);
 GLint textureWrapMode = GL_REPEAT;
 
@@ -60,6 +183,61 @@ GLint textureWrapMode = GL_REPEAT;
 GLuint shaderProgramId;
 GLuint lampProgramId;
 GLuint fillProgramId;
+UniformCache shaderUniforms;
+UniformCache lampUniforms;
+UniformCache fillUniforms;
+//deferred shading, lit objects draw into the G-buffer with gbufferProgramId and the lighting
+//program shades it in one full-screen pass, the lamp and fill programs draw into it unchanged
+GLuint gbufferProgramId;
+GLuint lightingProgramId;
+UniformCache gbufferUniforms;
+UniformCache lightingUniforms;
+//empty vao for the full-screen triangle, its corners come from gl_VertexID
+GLuint fullscreenVao;
+GBuffer gBuffer;
+//uniform buffer holding FrameData
+GLuint frameUbo;
+//Every mesh lives in one vertex and index buffer behind one vao, so a whole pass is one draw
+//16 bit indices fill the front of the index buffer and the few 32 bit meshes follow them
+GLuint meshVao;
+GLuint meshVbos[2];
+//mesh dequantization table, see MeshData
+GLuint meshUbo;
+//One mesh's data waiting for UploadMeshBuffers(), which writes it at the mesh's offset in the shared buffers
+//A cache hit keeps its file mapped until then and the data points straight into it,
+//generated meshes (and packed vertices, which are converted on load) keep a copy here
+struct PendingMesh {
+	GLMesh* mesh;
+	MeshCacheFile cache;
+	std::vector<unsigned char> vertices;
+	std::vector<unsigned char> indices;
+	const void* vertexData;
+	size_t vertexBytes;
+	const void* indexData;
+	size_t indexBytes;
+};
+PendingMesh pendingMeshes[MESH_COUNT];
+unsigned int pendingMeshCount = 0;
+//bytes written at offset into a shared mesh buffer, see FillMeshBuffer()
+struct MeshBufferPiece {
+	size_t offset;
+	size_t bytes;
+	const void* data;
+};
+//running totals, a new mesh's baseVertex and firstIndex
+size_t meshVertexCount = 0;
+size_t meshShortIndexCount = 0;
+size_t meshIntIndexCount = 0;
+//instance buffer read through the shared vao, refilled each frame from the scene table
+GLuint instanceVbo;
+std::vector<InstanceData> instances;
+std::vector<InstanceBatch> instanceBatches;
+//indirect draw commands, one per batch
+GLuint drawCommandBuffer;
+std::vector<DrawCommand> drawCommands;
+//what the instance and command buffers hold, so only entries that changed are uploaded
+std::vector<InstanceData> uploadedInstances;
+std::vector<DrawCommand> uploadedCommands;
 
 //Camera
 Camera camera(glm::vec3(-1.0f, 0.0f, 4.0f));
@@ -76,6 +254,102 @@ glm::mat4 projection;
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
 
+//Scene table, one row per drawn object, built from the values below at startup
+SceneTable scene;
+//objects culled last frame, only reported when it changes
+unsigned int lastCulledCount = 0;
+
+//Frame profiler, P prints the current window and profile.csv is written on exit
+FrameProfiler profiler;
+unsigned int zoneTextures;
+unsigned int zoneScene;
+unsigned int zoneObjects;
+unsigned int zoneLamp;
+unsigned int zoneFill;
+unsigned int zoneSwap;
+unsigned int zoneCull;
+unsigned int zonePyramid;
+unsigned int zoneLights;
+unsigned int zoneLighting;
+unsigned int zonePrepass;
+unsigned int zoneShadow;
+//seconds between frame time updates in the window title
+const float PROFILE_TITLE_INTERVAL = 1.0f;
+float lastTitleUpdate = 0.0f;
+
+//Headless mode renders offscreen on an OSMesa context and follows a scripted camera path
+//options come from the command line, see ParseOptions()
+bool headless = false;
+unsigned int headlessFrames = 0;		//0 plays the camera path once
+std::string cameraPathFile;				//empty uses CameraPath::LoadDefault()
+std::string captureDirectory = "frames";	//empty renders without saving frames
+//fixed time step so a path gives the same frames on every machine
+const float HEADLESS_FRAME_TIME = 1.0f / 60.0f;
+CameraPath cameraPath;
+FrameCapture frameCapture;
+
+//Benchmark mode is a headless run without capture over a scaled scene, reported as JSON
+//SphereBenchmark.vcxproj builds this file with SPHERE_BENCHMARK so it starts in this mode
+#ifdef SPHERE_BENCHMARK
+bool benchmark = true;
+#else
+bool benchmark = false;
+#endif
+unsigned int benchmarkObjects = 0;		//lit objects in the scene, below 5 keeps the normal scene
+std::string benchmarkJson = "benchmark.json";
+//frames rendered before timing starts, lets texture uploads and driver caches settle
+const unsigned int BENCHMARK_WARMUP_FRAMES = 30;
+//distance between the repeated boards in a scaled scene, the table is 10 wide
+const float BENCHMARK_BOARD_SPACING = 12.0f;
+
+//GPU culling moves frustum culling and LOD selection into a compute pass that writes the indirect
+//draws itself, occlusion culling adds a test against a depth pyramid from the previous frame
+//both fall back to CPU culling when the driver lacks compute shaders or indirect count draws
+bool gpuCulling = false;
+bool occlusionCulling = false;
+GpuCuller gpuCuller;
+std::vector<GpuCullObject> cullObjects;
+std::vector<GpuCullPass> cullPasses;
+
+//Point lights on top of the lamp and fill pair, binned into clusters every frame so each fragment
+//only shades the ones that reach it, none unless --lights asks for them
+LightClusters lightClusters;
+unsigned int pointLightCount = 0;
+//how far the scattered lights reach, each gets a range somewhere between these
+const float POINT_LIGHT_MIN_RANGE = 1.0f;
+const float POINT_LIGHT_MAX_RANGE = 2.5f;
+
+//Deferred shading lights every pixel once instead of every fragment drawn, G switches at runtime
+bool deferredShading = false;
+
+//Depth pre-pass: every object's depth first with a shader that does nothing else, then the real
+//passes test GL_EQUAL so each pixel runs the lit shader once. Front to back orders each
+//pass nearest first, which also helps early depth testing without the pre-pass
+bool depthPrepass = false;
+bool frontToBack = false;
+GLuint depthProgramId;
+UniformCache depthUniforms;
+
+//depth state for each stage of a frame drawn with the pre-pass
+enum DepthPass {
+	DEPTH_NORMAL,		//less, writes depth and color
+	DEPTH_PREPASS,		//less, writes depth only
+	DEPTH_EQUAL,		//equal against the pre-pass, writes color only
+};
+
+//Lamp shadows, the map is only redrawn when the lamp or a lit object moves
+//edge length of the map in texels, 0 turns shadows off
+const int SHADOW_MAP_SIZE = 1024;
+int shadowMapSize = SHADOW_MAP_SIZE;
+//depth difference a surface can sit behind the map and still count as lit, on top of the polygon offset
+const float SHADOW_DEPTH_BIAS = 0.0005f;
+ShadowMap shadowMap;
+GLuint shadowProgramId;
+UniformCache shadowUniforms;
+std::vector<InstanceData> shadowInstances;
+std::vector<InstanceBatch> shadowBatches;
+std::vector<DrawCommand> shadowCommands;
+
 //Plane functions
 glm::vec3 planePos(0.0f, 1.8f, 0.0f);
 glm::vec3 planeColor(0.5f, 0.2f, 0.0f);
@@ -113,8 +387,9 @@ glm::vec3 fillScale(0.5f);
 
 //--------------------------------------------------------------------------------------
 //Function calls for main
-void flipImageVertically(unsigned char* image, int width, int height, int channels);
 bool Initialize(int argc, char* argv[], GLFWwindow** window);
+bool ParseOptions(int argc, char* argv[]);
+bool RenderHeadless();
 void ResizeWindow(GLFWwindow* window, int width, int height);
 void ProcessInput(GLFWwindow* window);
 //Functions for mouse tracking for camera
@@ -122,20 +397,53 @@ void MousePositionCallback(GLFWwindow* window, double xPos, double yPos);
 void MouseScrollCallback(GLFWwindow* window, double xOffset, double yOffset);
 //Default mesh, contains game piece right now
 void CreateMesh(GLMesh& mesh);
-//Mesh for the plane, since vertices and indices are hardcoded, need a function for each one
-//as well as a separate mesh object for each one
+//Piece, plane and cylinder come from MeshBuilder, cube and pyramid are still hardcoded
+//since their texture coordinates are laid out by hand
 void CreateMeshPlane(GLMesh& mesh);
 void CreateMeshCube(GLMesh& mesh);
 void CreateMeshPyramid(GLMesh& mesh);
 void CreateMeshCylinder(GLMesh& mesh);
-void DestroyMesh(GLMesh& mesh);
+void AddMesh(GLMesh& mesh, MeshBuilder& builder, const char* name);
+void AddMeshData(GLMesh& mesh, const GLfloat* vertices, size_t vertexBytes,
+	const void* indices, GLenum indexType, size_t indexCount, const MeshLod* lods, size_t lodCount,
+	glm::vec3 boundsMin, glm::vec3 boundsMax);
+void UploadMeshBuffers();
+void FillMeshBuffer(GLenum target, size_t bytes, const MeshBufferPiece* pieces, size_t pieceCount);
+template <typename T>
+size_t UpdateChangedRanges(GLenum target, GLuint buffer, const std::vector<T>& data, std::vector<T>& uploaded);
+bool LoadCachedMesh(GLMesh& mesh, const char* fileName, uint32_t key);
+void SaveCachedMesh(const char* fileName, uint32_t key, const MeshBuilder& builder);
+void DestroyMeshBuffers();
 //Texture functions
-bool CreateTexture(const char* filename, GLuint& textureId);
-void DestroyTexture(GLuint textureId);
 void Render();
+void BuildScene();
+void BuildLights();
+unsigned int AddSceneObject(GLuint program, MeshHandle mesh, GLuint texture, unsigned int layer,
+	glm::vec3 position, glm::vec3 scale, glm::vec3 color);
 bool CreateShaderProgram(const char* vertShaderSource,
-	const char* fragShaderSource, GLuint& programId);
+	const char* fragShaderSource, GLuint& programId, UniformCache& uniforms);
+void CacheUniformLocations(GLuint programId, UniformCache& uniforms);
 void DestroyShaderProgram(GLuint programId);
+unsigned int PassZone(GLuint programId);
+void UpdateProfileTitle(float currentFrame);
+void DrawSceneCpuCulled(const FrameData& frame, const Frustum& frustum);
+void DrawSceneGpuCulled(const FrameData& frame, const Frustum& frustum);
+bool CreateGpuCuller();
+GLuint DrawProgram(GLuint programId);
+void SetDepthPass(DepthPass pass);
+void LightGBuffer(const FrameData& frame);
+void BuildDrawCommands(const std::vector<InstanceBatch>& batches, std::vector<DrawCommand>& commands);
+void DrawByIndexType(const std::vector<InstanceBatch>& batches);
+void UpdateShadowMap();
+
+//Linked programs kept on disk, a warm start loads every program without compiling any GLSL
+ProgramCache programCache;
+
+//Texture cache, every object's texture goes through this so images are only decoded once
+//decoding happens on worker threads, Render() shows a placeholder until each upload lands
+TextureCache textureCache;
+//bytes of decoded texture data copied to the GPU per frame, bigger images are spread over several frames
+const size_t TEXTURE_UPLOAD_BUDGET = 1024 * 1024;
 
 //------------------------------------------------------------------------------------------
 //GLSL calls for shaders
@@ -143,25 +451,64 @@ const GLchar* vertexShaderSource = GLSL(440,
 	layout(location = 0) in vec3 position;				//vertex data for the shape itself
 	layout(location = 1) in vec3 normal;				//lighting data
 	layout(location = 2) in vec2 textureCoordinate;		//texture data
+	layout(location = 3) in mat4 model;					//per-instance transform, locations 3-6
+	layout(location = 7) in vec4 instanceColor;			//per-instance color, a is the texture layer
+	layout(location = 8) in mat3 normalMatrix;			//per-instance normal matrix, locations 8-10
+	layout(location = 11) in uint meshIndex;			//per-instance mesh, picks its dequantization
 
 	out vec3 vertexNormal;								//Normals for lighting
 	out vec3 vertexFragmentPos;							//Outgoing color/pixels to fragment shader
 	out vec2 vertexTextureCoordinate;					//Texture coords
+	out vec3 objectColor;								//instance color for the fragment shader
+	flat out float textureLayer;						//layer of the texture array to sample
+
+	//Globals for transforming matrices, view and projection are shared per frame
+	layout(std140, binding = 0) uniform FrameData {
+		mat4 view;
+		mat4 projection;
+		vec3 lightPos;
+		vec3 lightColor;
+		vec3 fillLightPos;
+		vec3 fillColor;
+		vec3 viewPos;
+		mat4 shadowViewProjection;
+		vec4 shadowParams;
+	};
 
-	//Globals for transforming matrices
-	uniform mat4 model;
-	uniform mat4 view;
-	uniform mat4 projection;
+	//Per-mesh dequantization, an identity entry for every mesh unless the vertices are packed
+	const int MAX_MESHES = 16;
+	layout(std140, binding = 1) uniform MeshData {
+		vec4 positionOffsets[MAX_MESHES];
+		vec4 positionScales[MAX_MESHES];
+		int octahedralNormals;
+	};
+
+	//Unit normal from its octahedral encoding, the lower half of the sphere is folded over the diagonals
+	vec3 OctahedralDecode(vec2 encoded) {
+		vec3 n = vec3(encoded, 1.0f - abs(encoded.x) - abs(encoded.y));
+		if (n.z < 0.0f) {
+			n.xy = (1.0f - abs(n.yx)) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+		}
+		return normalize(n);
+	}
+
+	//the depth pre-pass computes the same position, GL_EQUAL needs it to match bit for bit
+	invariant gl_Position;
 
 	void main() {
+		//packed positions are 0-1 across the mesh bounds, float ones pass straight through
+		vec3 localPosition = positionOffsets[meshIndex].xyz + position * positionScales[meshIndex].xyz;
+		vec3 localNormal = octahedralNormals != 0 ? OctahedralDecode(normal.xy) : normal;
 		//establish clip field
-		gl_Position = projection * view * model * vec4(position, 1.0f);
+		gl_Position = projection * view * model * vec4(localPosition, 1.0f);
 		//Get fragment pixel info in world space
-		vertexFragmentPos = vec3(model * vec4(position, 1.0f));
-		//Input normals fed to output for normals
-		vertexNormal = mat3(transpose(inverse(model))) * normal;
+		vertexFragmentPos = vec3(model * vec4(localPosition, 1.0f));
+		//Input normals fed to output for normals, the matrix comes precomputed from the CPU
+		vertexNormal = normalMatrix * localNormal;
 		//input texture fed to output data
 		vertexTextureCoordinate = textureCoordinate;
+		objectColor = instanceColor.rgb;
+		textureLayer = instanceColor.a;
 	}
 );
 
@@ -170,18 +517,62 @@ const GLchar* fragmentShaderSource = GLSL(440,
 	in vec3 vertexNormal;					//incoming normal data for lighting reflection
 	in vec3 vertexFragmentPos;				//position data for the object
 	in vec2 vertexTextureCoordinate;		//Texture data from vert shader
+	in vec3 objectColor;					//instance color from vert shader
+	flat in float textureLayer;				//texture array layer from vert shader
 
 	out vec4 fragmentColor;					//output color info
 
-	uniform vec3 objectColor;
-	uniform vec3 lightColor;
-	uniform vec3 lightPos;
-	uniform vec3 fillColor;
-	uniform vec3 fillLightPos;
-	uniform vec3 viewPos;
-	uniform sampler2D uTexture;
+	//lights and camera come from the per-frame block
+	layout(std140, binding = 0) uniform FrameData {
+		mat4 view;
+		mat4 projection;
+		vec3 lightPos;
+		vec3 lightColor;
+		vec3 fillLightPos;
+		vec3 fillColor;
+		vec3 viewPos;
+		mat4 shadowViewProjection;
+		vec4 shadowParams;
+	};
+	uniform sampler2DArray uTexture;
 	uniform vec2 textureScale;
 
+	//Point lights binned into screen tile x depth slice clusters, see LightClusters.h
+	layout(std140, binding = 2) uniform ClusterData {
+		uvec4 gridSize;						//tiles across, tiles down, depth slices, lights
+		vec4 sliceScale;					//xy pixels to tiles, z and w turn log(view depth) into a slice
+	};
+	struct PointLight {
+		vec4 positionRange;					//w is the distance the light reaches
+		vec4 color;
+	};
+	layout(std430, binding = 4) readonly buffer PointLights { PointLight pointLights[]; };
+	layout(std430, binding = 5) readonly buffer ClusterCells { uvec2 clusterCells[]; };	//offset and count into the index list
+	layout(std430, binding = 6) readonly buffer ClusterIndices { uint clusterIndices[]; };
+
+	//lamp's depth map, see ShadowMap.h
+	uniform sampler2DShadow shadowMap;
+
+	//Share of the lamp's light reaching a world position, PCF over the shadow map
+	//the linear filter blends four comparisons per tap, so four taps a texel out cover 4x4 texels
+	float LampVisibility(vec3 position) {
+		if (shadowParams.x == 0.0f) {
+			return 1.0f;
+		}
+		vec4 clip = shadowViewProjection * vec4(position, 1.0f);
+		vec3 coord = clip.xyz / clip.w * 0.5f + 0.5f;
+		//behind the lamp or past the casters, nothing there to block it
+		if (clip.w <= 0.0f || coord.z >= 1.0f) {
+			return 1.0f;
+		}
+		float lit = 0.0f;
+		for (int i = 0; i < 4; i++) {
+			vec2 offset = vec2((i & 1) != 0 ? 1.0f : -1.0f, (i & 2) != 0 ? 1.0f : -1.0f);
+			lit += texture(shadowMap, vec3(coord.xy + offset * shadowParams.z, coord.z - shadowParams.y));
+		}
+		return lit * 0.25f;
+	}
+
 	void main() {
 		//Phone lighting to generate light components
 
@@ -218,11 +609,32 @@ const GLchar* fragmentShaderSource = GLSL(440,
 		vec3 specular = specularIntensity * specularComponent * lightColor;
 		vec3 fillSpecular = specularIntensity * specularComponent * fillColor;
 
+		//Point lights, only the ones binned into this fragment's cluster
+		float viewDepth = -(view * vec4(vertexFragmentPos, 1.0f)).z;
+		uvec2 tile = uvec2(min(ivec2(gl_FragCoord.xy * sliceScale.xy), ivec2(gridSize.xy) - 1));
+		uint slice = uint(clamp(int(log(max(viewDepth, 1.0e-4f)) * sliceScale.z + sliceScale.w), 0, int(gridSize.z) - 1));
+		uvec2 cell = clusterCells[(slice * gridSize.y + tile.y) * gridSize.x + tile.x];
+		vec3 pointLighting = vec3(0.0f);
+		for (uint i = 0u; i < cell.y; i++) {
+			PointLight point = pointLights[clusterIndices[cell.x + i]];
+			vec3 toLight = point.positionRange.xyz - vertexFragmentPos;
+			float distance = length(toLight);
+			//smooth falloff that reaches zero at the light's range
+			float falloff = clamp(1.0f - (distance * distance) / (point.positionRange.w * point.positionRange.w), 0.0f, 1.0f);
+			vec3 pointDirection = toLight / max(distance, 1.0e-4f);
+			float pointImpact = max(dot(norm, pointDirection), 0.0f);
+			float pointSpecular = pow(max(dot(viewDir, reflect(-pointDirection, norm)), 0.0f), highlightSize);
+			pointLighting += falloff * falloff * (pointImpact + specularIntensity * pointSpecular) * point.color.rgb;
+		}
+
 		//texture holds color for all 3 components
-		vec4 textureColor = texture(uTexture, vertexTextureCoordinate * textureScale);
+		vec4 textureColor = texture(uTexture, vec3(vertexTextureCoordinate * textureScale, textureLayer));
+
+		//the lamp's direct light is what its shadow takes away, ambient stays
+		float lampVisibility = LampVisibility(vertexFragmentPos);
 
 		//Calculate phong value
-		vec3 phong = (ambient + fill + diffuse + fillDiffuse + specular) * textureColor.xyz;
+		vec3 phong = (ambient + fill + lampVisibility * (diffuse + specular) + fillDiffuse + pointLighting) * textureColor.xyz;
 
 		//Send lighting results to GPU
 		fragmentColor = vec4(phong, 1.0);
@@ -233,14 +645,26 @@ const GLchar* fragmentShaderSource = GLSL(440,
 const GLchar* lampVertexShaderSource = GLSL(440,
 	//vertex position data
 	layout(location = 0) in vec3 position;
+	//per-instance transform, locations 3-6
+	layout(location = 3) in mat4 model;
+	//per-instance mesh, picks its dequantization
+	layout(location = 11) in uint meshIndex;
 
 	//Uniforms
-	uniform mat4 model;
-	uniform mat4 view;
-	uniform mat4 projection;
+	layout(std140, binding = 0) uniform FrameData {
+		mat4 view;
+		mat4 projection;
+	};
+	const int MAX_MESHES = 16;
+	layout(std140, binding = 1) uniform MeshData {
+		vec4 positionOffsets[MAX_MESHES];
+		vec4 positionScales[MAX_MESHES];
+	};
+	invariant gl_Position;
 
 	void main() {
-		gl_Position = projection * view * model * vec4(position, 1.0f);
+		vec3 localPosition = positionOffsets[meshIndex].xyz + position * positionScales[meshIndex].xyz;
+		gl_Position = projection * view * model * vec4(localPosition, 1.0f);
 	}
 );
 
@@ -259,14 +683,26 @@ const GLchar* lampFragmentShaderSource = GLSL(440,
 const GLchar* fillVertexShaderSource = GLSL(440,
 	//Vertex position data
 	layout(location = 0) in vec3 position;
+	//per-instance transform, locations 3-6
+	layout(location = 3) in mat4 model;
+	//per-instance mesh, picks its dequantization
+	layout(location = 11) in uint meshIndex;
 
 	//Uniforms
-	uniform mat4 model;
-	uniform mat4 view;
-	uniform mat4 projection;
+	layout(std140, binding = 0) uniform FrameData {
+		mat4 view;
+		mat4 projection;
+	};
+	const int MAX_MESHES = 16;
+	layout(std140, binding = 1) uniform MeshData {
+		vec4 positionOffsets[MAX_MESHES];
+		vec4 positionScales[MAX_MESHES];
+	};
+	invariant gl_Position;
 
 	void main() {
-		gl_Position = projection * view * model * vec4(position, 1.0f);
+		vec3 localPosition = positionOffsets[meshIndex].xyz + position * positionScales[meshIndex].xyz;
+		gl_Position = projection * view * model * vec4(localPosition, 1.0f);
 	}
 );
 
@@ -279,6 +715,400 @@ const GLchar* fillFragmentShaderSource = GLSL(440,
 	}
 );
 
+//Depth pre-pass, every object's position exactly as the other vertex shaders compute it
+const GLchar* depthVertexShaderSource = GLSL(440,
+	layout(location = 0) in vec3 position;
+	layout(location = 3) in mat4 model;
+	layout(location = 11) in uint meshIndex;
+
+	layout(std140, binding = 0) uniform FrameData {
+		mat4 view;
+		mat4 projection;
+	};
+	const int MAX_MESHES = 16;
+	layout(std140, binding = 1) uniform MeshData {
+		vec4 positionOffsets[MAX_MESHES];
+		vec4 positionScales[MAX_MESHES];
+	};
+	invariant gl_Position;
+
+	void main() {
+		vec3 localPosition = positionOffsets[meshIndex].xyz + position * positionScales[meshIndex].xyz;
+		gl_Position = projection * view * model * vec4(localPosition, 1.0f);
+	}
+);
+
+//color writes are off during the pre-pass, depth is all it produces
+const GLchar* depthFragmentShaderSource = GLSL(440,
+	void main() {
+	}
+);
+
+//Lamp's shadow map, the lit objects seen from the lamp, drawn with depthFragmentShaderSource
+const GLchar* shadowVertexShaderSource = GLSL(440,
+	layout(location = 0) in vec3 position;
+	layout(location = 3) in mat4 model;
+	layout(location = 11) in uint meshIndex;
+
+	const int MAX_MESHES = 16;
+	layout(std140, binding = 1) uniform MeshData {
+		vec4 positionOffsets[MAX_MESHES];
+		vec4 positionScales[MAX_MESHES];
+	};
+	uniform mat4 lightViewProjection;
+
+	void main() {
+		vec3 localPosition = positionOffsets[meshIndex].xyz + position * positionScales[meshIndex].xyz;
+		gl_Position = lightViewProjection * model * vec4(localPosition, 1.0f);
+	}
+);
+
+//Deferred geometry pass, runs after vertexShaderSource and only stores what lighting needs
+const GLchar* gbufferFragmentShaderSource = GLSL(440,
+	in vec3 vertexNormal;
+	in vec2 vertexTextureCoordinate;
+	flat in float textureLayer;
+
+	layout(location = 0) out vec4 albedo;	//texture color, a of 0 asks the lighting pass to shade it
+	layout(location = 1) out vec4 normal;	//world space normal scaled into 0-1
+
+	uniform sampler2DArray uTexture;
+	uniform vec2 textureScale;
+
+	void main() {
+		albedo = vec4(texture(uTexture, vec3(vertexTextureCoordinate * textureScale, textureLayer)).rgb, 0.0f);
+		normal = vec4(normalize(vertexNormal) * 0.5f + 0.5f, 0.0f);
+	}
+);
+
+//Deferred lighting pass, one triangle that covers the screen
+const GLchar* lightingVertexShaderSource = GLSL(440,
+	void main() {
+		//corners at (-1,-1), (3,-1) and (-1,3) so the triangle's inside holds the whole screen
+		gl_Position = vec4(float((gl_VertexID & 1) << 2) - 1.0f, float((gl_VertexID & 2) << 1) - 1.0f, 0.0f, 1.0f);
+	}
+);
+
+//Same Phong terms as fragmentShaderSource, with the position rebuilt from the G-buffer's depth
+const GLchar* lightingFragmentShaderSource = GLSL(440,
+	out vec4 fragmentColor;
+
+	layout(std140, binding = 0) uniform FrameData {
+		mat4 view;
+		mat4 projection;
+		vec3 lightPos;
+		vec3 lightColor;
+		vec3 fillLightPos;
+		vec3 fillColor;
+		vec3 viewPos;
+		mat4 shadowViewProjection;
+		vec4 shadowParams;
+	};
+
+	layout(std140, binding = 2) uniform ClusterData {
+		uvec4 gridSize;
+		vec4 sliceScale;
+	};
+	struct PointLight {
+		vec4 positionRange;
+		vec4 color;
+	};
+	layout(std430, binding = 4) readonly buffer PointLights { PointLight pointLights[]; };
+	layout(std430, binding = 5) readonly buffer ClusterCells { uvec2 clusterCells[]; };
+	layout(std430, binding = 6) readonly buffer ClusterIndices { uint clusterIndices[]; };
+
+	uniform sampler2DShadow shadowMap;
+
+	//same PCF lookup as the forward shader
+	float LampVisibility(vec3 position) {
+		if (shadowParams.x == 0.0f) {
+			return 1.0f;
+		}
+		vec4 clip = shadowViewProjection * vec4(position, 1.0f);
+		vec3 coord = clip.xyz / clip.w * 0.5f + 0.5f;
+		if (clip.w <= 0.0f || coord.z >= 1.0f) {
+			return 1.0f;
+		}
+		float lit = 0.0f;
+		for (int i = 0; i < 4; i++) {
+			vec2 offset = vec2((i & 1) != 0 ? 1.0f : -1.0f, (i & 2) != 0 ? 1.0f : -1.0f);
+			lit += texture(shadowMap, vec3(coord.xy + offset * shadowParams.z, coord.z - shadowParams.y));
+		}
+		return lit * 0.25f;
+	}
+
+	uniform sampler2D gAlbedo;
+	uniform sampler2D gNormal;
+	uniform sampler2D gDepth;
+	uniform mat4 inverseViewProjection;
+
+	void main() {
+		ivec2 pixel = ivec2(gl_FragCoord.xy);
+		vec4 albedo = texelFetch(gAlbedo, pixel, 0);
+		float depth = texelFetch(gDepth, pixel, 0).r;
+		//the target gets the scene's depth too, so anything drawn after still depth tests
+		gl_FragDepth = depth;
+		//lamp, fill and background keep the color they were drawn with
+		if (albedo.a > 0.5f) {
+			fragmentColor = vec4(albedo.rgb, 1.0f);
+			return;
+		}
+
+		vec3 norm = normalize(texelFetch(gNormal, pixel, 0).xyz * 2.0f - 1.0f);
+		vec2 ndc = gl_FragCoord.xy / vec2(textureSize(gDepth, 0)) * 2.0f - 1.0f;
+		vec4 world = inverseViewProjection * vec4(ndc, depth * 2.0f - 1.0f, 1.0f);
+		vec3 fragmentPos = world.xyz / world.w;
+
+		//lamp and fill
+		vec3 ambient = 0.5f * lightColor;
+		vec3 fill = 0.8f * fillColor;
+		vec3 lightDirection = normalize(lightPos - fragmentPos);
+		vec3 fillLightDirection = normalize(fillLightPos - fragmentPos);
+		vec3 diffuse = max(dot(norm, lightDirection), 0.0f) * lightColor;
+		vec3 fillDiffuse = max(dot(norm, fillLightDirection), 0.0f) * fillColor;
+		float specularIntensity = 0.8f;
+		float highlightSize = 16.0f;
+		vec3 viewDir = normalize(viewPos - fragmentPos);
+		float specularComponent = pow(max(dot(viewDir, reflect(-lightDirection, norm)), 0.0f), highlightSize);
+		vec3 specular = specularIntensity * specularComponent * lightColor;
+
+		//point lights from this pixel's cluster
+		float viewDepth = -(view * vec4(fragmentPos, 1.0f)).z;
+		uvec2 tile = uvec2(min(ivec2(gl_FragCoord.xy * sliceScale.xy), ivec2(gridSize.xy) - 1));
+		uint slice = uint(clamp(int(log(max(viewDepth, 1.0e-4f)) * sliceScale.z + sliceScale.w), 0, int(gridSize.z) - 1));
+		uvec2 cell = clusterCells[(slice * gridSize.y + tile.y) * gridSize.x + tile.x];
+		vec3 pointLighting = vec3(0.0f);
+		for (uint i = 0u; i < cell.y; i++) {
+			PointLight point = pointLights[clusterIndices[cell.x + i]];
+			vec3 toLight = point.positionRange.xyz - fragmentPos;
+			float distance = length(toLight);
+			float falloff = clamp(1.0f - (distance * distance) / (point.positionRange.w * point.positionRange.w), 0.0f, 1.0f);
+			vec3 pointDirection = toLight / max(distance, 1.0e-4f);
+			float pointImpact = max(dot(norm, pointDirection), 0.0f);
+			float pointSpecular = pow(max(dot(viewDir, reflect(-pointDirection, norm)), 0.0f), highlightSize);
+			pointLighting += falloff * falloff * (pointImpact + specularIntensity * pointSpecular) * point.color.rgb;
+		}
+
+		vec3 phong = (ambient + fill + LampVisibility(fragmentPos) * (diffuse + specular) + fillDiffuse + pointLighting) * albedo.rgb;
+		fragmentColor = vec4(phong, 1.0f);
+	}
+);
+
+//Compute pass for GPU culling, one invocation per object
+//tests the object's sphere and box against the frustum, and its box against the depth pyramid
+//when occlusion is on, then writes a command for its LOD level to the object's own slot,
+//with no instances when it was culled
+const GLchar* cullComputeShaderSource = GLSL(440,
+	layout(local_size_x = 64) in;
+
+	//same layouts as GpuCullObject, GpuCullLod and DrawCommand
+	struct CullObject {
+		vec4 sphere;
+		vec4 boxMin;
+		vec4 boxMax;
+		uint mesh;
+		uint lodCount;
+		uint pass;
+		uint commandBase;
+	};
+	struct CullLod {
+		uint count;
+		uint firstIndex;
+		int baseVertex;
+		uint padding;
+	};
+	struct DrawCommand {
+		uint count;
+		uint instanceCount;
+		uint firstIndex;
+		int baseVertex;
+		uint baseInstance;
+	};
+
+	layout(std430, binding = 0) readonly buffer Objects { CullObject objects[]; };
+	layout(std430, binding = 1) readonly buffer Lods { CullLod lods[]; };
+	layout(std430, binding = 2) writeonly buffer Commands { DrawCommand commands[]; };
+
+	const uint MAX_LODS = 4u;
+
+	uniform uint objectCount;
+	uniform vec4 planes[6];					//inward facing frustum planes
+	uniform vec4 viewZ;						//row of the view matrix giving view space depth
+	uniform vec3 projectionW;				//w from depth, constant w, y scale of the projection
+	uniform vec3 lodSizes;					//projected size where each level hands over to the next
+	uniform bool useOcclusion;
+	uniform mat4 pyramidViewProjection;		//matrix the depth pyramid was drawn with
+	uniform vec2 pyramidSize;
+	uniform int pyramidLevels;
+	uniform sampler2D depthPyramid;			//farthest depth under each texel, per level
+
+	//true when the whole box was behind what last frame drew over it
+	bool Occluded(vec3 boxMin, vec3 boxMax) {
+		vec2 screenMin = vec2(1.0f);
+		vec2 screenMax = vec2(0.0f);
+		float nearest = 1.0f;
+		for (int i = 0; i < 8; i++) {
+			vec3 corner = vec3((i & 1) != 0 ? boxMax.x : boxMin.x, (i & 2) != 0 ? boxMax.y : boxMin.y,
+				(i & 4) != 0 ? boxMax.z : boxMin.z);
+			vec4 clip = pyramidViewProjection * vec4(corner, 1.0f);
+			//box reaches behind the camera, no screen rectangle to test
+			if (clip.w <= 0.0f) {
+				return false;
+			}
+			vec3 ndc = clip.xyz / clip.w;
+			screenMin = min(screenMin, ndc.xy * 0.5f + 0.5f);
+			screenMax = max(screenMax, ndc.xy * 0.5f + 0.5f);
+			nearest = min(nearest, ndc.z * 0.5f + 0.5f);
+		}
+		//clamped before the conversion, corners close to the camera plane project far off screen
+		ivec2 size = ivec2(pyramidSize);
+		ivec2 texelMin = min(ivec2(clamp(screenMin, 0.0f, 1.0f) * pyramidSize), size - 1);
+		ivec2 texelMax = min(ivec2(clamp(screenMax, 0.0f, 1.0f) * pyramidSize), size - 1);
+
+		//first level where the rectangle spans at most 2x2 texels, coordinates halve with each level
+		int level = 0;
+		while (level < pyramidLevels - 1 && any(greaterThan((texelMax >> level) - (texelMin >> level), ivec2(1)))) {
+			level++;
+		}
+		//the last texel of an odd sized level also covers the one the halving dropped
+		//level size worked out here, some drivers report the wrong size for the smallest level
+		ivec2 last = max(size >> level, ivec2(1)) - 1;
+		ivec2 a = min(texelMin >> level, last);
+		ivec2 b = min(texelMax >> level, last);
+		float farthest = max(max(texelFetch(depthPyramid, a, level).r, texelFetch(depthPyramid, ivec2(b.x, a.y), level).r),
+			max(texelFetch(depthPyramid, ivec2(a.x, b.y), level).r, texelFetch(depthPyramid, b, level).r));
+		return nearest > farthest;
+	}
+
+	//sphere first, then the box corner furthest along each plane normal
+	bool Visible(CullObject object) {
+		for (int p = 0; p < 6; p++) {
+			if (dot(planes[p].xyz, object.sphere.xyz) + planes[p].w < -object.sphere.w) {
+				return false;
+			}
+			vec3 corner = mix(object.boxMin.xyz, object.boxMax.xyz, greaterThanEqual(planes[p].xyz, vec3(0.0f)));
+			if (dot(planes[p].xyz, corner) + planes[p].w < 0.0f) {
+				return false;
+			}
+		}
+		return !(useOcclusion && Occluded(object.boxMin.xyz, object.boxMax.xyz));
+	}
+
+	void main() {
+		uint id = gl_GlobalInvocationID.x;
+		if (id >= objectCount) {
+			return;
+		}
+		CullObject object = objects[id];
+
+		//level of detail from the projected sphere, same estimate as SceneTable::SelectLods()
+		float z = dot(viewZ.xyz, object.sphere.xyz) + viewZ.w;
+		float w = projectionW.x * z + projectionW.y;
+		float size = w > object.sphere.w * abs(projectionW.x) ? object.sphere.w * projectionW.z / w : 1.0e30f;
+		uint level = 0u;
+		while (level + 1u < object.lodCount && size < lodSizes[level]) {
+			level++;
+		}
+
+		CullLod lod = lods[object.mesh * MAX_LODS + level];
+		DrawCommand command;
+		command.count = lod.count;
+		command.instanceCount = Visible(object) ? 1u : 0u;
+		command.firstIndex = lod.firstIndex;
+		command.baseVertex = lod.baseVertex;
+		//instances are packed in the same order as the objects
+		command.baseInstance = id;
+		commands[id] = command;
+	}
+);
+
+//Compacts the cull pass's commands, one work group per pass
+//the visible commands move to the front of the pass's region in the order the objects were packed,
+//so the draws keep the scene's draw order (front to back included) and the count is the pass's draw count
+//the group walks its pass 64 objects at a time, a prefix sum over the visible flags gives each its slot
+const GLchar* cullCompactShaderSource = GLSL(440,
+	layout(local_size_x = 64) in;
+
+	struct DrawCommand {
+		uint count;
+		uint instanceCount;
+		uint firstIndex;
+		int baseVertex;
+		uint baseInstance;
+	};
+
+	layout(std430, binding = 0) readonly buffer Passes { uvec2 passes[]; };		//first object, object count
+	layout(std430, binding = 1) readonly buffer Culled { DrawCommand culled[]; };
+	layout(std430, binding = 2) writeonly buffer Commands { DrawCommand commands[]; };
+	layout(std430, binding = 3) writeonly buffer Counts { uint counts[]; };
+
+	const uint GROUP_SIZE = 64u;
+	shared uint offsets[GROUP_SIZE];
+
+	void main() {
+		uint pass = gl_WorkGroupID.x;
+		uvec2 range = passes[pass];
+		uint local = gl_LocalInvocationID.x;
+		uint written = 0u;
+		for (uint first = 0u; first < range.y; first += GROUP_SIZE) {
+			uint id = range.x + first + local;
+			bool keep = first + local < range.y && culled[id].instanceCount != 0u;
+			offsets[local] = keep ? 1u : 0u;
+			barrier();
+			//inclusive scan, offsets[local] ends up as the visible objects up to and including this one
+			for (uint stride = 1u; stride < GROUP_SIZE; stride *= 2u) {
+				uint add = local >= stride ? offsets[local - stride] : 0u;
+				barrier();
+				offsets[local] += add;
+				barrier();
+			}
+			if (keep) {
+				commands[range.x + written + offsets[local] - 1u] = culled[id];
+			}
+			written += offsets[GROUP_SIZE - 1u];
+			//everyone has read the total before the next chunk overwrites it
+			barrier();
+		}
+		if (local == 0u) {
+			counts[pass] = written;
+		}
+	}
+);
+
+//Reduces depth into the pyramid one level per dispatch, level 0 is a straight copy of the depth
+//and every later texel keeps the farthest depth of the texels under it in the level above
+const GLchar* depthPyramidShaderSource = GLSL(440,
+	layout(local_size_x = 8, local_size_y = 8) in;
+
+	layout(r32f, binding = 0) uniform writeonly image2D destination;
+	uniform sampler2D source;
+	uniform int sourceLevel;
+	uniform bool reduce;				//false copies level 0 from the depth texture
+
+	void main() {
+		ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+		ivec2 size = imageSize(destination);
+		if (any(greaterThanEqual(texel, size))) {
+			return;
+		}
+		if (!reduce) {
+			imageStore(destination, texel, vec4(texelFetch(source, texel, 0).r));
+			return;
+		}
+
+		//2x2 block, widened to 3 on the last row or column when the level above was odd
+		ivec2 sourceSize = textureSize(source, sourceLevel);
+		ivec2 first = texel * 2;
+		ivec2 last = min(first + 1 + ivec2(equal(texel, size - 1)) * (sourceSize & 1), sourceSize - 1);
+		float farthest = 0.0f;
+		for (int y = first.y; y <= last.y; y++) {
+			for (int x = first.x; x <= last.x; x++) {
+				farthest = max(farthest, texelFetch(source, ivec2(x, y), sourceLevel).r);
+			}
+		}
+		imageStore(destination, texel, vec4(farthest));
+	}
+);
 
 //-------------------------------------------------------------------------------------------
 
@@ -288,47 +1118,144 @@ int main(int argc, char* argv[]) {
 		return EXIT_FAILURE;
 	}
 
-	//Create the info inside our mesh
+	//Profiler zones, one per stage of the frame
+	zoneTextures = profiler.AddZone("textures");
+	zoneScene = profiler.AddZone("scene");
+	zoneObjects = profiler.AddZone("objects", true);
+	zoneLamp = profiler.AddZone("lamp");
+	zoneFill = profiler.AddZone("fill");
+	zoneSwap = profiler.AddZone("swap");
+	zoneCull = profiler.AddZone("gpu cull");
+	zonePyramid = profiler.AddZone("depth pyramid");
+	zoneLights = profiler.AddZone("lights");
+	zoneLighting = profiler.AddZone("deferred");
+	zonePrepass = profiler.AddZone("prepass", true);
+	zoneShadow = profiler.AddZone("shadow");
+
+	//Instance buffer has to exist before the vao so it can point at it
+	glGenBuffers(1, &instanceVbo);
+	glGenBuffers(1, &drawCommandBuffer);
+
+	//Create the info inside our mesh, each one is appended to the shared buffers
 	CreateMesh(gMesh);
 	CreateMeshPlane(meshPlane);
 	CreateMeshCube(meshCube);
 	CreateMeshPyramid(meshPyr);
 	CreateMeshCylinder(meshCyl);
+	UploadMeshBuffers();
 
 	//Create shader program
+	programCache.Create();
+	double programStart = glfwGetTime();
 	if (!CreateShaderProgram(vertexShaderSource, fragmentShaderSource,
-		shaderProgramId)) {
+		shaderProgramId, shaderUniforms)) {
 		return EXIT_FAILURE;
 	}
 	if (!CreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource,
-		lampProgramId)) {
+		lampProgramId, lampUniforms)) {
 		return EXIT_FAILURE;
 	}
 	if (!CreateShaderProgram(fillVertexShaderSource, fillFragmentShaderSource,
-		fillProgramId)) {
+		fillProgramId, fillUniforms)) {
+		return EXIT_FAILURE;
+	}
+	if (!CreateShaderProgram(vertexShaderSource, gbufferFragmentShaderSource,
+		gbufferProgramId, gbufferUniforms)) {
+		return EXIT_FAILURE;
+	}
+	if (!CreateShaderProgram(lightingVertexShaderSource, lightingFragmentShaderSource,
+		lightingProgramId, lightingUniforms)) {
+		return EXIT_FAILURE;
+	}
+	glGenVertexArrays(1, &fullscreenVao);
+	if (!CreateShaderProgram(depthVertexShaderSource, depthFragmentShaderSource,
+		depthProgramId, depthUniforms)) {
+		return EXIT_FAILURE;
+	}
+	if (!CreateShaderProgram(shadowVertexShaderSource, depthFragmentShaderSource,
+		shadowProgramId, shadowUniforms)) {
+		return EXIT_FAILURE;
+	}
+
+	if (gpuCulling && !CreateGpuCuller()) {
+		return EXIT_FAILURE;
+	}
+	std::cout << "INFO: Shader programs ready in " << (glfwGetTime() - programStart) * 1000.0 << " ms" << std::endl;
+	programCache.PrintStats();
+
+	//Uniform buffer for the per-frame block, every program reads it from the same binding
+	glGenBuffers(1, &frameUbo);
+	glBindBuffer(GL_UNIFORM_BUFFER, frameUbo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UBO_BINDING, frameUbo);
+
+	//Queue every texture once up front into the shared array, Render() binds it once per frame
+	textureCache.CreateArray(TEXTURE_LAYER_SIZE, TEXTURE_LAYER_COUNT);
+	if (!textureCache.GetLayer("Orange-gloss-plastic.jpg", textureLayerSphere) ||
+		!textureCache.GetLayer("Table-wood.jpg", textureLayerPlane) ||
+		!textureCache.GetLayer("Dice-faces.jpg", textureLayerCube) ||
+		!textureCache.GetLayer("Green-plastic.jpg", textureLayerPyr) ||
+		!textureCache.GetLayer("Metal-brushed.jpg", textureLayerCyl)) {
 		return EXIT_FAILURE;
 	}
 
+	//Uniforms that never change between draws are set once here
 	glUseProgram(shaderProgramId);
+	// We set the texture as texture unit 0
+	glUniform1i(shaderUniforms.uTexture, 0);
+	glUniform1i(shaderUniforms.Get("shadowMap"), SHADOW_MAP_UNIT);
+	glUniform2fv(shaderUniforms.textureScale, 1, glm::value_ptr(textureScale));
+	glUseProgram(gbufferProgramId);
+	glUniform1i(gbufferUniforms.uTexture, 0);
+	glUniform2fv(gbufferUniforms.textureScale, 1, glm::value_ptr(textureScale));
+	glUseProgram(lightingProgramId);
+	glUniform1i(lightingUniforms.Get("gAlbedo"), GBUFFER_ALBEDO_UNIT);
+	glUniform1i(lightingUniforms.Get("gNormal"), GBUFFER_NORMAL_UNIT);
+	glUniform1i(lightingUniforms.Get("gDepth"), GBUFFER_DEPTH_UNIT);
+	glUniform1i(lightingUniforms.Get("shadowMap"), SHADOW_MAP_UNIT);
+
+	//shadow map stays bound to its unit, Render() redraws it whenever it goes stale
+	if (shadowMapSize > 0 && shadowMap.Create(shadowMapSize)) {
+		shadowMap.BindTexture();
+	}
 
 	projection = glm::perspective(glm::radians(camera.zoom),
-		(GLfloat)SCREEN_W / (GLfloat)SCREEN_H, 0.1f, 100.0f);
-
+		(GLfloat)SCREEN_W / (GLfloat)SCREEN_H, NEAR_PLANE, FAR_PLANE);
+
+	//every object goes into the scene table, Render() just walks it
+	BuildScene();
+	//point lights are rebinned every frame, the buffers stay bound to the same points throughout
+	lightClusters.Create();
+	lightClusters.Bind();
+	BuildLights();
 	
 	//Background Color in rgb and opacity
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
+	//headless runs the camera path into the offscreen target instead of the render loop
+	if (headless && !RenderHeadless()) {
+		return EXIT_FAILURE;
+	}
+
 	//render loop
-	while (!glfwWindowShouldClose(window)) {
+	while (!headless && !glfwWindowShouldClose(window)) {
 
 		//new per-frame timing for the camera
 		float currentFrame = glfwGetTime();
 		deltaTime = currentFrame - lastFrame;
 		lastFrame = currentFrame;
+		profiler.BeginFrame();
+		UpdateProfileTitle(currentFrame);
 
 		//input function
 		ProcessInput(window);
 
+		//swap in any textures the decode threads have finished
+		profiler.Begin(zoneTextures, true);
+		textureCache.Update(TEXTURE_UPLOAD_BUDGET);
+		profiler.End(zoneTextures);
+
 		//Render the Frame
 		Render();
 
@@ -336,69 +1263,97 @@ int main(int argc, char* argv[]) {
 	}
 
 	//delete mesh and shader program
-	DestroyMesh(gMesh);
-	DestroyMesh(meshPlane);
-	DestroyMesh(meshCube);
-	DestroyMesh(meshPyr);
-	DestroyMesh(meshCyl);
-
-	DestroyTexture(textureIdSphere);
-	DestroyTexture(textureIdPlane);
-	DestroyTexture(textureIdCube);
-	DestroyTexture(textureIdPyr);
-	DestroyTexture(textureIdCyl);
+	DestroyMeshBuffers();
+
+	//cache owns every texture it loaded
+	textureCache.PrintStats();
+	textureCache.Shutdown();
+	textureCache.Clear();
+
+	//final profile, also kept on disk for comparing runs
+	profiler.Print(std::cout);
+	profiler.WriteCsv("profile.csv");
+	if (shadowMap.Created()) {
+		std::cout << "INFO: Shadow map drawn " << shadowMap.renders << " times" << std::endl;
+	}
+	profiler.Clear();
 
 	DestroyShaderProgram(shaderProgramId);
 	DestroyShaderProgram(lampProgramId);
 	DestroyShaderProgram(fillProgramId);
+	DestroyShaderProgram(gbufferProgramId);
+	DestroyShaderProgram(lightingProgramId);
+	glDeleteVertexArrays(1, &fullscreenVao);
+	DestroyShaderProgram(depthProgramId);
+	DestroyShaderProgram(shadowProgramId);
+	shadowMap.Destroy();
+	gBuffer.Destroy();
+	glDeleteBuffers(1, &frameUbo);
+	glDeleteBuffers(1, &instanceVbo);
+	glDeleteBuffers(1, &drawCommandBuffer);
+	gpuCuller.Destroy();
+	lightClusters.Destroy();
 
 	//return function, cleaner than return 0
 	exit(EXIT_SUCCESS);
 }
 
-//Texture function to correct image flip at load
-void flipImageVertically(unsigned char* image, int width, int height, int channels) {
-	for (int i = 0; i < height / 2; i++) {
-		int index1 = i * width * channels;
-		int index2 = (height - 1 - i) * width * channels;
-
-		for (int j = width * channels; j > 0; j--) {
-			unsigned char tmp = image[index1];
-			image[index1] = image[index2];
-			image[index2] = tmp;
-			index1++;
-			index2++;
-		}
-	}
-}
-
 //Initialization function
 bool Initialize(int argc, char* argv[], GLFWwindow** window) {
+	if (!ParseOptions(argc, argv)) {
+		return false;
+	}
+
 	//GLFW initialization and configuration options
+#if defined(GLFW_PLATFORM_NULL)
+	if (headless) {
+		//no display on the node, the null platform (GLFW 3.4+) needs no window system
+		glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+	}
+#endif
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	if (headless) {
+		//software context (llvmpipe) through OSMesa, the window is never shown
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	}
 
 	//GLFW window creation
 	*window = glfwCreateWindow(SCREEN_W, SCREEN_H, WINDOW_TITLE, NULL, NULL);
+	if (*window == NULL && headless) {
+		//GLFW built without OSMesa (the stock Windows build), render in a hidden native window instead
+		std::cout << "INFO: No OSMesa context, headless mode uses a hidden window" << std::endl;
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_NATIVE_CONTEXT_API);
+		*window = glfwCreateWindow(SCREEN_W, SCREEN_H, WINDOW_TITLE, NULL, NULL);
+	}
 	if (*window == NULL) {
 		std::cout << "Error: GLFW window creation" << std::endl;
 		glfwTerminate();
 		return false;
 	}
 	glfwMakeContextCurrent(*window);
-	glfwSetFramebufferSizeCallback(*window, ResizeWindow);
-	//Mouse tracking
-	glfwSetCursorPosCallback(*window, MousePositionCallback);
-	glfwSetScrollCallback(*window, MouseScrollCallback);
-
-	//Tell GLFW to capture the mouse
-	glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+	if (!headless) {
+		glfwSetFramebufferSizeCallback(*window, ResizeWindow);
+		//Mouse tracking
+		glfwSetCursorPosCallback(*window, MousePositionCallback);
+		glfwSetScrollCallback(*window, MouseScrollCallback);
+
+		//Tell GLFW to capture the mouse
+		glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+	}
 
 	//GLEW Initialize
 	glewExperimental = GL_TRUE;
 	GLenum GlewInitResult = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	//GLEW 2.2+ built for GLX reports no display on an OSMesa context, the GL entry points still load
+	if (headless && GlewInitResult == GLEW_ERROR_NO_GLX_DISPLAY) {
+		GlewInitResult = GLEW_OK;
+	}
+#endif
 	if (GLEW_OK != GlewInitResult) {
 		std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
 		return false;
@@ -410,6 +1365,102 @@ bool Initialize(int argc, char* argv[], GLFWwindow** window) {
 	return true;
 }
 
+//Command line options
+//	--headless				render offscreen on an OSMesa context instead of opening a window
+//	--frames N				frames to render headless, defaults to one pass of the camera path
+//	--camera-path FILE		camera path script, see CameraPath.h
+//	--output DIR			existing directory for captured frames, defaults to frames
+//	--no-capture			render headless without writing frames, for throughput runs
+//	--benchmark				headless run without capture that reports timings, implies --headless
+//	--objects N				benchmark scene size, the lit objects are repeated on extra boards
+//	--json FILE				benchmark report file, - for stdout, defaults to benchmark.json
+//	--no-mesh-cache			always regenerate meshes instead of mapping the cache files
+//	--no-program-cache		always compile shaders instead of loading the program binaries
+//	--mapped-upload			upload meshes through mapped immutable buffers
+//	--packed-vertices		store vertices quantized to 16 bytes and decode them in the vertex shaders
+//	--gpu-cull				cull and pick LODs in a compute pass feeding indirect count draws
+//	--occlusion				also cull against last frame's depth, implies --gpu-cull
+//	--lights N				point lights scattered over the scene, shaded through the light clusters
+//	--deferred				start in deferred shading, G switches between forward and deferred
+//	--depth-prepass			lay down depth first and shade with an equal depth test
+//	--front-to-back			draw each pass nearest object first
+//	--shadow-size N			lamp shadow map resolution, 0 turns shadows off, defaults to SHADOW_MAP_SIZE
+bool ParseOptions(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) {
+		std::string option = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (option == "--headless") {
+			headless = true;
+		}
+		else if (option == "--frames" && hasValue) {
+			headlessFrames = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (option == "--camera-path" && hasValue) {
+			cameraPathFile = argv[++i];
+		}
+		else if (option == "--output" && hasValue) {
+			captureDirectory = argv[++i];
+		}
+		else if (option == "--no-capture") {
+			captureDirectory.clear();
+		}
+		else if (option == "--benchmark") {
+			benchmark = true;
+		}
+		else if (option == "--objects" && hasValue) {
+			benchmarkObjects = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (option == "--json" && hasValue) {
+			benchmarkJson = argv[++i];
+		}
+		else if (option == "--no-mesh-cache") {
+			meshCacheEnabled = false;
+		}
+		else if (option == "--no-program-cache") {
+			programCache.enabled = false;
+		}
+		else if (option == "--mapped-upload") {
+			mappedMeshUpload = true;
+		}
+		else if (option == "--packed-vertices") {
+			packedVertices = true;
+		}
+		else if (option == "--gpu-cull") {
+			gpuCulling = true;
+		}
+		else if (option == "--occlusion") {
+			gpuCulling = true;
+			occlusionCulling = true;
+		}
+		else if (option == "--lights" && hasValue) {
+			pointLightCount = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (option == "--deferred") {
+			deferredShading = true;
+		}
+		else if (option == "--depth-prepass") {
+			depthPrepass = true;
+		}
+		else if (option == "--front-to-back") {
+			frontToBack = true;
+		}
+		else if (option == "--shadow-size" && hasValue) {
+			shadowMapSize = atoi(argv[++i]);
+		}
+		else {
+			std::cout << "Error: unknown or incomplete option " << option << std::endl;
+			return false;
+		}
+	}
+
+	//benchmarks always run offscreen and never spend time writing frames
+	if (benchmark) {
+		headless = true;
+		captureDirectory.clear();
+	}
+	return true;
+}
+
 //process user key inputs
 void ProcessInput(GLFWwindow* window) {
 	static const float cameraSpeed = 2.5f;
@@ -440,11 +1491,28 @@ void ProcessInput(GLFWwindow* window) {
 	if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS) {
 		//Perspective projection for camera
 		projection = glm::perspective(glm::radians(camera.zoom),
-			(GLfloat)SCREEN_W / (GLfloat)SCREEN_H, 0.1f, 100.0f);
+			(GLfloat)SCREEN_W / (GLfloat)SCREEN_H, NEAR_PLANE, FAR_PLANE);
 	}
 	if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS) {
-		projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, 0.1f, 100.0f);
+		projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, NEAR_PLANE, FAR_PLANE);
 	}
+
+	//Print the profile once per press
+	static bool profileKeyDown = false;
+	bool profileKey = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+	if (profileKey && !profileKeyDown) {
+		profiler.Print(std::cout);
+	}
+	profileKeyDown = profileKey;
+
+	//Forward and deferred shading, also once per press
+	static bool deferredKeyDown = false;
+	bool deferredKey = glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS;
+	if (deferredKey && !deferredKeyDown) {
+		deferredShading = !deferredShading;
+		std::cout << "INFO: " << (deferredShading ? "Deferred" : "Forward") << " shading" << std::endl;
+	}
+	deferredKeyDown = deferredKey;
 }
 
 //resize view along with window
@@ -477,6 +1545,25 @@ void MouseScrollCallback(GLFWwindow* window, double xOffset, double yOffset) {
 
 //function for rendering each frame
 void Render() {
+	//lamp's shadow map, nothing is drawn unless the lamp or a lit object moved
+	UpdateShadowMap();
+
+	//viewport of the current target, the G-buffer and light clusters follow its size
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	profiler.pixelCount = (unsigned int)(viewport[2] * viewport[3]);
+	//deferred frames draw the scene into the G-buffer and light it into the current target afterwards
+	GLint target = 0;
+	if (deferredShading) {
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+		if (gBuffer.Resize(viewport[2], viewport[3])) {
+			gBuffer.Bind();
+		}
+		else {
+			deferredShading = false;
+		}
+	}
+
 	//Z buffer to handle draw errors in 3d
 	glEnable(GL_DEPTH_TEST);
 
@@ -484,630 +1571,554 @@ void Render() {
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	//set up model matrix object for the game piece
-	// For additional objects, copy everything except camera pieces for a separate mesh
+	//Per-frame data shared by every program, uploaded once instead of once per object
 	//---------------------------------------------------------------------------------
-	//Set place in scene
-	glm::mat4 model = glm::translate(piecePos) * glm::scale(pieceScale);
-
+	FrameData frame;
 	//camera transformation
-	glm::mat4 view = camera.GetViewMatrix();
-
-	//Load texture
-	const char* texFilename = "Orange-gloss-plastic.jpg";
-	if (!CreateTexture(texFilename, textureIdSphere)) {
-		std::cout << "Failed to load texture" << texFilename << std::endl;
-		return;
-	}
-
-	//VAO and VBO activation
-	glBindVertexArray(gMesh.vao);
-	//Commenting this line out will remove the object
-	glUseProgram(shaderProgramId);
-	// We set the texture as texture unit 0
-	glUniform1i(glGetUniformLocation(shaderProgramId, "uTexture"), 0);
-
-	//Retrieve and pass matrices to shader program
-	GLint modelLoc = glGetUniformLocation(shaderProgramId, "model");
-	GLint viewLoc = glGetUniformLocation(shaderProgramId, "view");
-	GLint projLoc = glGetUniformLocation(shaderProgramId, "projection");
-
-	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-	//Reference matrix uniforms from the object shader for color and position
-	GLint objectColorLoc = glGetUniformLocation(shaderProgramId, "objectColor");
-	//Location for light
-	GLint lightColorLoc = glGetUniformLocation(shaderProgramId, "lightColor");
-	GLint lightPositionLoc = glGetUniformLocation(shaderProgramId, "lightPos");
-	//Reference for fill light
-	GLint fillColorLoc = glGetUniformLocation(shaderProgramId, "fillLightColor");
-	GLint fillPosLoc = glGetUniformLocation(shaderProgramId, "fillLightPos");
-	//Reference for Camera
-	GLint viewPositionLoc = glGetUniformLocation(shaderProgramId, "viewPos");
-
-	//pass info to the shader variables
-	glUniform3f(objectColorLoc, pieceColor.r, pieceColor.g, pieceColor.b);
-	//for main light
-	glUniform3f(lightColorLoc, lampColor.r, lampColor.g, lampColor.b);
-	glUniform3f(lightPositionLoc, lampPos.x, lampPos.y, lampPos.z);
-	//for Fill light
-	glUniform3f(fillColorLoc, fillColor.r, fillColor.g, fillColor.b);
-	glUniform3f(fillPosLoc, fillPos.x, fillPos.y, fillPos.z);
-
+	frame.view = camera.GetViewMatrix();
+	frame.projection = projection;
+	//main light and fill light
+	frame.lightPos = glm::vec4(lampPos, 1.0f);
+	frame.lightColor = glm::vec4(lampColor, 1.0f);
+	frame.fillLightPos = glm::vec4(fillPos, 1.0f);
+	frame.fillColor = glm::vec4(fillColor, 1.0f);
 	//Camera
-	const glm::vec3 cameraPosition = camera.Position;
-	glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-	GLint textureScaleLoc = glGetUniformLocation(shaderProgramId, "textureScale");
-	glUniform2fv(textureScaleLoc, 1, glm::value_ptr(textureScale));
-
-	//Texture activation
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, textureIdSphere);
-
-	//Draw triangles, using nIndices means you can use this statement for 3d as well
-	glDrawElements(GL_TRIANGLES, gMesh.nIndices, GL_UNSIGNED_SHORT, NULL);
-	//--------------------------------------------------------------------------------------
-
-	//set up model matrix object for the plane
-	//--------------------------------------------------------------------------------------
-	model = glm::translate(planePos) * glm::scale(planeScale);
-
-	//Load texture
-	texFilename = "Table-wood.jpg";
-	if (!CreateTexture(texFilename, textureIdPlane)) {
-		std::cout << "Failed to load texture" << texFilename << std::endl;
-		return;
+	frame.viewPos = glm::vec4(camera.Position, 1.0f);
+	//lamp shadows, sampled from whatever the map last drew
+	frame.shadowViewProjection = shadowMap.ViewProjection();
+	frame.shadowParams = glm::vec4(shadowMap.Drawn() ? 1.0f : 0.0f, SHADOW_DEPTH_BIAS, shadowMap.TexelSize(), 0.0f);
+
+	glBindBuffer(GL_UNIFORM_BUFFER, frameUbo);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &frame);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	//point lights binned for this view, clusters are in view space so this follows the camera
+	{
+		ProfileScope lightsZone(profiler, zoneLights, false);
+		lightClusters.Build(frame.view, frame.projection, viewport[2], viewport[3], NEAR_PLANE, FAR_PLANE);
 	}
 
+	//Frustum culling, objects outside the view never reach a draw
+	Frustum frustum;
+	frustum.Extract(frame.projection * frame.view);
+	if (gpuCulling) {
+		DrawSceneGpuCulled(frame, frustum);
+	}
+	else {
+		DrawSceneCpuCulled(frame, frustum);
+	}
 
-	//texture with the program
-	glUniform1i(glGetUniformLocation(shaderProgramId, "uTexture"), 0);
-
-	//Retrieve and pass matrices to shader program
-	modelLoc = glGetUniformLocation(shaderProgramId, "model");
-	viewLoc = glGetUniformLocation(shaderProgramId, "view");
-	projLoc = glGetUniformLocation(shaderProgramId, "projection");
-
-	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-	//Reference matrix uniforms from object shader for color and position
-	objectColorLoc = glGetUniformLocation(shaderProgramId, "objectColor");
-	//Location for light
-	lightColorLoc = glGetUniformLocation(shaderProgramId, "lightColor");
-	lightPositionLoc = glGetUniformLocation(shaderProgramId, "lightPos");
-	//Reference for fill light
-	fillColorLoc = glGetUniformLocation(shaderProgramId, "fillLightColor");
-	fillPosLoc = glGetUniformLocation(shaderProgramId, "fillLightPos");
-	//pass info to shader variables
-	glUniform3f(objectColorLoc, planeColor.r, planeColor.g, planeColor.b);
-	glUniform3f(lightColorLoc, lampColor.r, lampColor.g, lampColor.b);
-	glUniform3f(lightPositionLoc, lampPos.x, lampPos.y, lampPos.z);
-	//for Fill light
-	glUniform3f(fillColorLoc, fillColor.r, fillColor.g, fillColor.b);
-	glUniform3f(fillPosLoc, fillPos.x, fillPos.y, fillPos.z);
-
-	glBindVertexArray(meshPlane.vao);
-
-	//Texture activation
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, textureIdPlane);
-
-	glDrawElements(GL_TRIANGLES, meshPlane.nIndices, GL_UNSIGNED_SHORT, NULL);
-	//--------------------------------------------------------------------------------------
-
-	//set up model matrix object for the cube
-	//--------------------------------------------------------------------------------------
-	model = glm::translate(cubePos) * glm::scale(cubeScale);
+	//every pixel is shaded once, against whatever ended up in front
+	if (deferredShading) {
+		ProfileScope lightingZone(profiler, zoneLighting, true);
+		glBindFramebuffer(GL_FRAMEBUFFER, target);
+		LightGBuffer(frame);
+	}
 
-	//cube texture
-	texFilename = "Dice-faces.jpg";
-	if (!CreateTexture(texFilename, textureIdCube)) {
-		std::cout << "Failed to load texture" << texFilename << std::endl;
-		return;
+	//unassign the vertex array
+	glBindVertexArray(0);
+	//sawp buffers and poll for input events
+	//nothing to present when rendering offscreen
+	if (!headless) {
+		ProfileScope swapZone(profiler, zoneSwap, true);
+		glfwSwapBuffers(window);
 	}
+}
 
-	glUniform1i(glGetUniformLocation(shaderProgramId, "uTexture"), 0);
+//Culls and picks LODs on the CPU, then draws each run of batches with one multi-draw
+void DrawSceneCpuCulled(const FrameData& frame, const Frustum& frustum) {
+	//CPU side scene work, culling through the instance upload
+	profiler.Begin(zoneScene, false);
+	if (frontToBack) {
+		scene.SortFrontToBack(camera.Position);
+	}
 
-	//Retrieve and pass matrices to shader program
-	modelLoc = glGetUniformLocation(shaderProgramId, "model");
-	viewLoc = glGetUniformLocation(shaderProgramId, "view");
-	projLoc = glGetUniformLocation(shaderProgramId, "projection");
+	//Frustum culling, objects outside the view never reach the instance buffer
+	unsigned int culled = scene.Cull(frustum);
+	if (culled != lastCulledCount) {
+		std::cout << "INFO: Frustum culled " << culled << " of " << scene.Size() << " objects" << std::endl;
+		lastCulledCount = culled;
+	}
 
-	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+	//Level of detail for each object from its size on screen
+	scene.SelectLods(frame.view, frame.projection, LOD_SCREEN_SIZES, LOD_HYSTERESIS);
 
-	//Reference matrix uniforms from the object shader for color and position
-	objectColorLoc = glGetUniformLocation(shaderProgramId, "objectColor");
-	//location for light
-	lightColorLoc = glGetUniformLocation(shaderProgramId, "lightColor");
-	lightPositionLoc = glGetUniformLocation(shaderProgramId, "lightPos");
-	//Reference for fill light
-	fillColorLoc = glGetUniformLocation(shaderProgramId, "fillLightColor");
-	fillPosLoc = glGetUniformLocation(shaderProgramId, "fillLightPos");
+	//Pack visible objects into the instance buffer, every group sharing a mesh and state is one draw
+	//--------------------------------------------------------------------------------------
+	//normal matrices only rebuild for frames where something moved
+	scene.UpdateNormalMatrices();
+	scene.BuildInstances(instances, instanceBatches);
 
-	//pass info to shader variables
-	glUniform3f(objectColorLoc, cubeColor.r, cubeColor.g, cubeColor.b);
-	//for main light
-	glUniform3f(lightColorLoc, lampColor.r, lampColor.g, lampColor.b);
-	glUniform3f(lightPositionLoc, lampPos.x, lampPos.y, lampPos.z);
-	//for Fill light
-	glUniform3f(fillColorLoc, fillColor.r, fillColor.g, fillColor.b);
-	glUniform3f(fillPosLoc, fillPos.x, fillPos.y, fillPos.z);
+	//one indirect command per batch, offsets point into the shared buffers
+	BuildDrawCommands(instanceBatches, drawCommands);
+	//a still scene uploads nothing, a moving one only the entries that changed
+	UpdateChangedRanges(GL_ARRAY_BUFFER, instanceVbo, instances, uploadedInstances);
+	UpdateChangedRanges(GL_DRAW_INDIRECT_BUFFER, drawCommandBuffer, drawCommands, uploadedCommands);
+	profiler.End(zoneScene);
 
-	glBindVertexArray(meshCube.vao);
+	GLuint boundProgram = 0;
+	GLuint boundTexture = 0;
 
-	//Texture activation
+	//Texture activation, lit objects all share the array so this usually binds once a frame
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, textureIdCube);
-	
-	glDrawElements(GL_TRIANGLES, meshCube.nIndices, GL_UNSIGNED_SHORT, NULL);
-	//--------------------------------------------------------------------------------------
-
-	//set up model matrix object for the pyramid
-	//--------------------------------------------------------------------------------------
-	model = glm::translate(pyrPos) * glm::scale(pyrScale);
-
-	//pyramid texture
-	texFilename = "Green-plastic.jpg";
-	if (!CreateTexture(texFilename, textureIdPyr)) {
-		std::cout << "Failed to load texture" << texFilename << std::endl;
-		return;
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	//every mesh is in the shared buffers, so the vao and command buffer are bound once
+	glBindVertexArray(meshVao);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawCommandBuffer);
+
+	//pre-pass draws every batch with the depth program, only a change of index type splits it
+	if (depthPrepass) {
+		ProfileScope prepassZone(profiler, zonePrepass, true);
+		SetDepthPass(DEPTH_PREPASS);
+		DrawByIndexType(instanceBatches);
+		SetDepthPass(DEPTH_EQUAL);
 	}
 
-	glUniform1i(glGetUniformLocation(shaderProgramId, "uTexture"), 0);
-
-	//Retrieve and pass matrices to shader program
-	modelLoc = glGetUniformLocation(shaderProgramId, "model");
-	viewLoc = glGetUniformLocation(shaderProgramId, "view");
-	projLoc = glGetUniformLocation(shaderProgramId, "projection");
-
-	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-	//Reference matrix uniforms from the object shader for color and position
-	objectColorLoc = glGetUniformLocation(shaderProgramId, "objectColor");
-	//location for light
-	lightColorLoc = glGetUniformLocation(shaderProgramId, "lightColor");
-	lightPositionLoc = glGetUniformLocation(shaderProgramId, "lightPos");
-	//Reference for fill light
-	fillColorLoc = glGetUniformLocation(shaderProgramId, "fillLightColor");
-	fillPosLoc = glGetUniformLocation(shaderProgramId, "fillLightPos");
+	//batches come sorted, so each run with the same program, texture and index type is one multi-draw
+	size_t start = 0;
+	while (start < instanceBatches.size()) {
+		const InstanceBatch& batch = instanceBatches[start];
+		size_t end = start + 1;
+		while (end < instanceBatches.size() && instanceBatches[end].program == batch.program &&
+			instanceBatches[end].texture == batch.texture && instanceBatches[end].indexType == batch.indexType) {
+			end++;
+		}
 
-	//pass info to the shader variables
-	glUniform3f(objectColorLoc, pyrColor.r, pyrColor.g, pyrColor.b);
-	//for main light
-	glUniform3f(lightColorLoc, lampColor.r, lampColor.g, lampColor.b);
-	glUniform3f(lightPositionLoc, lampPos.x, lampPos.y, lampPos.z);
-	//for Fill light
-	glUniform3f(fillColorLoc, fillColor.r, fillColor.g, fillColor.b);
-	glUniform3f(fillPosLoc, fillPos.x, fillPos.y, fillPos.z);
+		if (batch.program != boundProgram) {
+			//each program is its own pass in the profile
+			if (boundProgram != 0) {
+				profiler.End(PassZone(boundProgram));
+			}
+			boundProgram = batch.program;
+			profiler.Begin(PassZone(boundProgram), true);
+			glUseProgram(DrawProgram(boundProgram));
+		}
+		//untextured passes don't sample, so they leave the array bound
+		if (batch.texture != 0 && batch.texture != boundTexture) {
+			boundTexture = batch.texture;
+			glBindTexture(GL_TEXTURE_2D_ARRAY, boundTexture);
+		}
 
+		//Draw every batch in the run, each command picks its mesh, LOD range and instances
+		glMultiDrawElementsIndirect(GL_TRIANGLES, batch.indexType, (void*)(start * sizeof(DrawCommand)),
+			(GLsizei)(end - start), 0);
+		start = end;
+	}
+	if (boundProgram != 0) {
+		profiler.End(PassZone(boundProgram));
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	if (depthPrepass) {
+		SetDepthPass(DEPTH_NORMAL);
+	}
+}
 
-	glBindVertexArray(meshPyr.vao);
-	
-	//Texture activation
+//Culls on the GPU, the compute pass writes each pass's commands and count and the draws read them
+//straight from the buffers, the CPU only packs the scene and uploads what changed
+void DrawSceneGpuCulled(const FrameData& frame, const Frustum& frustum) {
+	//every row goes up, visible or not, and only the rows that changed are uploaded
+	profiler.Begin(zoneScene, false);
+	if (frontToBack) {
+		scene.SortFrontToBack(camera.Position);
+	}
+	scene.UpdateNormalMatrices();
+	BuildCullObjects(scene, cullObjects, instances, cullPasses);
+	UpdateChangedRanges(GL_ARRAY_BUFFER, instanceVbo, instances, uploadedInstances);
+	profiler.End(zoneScene);
+
+	//frustum, occlusion and LOD for every object in one dispatch
+	profiler.Begin(zoneCull, true);
+	gpuCuller.Cull(cullObjects, cullPasses.size(), frustum, frame.view, frame.projection,
+		LOD_SCREEN_SIZES, occlusionCulling);
+	profiler.End(zoneCull);
+
+	GLuint boundProgram = 0;
+	GLuint boundTexture = 0;
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, textureIdPyr);
-	
-	glDrawElements(GL_TRIANGLES, meshPyr.nIndices, GL_UNSIGNED_SHORT, NULL);
-	//--------------------------------------------------------------------------------------
-
-	//set up model matrix object for the Cylinder
-	//--------------------------------------------------------------------------------------
-	model = glm::translate(cylPos) * glm::scale(cylScale);;
-
-	//cylinder texture
-	texFilename = "Metal-brushed.jpg";
-	if (!CreateTexture(texFilename, textureIdCyl)) {
-		std::cout << "Failed to load texture" << texFilename << std::endl;
-		return;
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	glBindVertexArray(meshVao);
+
+	//pre-pass runs the same commands as the passes below with the depth program
+	if (depthPrepass) {
+		ProfileScope prepassZone(profiler, zonePrepass, true);
+		SetDepthPass(DEPTH_PREPASS);
+		for (size_t i = 0; i < cullPasses.size(); i++) {
+			gpuCuller.Draw(cullPasses[i], (GLuint)i);
+		}
+		SetDepthPass(DEPTH_EQUAL);
 	}
 
+	//one indirect count draw per pass, how many commands it runs is only known to the GPU
+	for (size_t i = 0; i < cullPasses.size(); i++) {
+		const GpuCullPass& pass = cullPasses[i];
+		if (pass.program != boundProgram) {
+			if (boundProgram != 0) {
+				profiler.End(PassZone(boundProgram));
+			}
+			boundProgram = pass.program;
+			profiler.Begin(PassZone(boundProgram), true);
+			glUseProgram(DrawProgram(boundProgram));
+		}
+		if (pass.texture != 0 && pass.texture != boundTexture) {
+			boundTexture = pass.texture;
+			glBindTexture(GL_TEXTURE_2D_ARRAY, boundTexture);
+		}
+		gpuCuller.Draw(pass, (GLuint)i);
+	}
+	if (boundProgram != 0) {
+		profiler.End(PassZone(boundProgram));
+	}
+	if (depthPrepass) {
+		SetDepthPass(DEPTH_NORMAL);
+	}
 
-	glUniform1i(glGetUniformLocation(shaderProgramId, "uTexture"), 0);
-
-	//Retrieve and pass matrices to shader program
-	modelLoc = glGetUniformLocation(shaderProgramId, "model");
-	viewLoc = glGetUniformLocation(shaderProgramId, "view");
-	projLoc = glGetUniformLocation(shaderProgramId, "projection");
-
-	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-	//Reference matrix uniforms from the object shader for color and position
-	objectColorLoc = glGetUniformLocation(shaderProgramId, "objectColor");
-	//location for light
-	lightColorLoc = glGetUniformLocation(shaderProgramId, "lightColor");
-	lightPositionLoc = glGetUniformLocation(shaderProgramId, "lightPos");
-	//Reference for fill light
-	fillColorLoc = glGetUniformLocation(shaderProgramId, "fillLightColor");
-	fillPosLoc = glGetUniformLocation(shaderProgramId, "fillLightPos");
-
-	//pass info to the shader variables
-	glUniform3f(objectColorLoc, cylColor.r, cylColor.g, cylColor.b);
-	//for main light
-	glUniform3f(lightColorLoc, lampColor.r, lampColor.g, lampColor.b);
-	glUniform3f(lightPositionLoc, lampPos.x, lampPos.y, lampPos.z);
-	//for Fill light
-	glUniform3f(fillColorLoc, fillColor.r, fillColor.g, fillColor.b);
-	glUniform3f(fillPosLoc, fillPos.x, fillPos.y, fillPos.z);
-
-	glBindVertexArray(meshCyl.vao);
-
-	//Texture activation
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, textureIdCyl);
-	
-	glDrawElements(GL_TRIANGLES, meshCyl.nIndices, GL_UNSIGNED_SHORT, NULL);
-	
-	//Draw light: Lamp
-	//--------------------------------------------------------------------------------------
-	glUseProgram(lampProgramId);
-
-	//transform light as a visual cue for the light source
-	model = glm::translate(lampPos) * glm::scale(lampScale);
+	//this frame's depth is what next frame's objects are tested against
+	if (occlusionCulling) {
+		ProfileScope pyramidZone(profiler, zonePyramid, true);
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		gpuCuller.BuildDepthPyramid(viewport[2], viewport[3], frame.projection * frame.view);
+	}
+}
 
-	//Reference matrix uniforms from lamp shader program
-	modelLoc = glGetUniformLocation(lampProgramId, "model");
-	viewLoc = glGetUniformLocation(lampProgramId, "view");
-	projLoc = glGetUniformLocation(lampProgramId, "projection");
+//Renders every frame of the camera path into the offscreen target and reads each one back to disk
+//input and mouse callbacks aren't used, the camera only moves through cameraPath
+bool RenderHeadless() {
+	if (!cameraPathFile.empty()) {
+		if (!cameraPath.Load(cameraPathFile.c_str())) {
+			return false;
+		}
+	}
+	else {
+		cameraPath.LoadDefault();
+	}
+	unsigned int frames = headlessFrames > 0 ? headlessFrames : cameraPath.TotalFrames();
 
-	//Pass matrix data to the lamp shader program's matrix
-	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+	if (!frameCapture.Create(SCREEN_W, SCREEN_H, captureDirectory)) {
+		return false;
+	}
+	//every frame should show final textures, not placeholders
+	textureCache.Flush();
+	frameCapture.Bind();
+
+	deltaTime = HEADLESS_FRAME_TIME;
+	unsigned int warmup = benchmark ? BENCHMARK_WARMUP_FRAMES : 0;
+	//CPU time spent submitting each measured frame
+	SampleWindow submission(frames);
+	double start = glfwGetTime();
+	for (unsigned int frame = 0; frame < warmup + frames; frame++) {
+		if (frame == warmup) {
+			//timing starts with the GPU idle so warmup work isn't counted
+			glFinish();
+			start = glfwGetTime();
+		}
+		profiler.BeginFrame();
+		cameraPath.Apply(camera, frame, deltaTime);
 
-	//Use the lowest polygon object as a reference point, will also look like studio lighting rather than a random cube
-	glDrawElements(GL_TRIANGLES, meshPlane.nIndices, GL_UNSIGNED_SHORT, NULL);
-	//-----------------------------------------------------------------------------------------
+		double submitStart = glfwGetTime();
+		Render();
+		if (frame >= warmup) {
+			submission.Add((float)((glfwGetTime() - submitStart) * 1000.0));
+			frameCapture.Capture(frame - warmup);
+		}
+	}
+	//wait for the last frames so their GPU time is counted
+	glFinish();
+	frameCapture.Finish();
+	double elapsed = glfwGetTime() - start;
+
+	std::cout << "INFO: Headless rendered " << frames << " frames in " << elapsed << " s ("
+		<< (elapsed > 0.0 ? frames / elapsed : 0.0) << " frames/s), wrote " << frameCapture.framesWritten << std::endl;
+	frameCapture.Destroy();
+
+	if (benchmark) {
+		BenchmarkResult result;
+		result.renderer = (const char*)glGetString(GL_RENDERER);
+		result.objects = (unsigned int)scene.Size();
+		result.frames = frames;
+		result.seconds = elapsed;
+		result.submission = submission.Compute();
+		result.peakResidentBytes = PeakResidentBytes();
+		if (!WriteBenchmarkJson(result, benchmarkJson)) {
+			return false;
+		}
+	}
+	return true;
+}
 
+//Sets up GPU culling, falling back to CPU culling when the driver can't run it
+//false only when the cull shaders fail to build
+bool CreateGpuCuller() {
+	if (!GpuCuller::Supported()) {
+		std::cout << "INFO: GPU culling needs compute shaders and indirect count draws, culling on the CPU" << std::endl;
+		gpuCulling = false;
+		occlusionCulling = false;
+		return true;
+	}
+	if (!gpuCuller.Create(cullComputeShaderSource, cullCompactShaderSource, occlusionCulling ? depthPyramidShaderSource : nullptr, &programCache)) {
+		return false;
+	}
 
-	//Draw light: fill light
-	//-----------------------------------------------------------------------------------------
-	glUseProgram(fillProgramId);
+	//every mesh's LOD ranges in the shared buffers, GPU_CULL_MAX_LODS slots per mesh
+	std::vector<GpuCullLod> lods(MESH_COUNT * GPU_CULL_MAX_LODS);
+	for (unsigned int mesh = 0; mesh < MESH_COUNT; mesh++) {
+		for (unsigned int level = 0; level < meshes[mesh]->nLods && level < GPU_CULL_MAX_LODS; level++) {
+			GpuCullLod& lod = lods[mesh * GPU_CULL_MAX_LODS + level];
+			lod.count = meshes[mesh]->lods[level].indexCount;
+			lod.firstIndex = meshes[mesh]->firstIndex + meshes[mesh]->lods[level].firstIndex;
+			lod.baseVertex = meshes[mesh]->baseVertex + meshes[mesh]->lods[level].baseVertex;
+			lod.padding = 0;
+		}
+	}
+	gpuCuller.SetLods(lods);
+	return true;
+}
 
-	//transform light as a visual cue for light source
-	model = glm::translate(fillPos) * glm::scale(fillScale);
+//Program a scene row's program is drawn with, lit objects go to the G-buffer when shading is deferred
+GLuint DrawProgram(GLuint programId) {
+	if (deferredShading && programId == shaderProgramId) {
+		return gbufferProgramId;
+	}
+	return programId;
+}
 
-	//Reference matrix uniforms
-	modelLoc = glGetUniformLocation(fillProgramId, "model");
-	viewLoc = glGetUniformLocation(fillProgramId, "view");
-	projLoc = glGetUniformLocation(fillProgramId, "projection");
+//Depth test, depth writes and color writes for one stage of a frame drawn with the pre-pass
+void SetDepthPass(DepthPass pass) {
+	if (pass == DEPTH_PREPASS) {
+		glUseProgram(depthProgramId);
+	}
+	GLboolean color = pass == DEPTH_PREPASS ? GL_FALSE : GL_TRUE;
+	glColorMask(color, color, color, color);
+	glDepthMask(pass == DEPTH_EQUAL ? GL_FALSE : GL_TRUE);
+	glDepthFunc(pass == DEPTH_EQUAL ? GL_EQUAL : GL_LESS);
+}
 
-	//Pass matrix data to fill shader program's matrix
-	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+//Full-screen lighting pass over the G-buffer into the bound target, writes its color and depth
+void LightGBuffer(const FrameData& frame) {
+	glUseProgram(lightingProgramId);
+	glm::mat4 inverseViewProjection = glm::inverse(frame.projection * frame.view);
+	glUniformMatrix4fv(lightingUniforms.Get("inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+	gBuffer.BindTextures();
+	//every pixel passes, the depth test stays on only so the G-buffer's depth is written
+	glDepthFunc(GL_ALWAYS);
+	glBindVertexArray(fullscreenVao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glDepthFunc(GL_LESS);
+}
 
-	glDrawElements(GL_TRIANGLES, meshPlane.nIndices, GL_UNSIGNED_SHORT, NULL);
-	//------------------------------------------------------------------------------------------
+//One indirect command per batch, in the same order
+void BuildDrawCommands(const std::vector<InstanceBatch>& batches, std::vector<DrawCommand>& commands) {
+	commands.clear();
+	for (size_t i = 0; i < batches.size(); i++) {
+		const InstanceBatch& batch = batches[i];
+		const GLMesh& mesh = *meshes[batch.mesh];
+		const MeshLod& lod = mesh.lods[batch.lod];
+		DrawCommand command;
+		command.count = lod.indexCount;
+		command.instanceCount = batch.instanceCount;
+		command.firstIndex = mesh.firstIndex + lod.firstIndex;
+		command.baseVertex = mesh.baseVertex + lod.baseVertex;
+		command.baseInstance = batch.firstInstance;
+		commands.push_back(command);
+	}
+}
 
+//Draws every batch with whatever program is bound, only a change of index type splits the multi-draw
+//the batches' commands have to be in the bound indirect buffer in the same order
+void DrawByIndexType(const std::vector<InstanceBatch>& batches) {
+	size_t first = 0;
+	while (first < batches.size()) {
+		size_t last = first + 1;
+		while (last < batches.size() && batches[last].indexType == batches[first].indexType) {
+			last++;
+		}
+		glMultiDrawElementsIndirect(GL_TRIANGLES, batches[first].indexType, (void*)(first * sizeof(DrawCommand)),
+			(GLsizei)(last - first), 0);
+		first = last;
+	}
+}
 
-	//unassign the vertex array
+//Redraws the lamp's shadow map when it's stale, every lit object casts whether or not the camera sees it
+//The casters go through the shared instance and command buffers, the uploaded copies track that so
+//the scene's own upload afterwards only sends what differs
+void UpdateShadowMap() {
+	if (!shadowMap.Created() || !shadowMap.Stale(lampPos, scene.transformVersion)) {
+		return;
+	}
+	ProfileScope shadowZone(profiler, zoneShadow, true);
+
+	//box around every caster for the light's frustum
+	glm::vec3 low(1.0e30f);
+	glm::vec3 high(-1.0e30f);
+	for (size_t row = 0; row < scene.Size(); row++) {
+		if (scene.programs[row] == shaderProgramId) {
+			low = glm::min(low, scene.worldMins[row]);
+			high = glm::max(high, scene.worldMaxs[row]);
+		}
+	}
+	if (low.x > high.x) {
+		return;
+	}
+	shadowMap.Fit(lampPos, low, high);
+
+	//same instance data the scene packs, so rows that are also on screen upload nothing twice
+	scene.UpdateNormalMatrices();
+	scene.BuildCasterInstances(shaderProgramId, shadowInstances, shadowBatches);
+	BuildDrawCommands(shadowBatches, shadowCommands);
+	UpdateChangedRanges(GL_ARRAY_BUFFER, instanceVbo, shadowInstances, uploadedInstances);
+	UpdateChangedRanges(GL_DRAW_INDIRECT_BUFFER, drawCommandBuffer, shadowCommands, uploadedCommands);
+
+	shadowMap.Begin();
+	glUseProgram(shadowProgramId);
+	glUniformMatrix4fv(shadowUniforms.Get("lightViewProjection"), 1, GL_FALSE, glm::value_ptr(shadowMap.ViewProjection()));
+	glBindVertexArray(meshVao);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawCommandBuffer);
+	DrawByIndexType(shadowBatches);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
 	glBindVertexArray(0);
-	//sawp buffers and poll for input events
-	glfwSwapBuffers(window);
+	shadowMap.End(lampPos, scene.transformVersion);
 }
 
-//Create the mesh, stores vertices and indices and will likely need to be refactored for circles
-void CreateMesh(GLMesh& mesh) {
-
-	//Y-values for heights of each rank of the sphere
-	GLfloat zTop = 0.85f;
-	GLfloat zRank1 = 0.75f;
-	GLfloat zRank2 = 0.5f;
-	GLfloat zRank3 = 0.25f;
-	GLfloat zMid = 0.0f;
-	GLfloat zRank4 = -0.25f;
-	GLfloat zRank5 = -0.5f;
-	GLfloat zRank6 = -0.75f;
-	GLfloat zBot = -1.0f;
-
-	//Steps for circular movement
-	GLfloat step1cos = cos(0 * 2 * PI / 10);
-	GLfloat step1sin = sin(0 * 2 * PI / 10);
-	GLfloat step2cos = cos(1 * 2 * PI / 10);
-	GLfloat step2sin = sin(1 * 2 * PI / 10);
-	GLfloat step3cos = cos(2 * 2 * PI / 10);
-	GLfloat step3sin = sin(2 * 2 * PI / 10);
-	GLfloat step4cos = cos(3 * 2 * PI / 10);
-	GLfloat step4sin = sin(3 * 2 * PI / 10);
-	GLfloat step5cos = cos(4 * 2 * PI / 10);
-	GLfloat step5sin = sin(4 * 2 * PI / 10);
-	GLfloat step6cos = cos(5 * 2 * PI / 10);
-	GLfloat step6sin = sin(5 * 2 * PI / 10);
-	GLfloat step7cos = cos(6 * 2 * PI / 10);
-	GLfloat step7sin = sin(6 * 2 * PI / 10);
-	GLfloat step8cos = cos(7 * 2 * PI / 10);
-	GLfloat step8sin = sin(7 * 2 * PI / 10);
-	GLfloat step9cos = cos(8 * 2 * PI / 10);
-	GLfloat step9sin = sin(8 * 2 * PI / 10);
-	GLfloat step10cos = cos(9 * 2 * PI / 10);
-	GLfloat step10sin = sin(9 * 2 * PI / 10);
-
-
-	//Radiuses to make smaller circles at ranks
-	GLfloat Rank1Rad = 0.5f;
-	GLfloat Rank2Rad = 0.8f;
-	GLfloat Rank3Rad = 0.9f;
-
-	GLfloat v1[] = {
-		//Sphere
-		//vertices					//Normals					//Texture
-		0.0f, zTop, 0.0f,			0.0f, 1.0f, 0.0f,			1.0f, zTop, //top vertice, 0
-
-		//First rank vertices
-		//Feed radians in to calculate x and z coords, creates a grid for our "Squares"
-		//vertices											//normals					/texture
-		Rank1Rad * step1cos, zRank1, Rank1Rad * step1sin,	step1cos, zRank1, step1sin,		0.1f, zRank1, //First position, 1
-		Rank1Rad * step2cos, zRank1, Rank1Rad * step2sin,	step2cos, zRank1, step2sin,		0.2f, zRank1, //Second position, 2
-		Rank1Rad * step3cos, zRank1, Rank1Rad * step3sin,	step3cos, zRank1, step3sin,		0.3f, zRank1, //Third position, 3
-		Rank1Rad * step4cos, zRank1, Rank1Rad * step4sin,	step4cos, zRank1, step4sin,		0.4f, zRank1, //Fourth position, 4
-		Rank1Rad * step5cos, zRank1, Rank1Rad * step5sin,	step5cos, zRank1, step5sin,		0.5f, zRank1, //Fifth position, 5
-		Rank1Rad * step6cos, zRank1, Rank1Rad * step6sin,	step6cos, zRank1, step6sin,		0.6f, zRank1, //Sixth Position, 6
-		Rank1Rad * step7cos, zRank1, Rank1Rad * step7sin,	step7cos, zRank1, step7sin,		0.7f, zRank1, //Seventh Position, 7
-		Rank1Rad * step8cos, zRank1, Rank1Rad * step8sin,	step8cos, zRank1, step8sin,		0.8f, zRank1,	//Eighth Position, 8
-		Rank1Rad * step9cos, zRank1, Rank1Rad * step9sin,	step9cos, zRank1, step9sin,		0.9f, zRank1, //Ninth Position, 9
-		Rank1Rad * step10cos, zRank1, Rank1Rad * step10sin,	step10cos, zRank1, step10sin,		1.0f, zRank1,//Tenth Position, 10
-
-		//Second rank vertices
-		Rank2Rad * step1cos, zRank2, Rank2Rad * step1sin,	step1cos, zRank2, step1sin,		0.1f, zRank2, //First position, 11
-		Rank2Rad * step2cos, zRank2, Rank2Rad * step2sin,	step2cos, zRank2, step2sin,		0.2f, zRank2, //Second position, 12
-		Rank2Rad * step3cos, zRank2, Rank2Rad * step3sin,	step3cos, zRank2, step3sin,		0.3f, zRank2, //Third position, 13
-		Rank2Rad * step4cos, zRank2, Rank2Rad * step4sin,	step4cos, zRank2, step4sin,		0.4f, zRank2, //Fourth position, 14
-		Rank2Rad * step5cos, zRank2, Rank2Rad * step5sin,	step5cos, zRank2, step5sin,		0.5f, zRank2, //Fifth position, 15
-		Rank2Rad * step6cos, zRank2, Rank2Rad * step6sin,	step6cos, zRank2, step6sin,		0.6f, zRank2, //Sixth Position, 16
-		Rank2Rad * step7cos, zRank2, Rank2Rad * step7sin,	step7cos, zRank2, step7sin,		0.7f, zRank2, //Seventh Position, 17
-		Rank2Rad * step8cos, zRank2, Rank2Rad * step8sin,	step8cos, zRank2, step8sin,		0.8f, zRank2, //Eighth Position, 18
-		Rank2Rad * step9cos, zRank2, Rank2Rad * step9sin,	step9cos, zRank2, step9sin,		0.9f, zRank2, //Ninth Position, 19
-		Rank2Rad * step10cos, zRank2, Rank2Rad * step10sin,	step10cos, zRank2, step10sin,		1.0f, zRank2, //Tenth Position, 20
-
-		//Third rank vertices
-		Rank3Rad * step1cos, zRank3, Rank3Rad * step1sin,	step1cos, zRank3, step1sin,		0.1f, zRank3, //First position, 21
-		Rank3Rad * step2cos, zRank3, Rank3Rad * step2sin,	step2cos, zRank3, step2sin,		0.2f, zRank3, //Second position, 22
-		Rank3Rad * step3cos, zRank3, Rank3Rad * step3sin,	step3cos, zRank3, step3sin,		0.3f, zRank3, //Third position, 23
-		Rank3Rad * step4cos, zRank3, Rank3Rad * step4sin,	step4cos, zRank3, step4sin,		0.4f, zRank3, //Fourth position, 24
-		Rank3Rad * step5cos, zRank3, Rank3Rad * step5sin,	step5cos, zRank3, step5sin,		0.5f, zRank3, //Fifth position, 25
-		Rank3Rad * step6cos, zRank3, Rank3Rad * step6sin,	step6cos, zRank3, step6sin,		0.6f, zRank3, //Sixth Position, 26
-		Rank3Rad * step7cos, zRank3, Rank3Rad * step7sin,	step7cos, zRank3, step7sin,		0.7f, zRank3, //Seventh Position, 27
-		Rank3Rad * step8cos, zRank3, Rank3Rad * step8sin,	step8cos, zRank3, step8sin,		0.8f, zRank3, //Eighth Position, 28
-		Rank3Rad * step9cos, zRank3, Rank3Rad * step9sin,	step9cos, zRank3, step9sin,		0.9f, zRank3, //Ninth Position, 29
-		Rank3Rad * step10cos, zRank3, Rank3Rad * step10sin,	step10cos, zRank3, step10sin,		1.0f, zRank3, //Tenth Position, 30
-
-		//Mid rank vertices
-		step1cos, zMid, step1sin,	step1cos, zMid, step1sin,		0.1f, zMid, //First position, 31
-		step2cos, zMid, step2sin,	step2cos, zMid, step2sin,		0.2f, zMid, //Second position, 32
-		step3cos, zMid, step3sin,	step3cos, zMid, step3sin,		0.3f, zMid, //Third position, 33
-		step4cos, zMid, step4sin,	step4cos, zMid, step4sin,		0.4f, zMid, //Fourth position, 34
-		step5cos, zMid, step5sin,	step5cos, zMid, step5sin,		0.5f, zMid, //Fifth position, 35
-		step6cos, zMid, step6sin,	step6cos, zMid, step6sin,		0.6f, zMid, //Sixth Position, 36
-		step7cos, zMid, step7sin,	step7cos, zMid, step7sin,		0.7f, zMid, //Seventh Position, 37
-		step8cos, zMid, step8sin,	step8cos, zMid, step8sin,		0.8f, zMid,	//Eighth Position, 38
-		step9cos, zMid, step9sin,	step9cos, zMid, step9sin,		0.9f, zMid, //Ninth Position, 39
-		step10cos, zMid, step10sin,	step10cos, zMid, step10sin,		1.0f, zMid, //Tenth Position, 40
-
-		//Fourth rank vertices
-		Rank3Rad * step1cos, zRank4, Rank3Rad * step1sin,	step1cos, zRank4, step1sin,		0.1f, zRank4, //First position, 41
-		Rank3Rad * step2cos, zRank4, Rank3Rad * step2sin,	step2cos, zRank4, step2sin,		0.2f, zRank4, //Second position, 42
-		Rank3Rad * step3cos, zRank4, Rank3Rad * step3sin,	step3cos, zRank4, step3sin,		0.3f, zRank4, //Third position, 43
-		Rank3Rad * step4cos, zRank4, Rank3Rad * step4sin,	step4cos, zRank4, step4sin,		0.4f, zRank4, //Fourth position, 44
-		Rank3Rad * step5cos, zRank4, Rank3Rad * step5sin,	step5cos, zRank4, step5sin,		0.5f, zRank4, //Fifth position, 45
-		Rank3Rad * step6cos, zRank4, Rank3Rad * step6sin,	step6cos, zRank4, step6sin,		0.6f, zRank4, //Sixth Position, 46
-		Rank3Rad * step7cos, zRank4, Rank3Rad * step7sin,	step7cos, zRank4, step7sin,		0.7f, zRank4, //Seventh Position, 47
-		Rank3Rad * step8cos, zRank4, Rank3Rad * step8sin,	step8cos, zRank4, step8sin,		0.8f, zRank4, //Eighth Position, 48
-		Rank3Rad * step9cos, zRank4, Rank3Rad * step9sin,	step9cos, zRank4, step9sin,		0.9f, zRank4, //Ninth Position, 49
-		Rank3Rad * step10cos, zRank4, Rank3Rad * step10sin,	step10cos, zRank4, step10sin,	1.0f, zRank4, //Tenth Position, 50
-
-		//Fifth rank vertices
-		Rank2Rad * step1cos, zRank5, Rank2Rad * step1sin,	step1cos, zRank5, step1sin,		0.1f, zRank5, //First position, 51
-		Rank2Rad * step2cos, zRank5, Rank2Rad * step2sin,	step2cos, zRank5, step2sin,		0.2f, zRank5, //Second position, 52
-		Rank2Rad * step3cos, zRank5, Rank2Rad * step3sin,	step3cos, zRank5, step3sin,		0.3f, zRank5, //Third position, 53
-		Rank2Rad * step4cos, zRank5, Rank2Rad * step4sin,	step4cos, zRank5, step4sin,		0.4f, zRank5, //Fourth position, 54
-		Rank2Rad * step5cos, zRank5, Rank2Rad * step5sin,	step5cos, zRank5, step5sin,		0.5f, zRank5, //Fifth position, 55
-		Rank2Rad * step6cos, zRank5, Rank2Rad * step6sin,	step6cos, zRank5, step6sin,		0.6f, zRank5, //Sixth Position, 56
-		Rank2Rad * step7cos, zRank5, Rank2Rad * step7sin,	step7cos, zRank5, step7sin,		0.7f, zRank5, //Seventh Position, 57
-		Rank2Rad * step8cos, zRank5, Rank2Rad * step8sin,	step8cos, zRank5, step8sin,		0.8f, zRank5, //Eighth Position, 58
-		Rank2Rad * step9cos, zRank5, Rank2Rad * step9sin,	step9cos, zRank5, step9sin,		0.9f, zRank5, //Ninth Position, 59
-		Rank2Rad * step10cos, zRank5, Rank2Rad * step10sin,	step10cos, zRank5, step10sin,	1.0f, zRank5, //Tenth Position, 60
-
-		//Sixth rank vertices
-		Rank1Rad * step1cos, zRank6, Rank1Rad * step1sin,	step1cos, zRank6, step1sin,		0.1f, zRank6, //First position, 61
-		Rank1Rad * step2cos, zRank6, Rank1Rad * step2sin,	step2cos, zRank6, step2sin,		0.2f, zRank6, //Second position, 62
-		Rank1Rad * step3cos, zRank6, Rank1Rad * step3sin,	step3cos, zRank6, step3sin,		0.3f, zRank6, //Third position, 63
-		Rank1Rad * step4cos, zRank6, Rank1Rad * step4sin,	step4cos, zRank6, step4sin,		0.4f, zRank6, //Fourth position, 64
-		Rank1Rad * step5cos, zRank6, Rank1Rad * step5sin,	step5cos, zRank6, step5sin,		0.5f, zRank6, //Fifth position, 65
-		Rank1Rad * step6cos, zRank6, Rank1Rad * step6sin,	step6cos, zRank6, step6sin,		0.6f, zRank6, //Sixth Position, 66
-		Rank1Rad * step7cos, zRank6, Rank1Rad * step7sin,	step7cos, zRank6, step7sin,		0.7f, zRank6, //Seventh Position, 67
-		Rank1Rad * step8cos, zRank6, Rank1Rad * step8sin,	step8cos, zRank6, step8sin,		0.8f, zRank6, //Eighth Position, 68
-		Rank1Rad * step9cos, zRank6, Rank1Rad * step9sin,	step9cos, zRank6, step9sin,		0.9f, zRank6, //Ninth Position, 69
-		Rank1Rad * step10cos, zRank6, Rank1Rad * step10sin,	step10cos, zRank6, step10sin,		1.0f, zRank6, //Tenth Position, 70
+//Profiler zone for the pass a program draws
+unsigned int PassZone(GLuint programId) {
+	if (programId == lampProgramId) {
+		return zoneLamp;
+	}
+	if (programId == fillProgramId) {
+		return zoneFill;
+	}
+	return zoneObjects;
+}
 
-		//Bottom
-		0.0f, zBot, 0.0f,			0.0f, zBot, 0.0f,		1.0f, zBot, //Bottom, 71
-
-
-		//Cone
-		//Don't need to interleave vertices, so will just make 10 vertices and connect to point at center of sphere
-		//Top of cone
-		0.0f, 0.8f, 0.0f,				0.0f, zBot, 0.0f,				1.0f, 1.0f,	//Top point, 72
-
-		//Circle
-		//Unsure of how to do scaling manually and current scale function applies to whole object
-		step1cos, -3.0f, step1sin,		step1cos, 0.0f, step1sin,		0.1f, 0.0f,	//Circle position 1, 73
-		step2cos, -3.0f, step2sin,		step2cos, 0.0f, step2sin,		0.2f, 0.0f,	//Circle position 2, 74
-		step3cos, -3.0f, step3sin,		step3cos, 0.0f, step3sin,		0.3f, 0.0f,	//Circle position 3, 75
-		step4cos, -3.0f, step4sin,		step4cos, 0.0f, step4sin,		0.4f, 0.0f,	//Circle position 4, 76
-		step5cos, -3.0f, step5sin,		step5cos, 0.0f, step5sin,		0.5f, 0.0f,	//Circle position 5, 77
-		step6cos, -3.0f, step6sin,		step6cos, 0.0f, step6sin,		0.6f, 0.0f,	//Circle position 6, 78
-		step7cos, -3.0f, step7sin,		step7cos, 0.0f, step7sin,		0.7f, 0.0f,	//Circle position 7, 79
-		step8cos, -3.0f, step8sin,		step8cos, 0.0f, step8sin,		0.8f, 0.0f,	//Circle position 8, 80
-		step9cos, -3.0f, step9sin,		step9cos, 0.0f, step9sin,		0.9f, 0.0f,	//Circle position 9, 81
-		step10cos, -3.0f, step10sin,	step10cos, 0.0f, step10sin,		1.0f, 0.0f,	//Circle position 10, 82
+//Shows the average frame time in the title bar, refreshed every PROFILE_TITLE_INTERVAL seconds
+void UpdateProfileTitle(float currentFrame) {
+	if (currentFrame - lastTitleUpdate < PROFILE_TITLE_INTERVAL) {
+		return;
+	}
+	lastTitleUpdate = currentFrame;
+
+	SampleWindow::Stats frame = profiler.CpuStats(0);
+	SampleWindow::Stats objects = profiler.GpuStats(zoneObjects);
+	char title[128];
+	snprintf(title, sizeof(title), "%s - %.2f ms (p99 %.2f ms), objects %.2f ms GPU",
+		WINDOW_TITLE, frame.avg, frame.p99, objects.avg);
+	glfwSetWindowTitle(window, title);
+}
 
-	};
+//Fill the scene table with the objects in the scene, each one is a single row
+void BuildScene() {
+	scene.Clear();
+
+	//Lit objects
+	GLuint textureArray = textureCache.ArrayTexture();
+	AddSceneObject(shaderProgramId, MESH_PIECE, textureArray, textureLayerSphere, piecePos, pieceScale, pieceColor);
+	AddSceneObject(shaderProgramId, MESH_PLANE, textureArray, textureLayerPlane, planePos, planeScale, planeColor);
+	AddSceneObject(shaderProgramId, MESH_CUBE, textureArray, textureLayerCube, cubePos, cubeScale, cubeColor);
+	AddSceneObject(shaderProgramId, MESH_PYRAMID, textureArray, textureLayerPyr, pyrPos, pyrScale, pyrColor);
+	AddSceneObject(shaderProgramId, MESH_CYLINDER, textureArray, textureLayerCyl, cylPos, cylScale, cylColor);
+
+	//Benchmark scenes repeat the lit objects on a grid of boards until there are benchmarkObjects
+	const unsigned int litObjects = (unsigned int)scene.Size();
+	if (benchmarkObjects > litObjects) {
+		unsigned int boards = (benchmarkObjects + litObjects - 1) / litObjects;
+		unsigned int side = (unsigned int)ceil(sqrt((double)boards));
+		for (unsigned int i = litObjects; i < benchmarkObjects; i++) {
+			unsigned int board = i / litObjects;
+			unsigned int source = i % litObjects;
+			//boards spread right and away from the camera's start
+			glm::vec3 offset((float)(board % side) * BENCHMARK_BOARD_SPACING, 0.0f,
+				-(float)(board / side) * BENCHMARK_BOARD_SPACING);
+			AddSceneObject(shaderProgramId, (MeshHandle)scene.meshes[source], scene.textures[source],
+				(unsigned int)scene.layers[source], scene.positions[source] + offset, scene.scales[source], scene.colors[source]);
+		}
+	}
 
+	//Lights as visual cues, the plane is the lowest polygon object and looks like studio lighting
+	AddSceneObject(lampProgramId, MESH_PLANE, 0, 0, lampPos, lampScale, lampColor);
+	AddSceneObject(fillProgramId, MESH_PLANE, 0, 0, fillPos, fillScale, fillColor);
+}
 
-	//used GLushort indices[] = {} here, might be different for spheres
-	GLushort indices[] = {
-		//Sphere
-		//Top
-		0, 1, 2,		0, 2, 3,		0, 3, 4,		0, 4, 5,		0, 5, 6,
-		0, 6, 7,		0, 7, 8,		0, 8, 9,		0, 9, 10,		0, 10, 1,
-
-		//First rank
-		1, 2, 11,			2, 11, 12,		2, 3, 12,		3, 12, 13,		3, 4, 13,
-		4, 13, 14,			4, 5, 14,		5, 14, 15,		5, 6, 15,		6, 15, 16,
-		6, 7, 16,			7, 16, 17,		7, 8, 17,		8, 17, 18,		8, 9, 18,
-		9, 18, 19,			9, 10, 19,		10, 19, 20,		10, 1, 20,		1, 20, 11,
-
-
-		//Second rank
-		11, 12, 21,		12, 21, 22,		12, 13, 22,		13, 22, 23,		13, 14, 23,
-		14, 23, 24,		14, 15, 24,		15, 24, 25,		15, 16, 25,		16, 25, 26,
-		16, 17, 26,		17, 26, 27,		17, 18, 27,		18, 27, 28,		18, 19, 28,
-		19, 28, 29,		19, 20, 29,		20, 29, 30,		20, 11, 30,		11, 30, 21,
-
-		//Third rank
-		21, 22, 31,		22, 31, 32,		22, 23, 32,		23, 32, 33,		23, 24, 33,
-		24, 33, 34,		24, 25, 34,		25, 34, 35,		25, 26, 35,		26, 35, 36,
-		26, 27, 36,		27, 36, 37,		27, 28, 37,		28, 37, 38,		28, 29, 38,
-		29, 38, 39,		29, 30, 39,		30, 39, 40,		30, 21, 40,		21, 40, 31,
-
-		//Bottom half of sphere starts here, remove for half sphere
-		//Fourth rank
-		31, 32, 41,		32, 41, 42,		32, 33, 42,		33, 42, 43,		33, 34, 43,
-		34, 43, 44,		34, 35, 44,		35, 44, 45,		35, 36, 45,		36, 45, 46,
-		36, 37, 46,		37, 46, 47,		37, 38, 47,		38, 47, 48,		38, 39, 48,
-		39, 48, 49,		39, 40, 49,		40, 49, 50,		40, 31, 50,		31, 50, 41,
-
-		//Fifth rank
-		41, 42, 51,		42, 51, 52,		42, 43, 52,		43, 52, 53,		43, 44, 53,
-		44, 53, 54,		44, 45, 54,		45, 54, 55,		45, 46, 55,		46, 55, 56,
-		46, 47, 56,		47, 56, 57,		47, 48, 57,		48, 57, 58,		48, 49, 58,
-		49, 58, 59,		49, 50, 59,		50 ,59, 60,		50, 41, 60,		41, 60, 51,
-
-		//Sixth rank
-		51, 52, 61,		52, 61, 62,		52, 53, 62,		53, 62, 63,		53, 54, 63,
-		54, 63, 64,		54, 55, 64,		55, 64, 65,		55, 56, 65,		56, 65, 66,
-		56, 57, 66,		57, 66, 67,		57, 58, 67,		58, 67, 68,		58, 59, 68,
-		59, 68, 69,		59, 60, 69,		60, 69, 70,		60, 51, 70,		51, 70, 61,
-
-		//Bottom of sphere
-		61, 62, 71,		62, 63, 71,		63, 64, 71,		64, 65, 71,		65, 66, 71,
-		66, 67, 71,		67, 68, 71,		68, 69, 71,		69, 70, 71,		70, 61, 71,
-
-
-		//Cone
-		72, 73, 74,			//Cone face 1
-		72, 74, 75,			//Cone face 2
-		72, 75, 76,			//Cone face 3
-		72, 76, 77,			//Cone face 4
-		72, 77, 78,			//Cone face 5
-		72, 78, 79,			//Cone face 6
-		72, 79, 80,			//Cone face 7
-		72, 80, 81,			//Cone face 8
-		72, 81, 82,			//Cone face 9
-		72, 82, 73,			//Cone face 10
-		
+//Scatters pointLightCount lights over the lit objects, seeded so every run gets the same layout
+void BuildLights() {
+	lightClusters.Clear();
+	if (pointLightCount == 0) {
+		return;
+	}
+	//box around everything lit, benchmark boards included
+	glm::vec3 low(1.0e30f);
+	glm::vec3 high(-1.0e30f);
+	for (size_t row = 0; row < scene.Size(); row++) {
+		if (scene.programs[row] == shaderProgramId) {
+			low = glm::min(low, scene.worldMins[row]);
+			high = glm::max(high, scene.worldMaxs[row]);
+		}
+	}
+	//saturated colors so overlapping lights stay easy to tell apart
+	const glm::vec3 palette[6] = {
+		glm::vec3(1.0f, 0.2f, 0.2f), glm::vec3(0.2f, 1.0f, 0.2f), glm::vec3(0.2f, 0.4f, 1.0f),
+		glm::vec3(1.0f, 0.8f, 0.2f), glm::vec3(0.2f, 1.0f, 1.0f), glm::vec3(1.0f, 0.2f, 1.0f),
 	};
+	std::mt19937 random(330);
+	for (unsigned int i = 0; i < pointLightCount; i++) {
+		glm::vec3 t((float)random() / (float)random.max(), (float)random() / (float)random.max(),
+			(float)random() / (float)random.max());
+		float range = POINT_LIGHT_MIN_RANGE + (POINT_LIGHT_MAX_RANGE - POINT_LIGHT_MIN_RANGE) * ((float)random() / (float)random.max());
+		lightClusters.AddLight(low + (high - low) * t, palette[i % 6], range);
+	}
+	std::cout << "INFO: " << pointLightCount << " point lights in " << CLUSTER_COUNT << " clusters" << std::endl;
+}
 
-	//constants for stride
-	const GLuint floatsPerVertex = 3;
-	const GLuint floatsPerNormal = 3;
-	const GLuint floatsPerTexture = 2;
-
-	//generate and bind vao
-	glGenVertexArrays(1, &mesh.vao);
-	glBindVertexArray(mesh.vao);
-
-	//Create and bind 2 vbos for vertices and indices
-	glGenBuffers(2, mesh.vbos);
-	//Activate and bind buffers
-	glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(v1), v1, GL_STATIC_DRAW);
-
-	//Activate buffer and bind indices
-	mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+//Adds a scene table row, taking the bounds and LOD count from the mesh
+unsigned int AddSceneObject(GLuint program, MeshHandle mesh, GLuint texture, unsigned int layer,
+	glm::vec3 position, glm::vec3 scale, glm::vec3 color) {
+	const GLMesh& source = *meshes[mesh];
+	return scene.AddObject(program, mesh, texture, (float)layer, position, scale, color,
+		source.boundsMin, source.boundsMax, source.nLods, source.indexType);
+}
 
-	//establish stride
-	GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerTexture);
+//Game piece: a sphere sitting on a cone, one level per entry in PIECE_SEGMENTS x PIECE_RINGS
+//all levels share one vertex and index buffer
+void CreateMesh(GLMesh& mesh) {
+	uint32_t key = MeshCacheKey(PIECE_SEGMENTS, sizeof(PIECE_SEGMENTS));
+	key = MeshCacheKey(PIECE_RINGS, sizeof(PIECE_RINGS), key);
+	if (LoadCachedMesh(mesh, "piece.mesh", key)) {
+		return;
+	}
 
-	//Create attribute pointers
-	glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
-	glEnableVertexAttribArray(1);
+	MeshBuilder builder;
+	size_t vertexCount = 0;
+	size_t indexCount = 0;
+	for (unsigned int lod = 0; lod < PIECE_LOD_COUNT; lod++) {
+		vertexCount += MeshBuilder::SphereVertexCount(PIECE_SEGMENTS[lod], PIECE_RINGS[lod]) + MeshBuilder::ConeVertexCount(PIECE_SEGMENTS[lod], false);
+		indexCount += MeshBuilder::SphereIndexCount(PIECE_SEGMENTS[lod], PIECE_RINGS[lod]) + MeshBuilder::ConeIndexCount(PIECE_SEGMENTS[lod], false);
+	}
+	builder.Reserve(vertexCount, indexCount);
 
-	//for texture
-	glVertexAttribPointer(2, floatsPerTexture, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-	glEnableVertexAttribArray(2);
+	for (unsigned int lod = 0; lod < PIECE_LOD_COUNT; lod++) {
+		//Sphere
+		builder.AddSphere(glm::vec3(0.0f, 0.0f, 0.0f), 1.0f, PIECE_SEGMENTS[lod], PIECE_RINGS[lod]);
+		//Cone, apex tucked inside the sphere
+		builder.AddCone(glm::vec3(0.0f, -3.0f, 0.0f), 1.0f, 3.8f, PIECE_SEGMENTS[lod], false);
+		builder.EndLod();
+	}
 
-	//wireframe render for debug, comment to get solid shapes
-	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	AddMesh(mesh, builder, "piece");
+	SaveCachedMesh("piece.mesh", key, builder);
 }
 
 void CreateMeshPlane(GLMesh& mesh) {
-	GLfloat vertices[] = {
-		//Scene plane, dark orange
-		-5.0f, -3.0f, 5.0f,		0.0f, 1.0f, 0.0f,		0.0f, 1.0f,
-		5.0f, -3.0f, 5.0f,		0.0f, 1.0f, 0.0f,		1.0f, 1.0f,
-		-5.0f, -3.0f, -5.0f,	0.0f, 1.0f, 0.0f,		0.0f, 0.0f,
-		5.0f, -3.0f, -5.0f,		0.0f, 1.0f, 0.0f,		1.0f, 0.0f,
-	};
-
-	GLushort indices[] = {
-		0, 1, 2,
-		1, 2, 3
-	};
-
-	//Now run it all for v2 and indices2 for the plane
-	//constants for stride
-	const GLuint floatsPerVertex = 3;
-	const GLuint floatsPerNormal = 3;
-	const GLuint floatsPerTexture = 2;
-
-	//generate and bind vao
-	glGenVertexArrays(1, &mesh.vao);
-	glBindVertexArray(mesh.vao);
-
-	//Create and bind 2 vbos for vertices and indices
-	glGenBuffers(2, mesh.vbos);
-	//Activate and bind buffers
-
-	//Rebind buffer and use the next set of vertices and indices
-	glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-
-	mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+	//Scene plane, 10 x 10 at the bottom of the scene
+	uint32_t key = MeshCacheKey(&PLANE_DIVISIONS, sizeof(PLANE_DIVISIONS));
+	if (LoadCachedMesh(mesh, "plane.mesh", key)) {
+		return;
+	}
 
-	//establish draw
-	//GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);
-	GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerTexture);
+	MeshBuilder builder;
+	builder.AddPlane(glm::vec3(0.0f, -3.0f, 0.0f), 10.0f, 10.0f, PLANE_DIVISIONS);
 
-	//Create attribute pointers
-	glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
-	glEnableVertexAttribArray(1);
-	
-	//for texture
-	glVertexAttribPointer(2, floatsPerTexture, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-	glEnableVertexAttribArray(2);
-
-	//wireframe render for debug, comment to get solid shapes
-	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	AddMesh(mesh, builder, "plane");
+	SaveCachedMesh("plane.mesh", key, builder);
 }
 
 void CreateMeshCube(GLMesh& mesh) {
@@ -1159,44 +2170,10 @@ void CreateMeshCube(GLMesh& mesh) {
 		20, 21, 22,	21, 22, 23,
 	};
 
-	//Now run it all for v2 and indices2 for the plane
-	//constants for stride
-	const GLuint floatsPerVertex = 3;
-	const GLuint floatsPerNormal = 3;
-	const GLuint floatsPerTexture = 2;
-
-	//generate and bind vao
-	glGenVertexArrays(1, &mesh.vao);
-	glBindVertexArray(mesh.vao);
-
-	//Create and bind 2 vbos for vertices and indices
-	glGenBuffers(2, mesh.vbos);
-	//Activate and bind buffers
-
-	//Rebind buffer and use the next set of vertices and indices
-	glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-
-	mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
-
-	//establish draw
-	//GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);
-	GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerTexture);
+	MeshBuilder builder;
+	builder.AddRaw(vertices, sizeof(vertices) / sizeof(vertices[0]) / FLOATS_PER_VERTEX, indices, sizeof(indices) / sizeof(indices[0]));
 
-	//Create attribute pointers
-	glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
-	glEnableVertexAttribArray(1);
-	
-	//for texture
-	glVertexAttribPointer(2, floatsPerTexture, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-	glEnableVertexAttribArray(2);
-
-	//wireframe render for debug, comment to get solid shapes
-	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	AddMesh(mesh, builder, "cube");
 }
 
 void CreateMeshPyramid(GLMesh& mesh) {
@@ -1231,213 +2208,337 @@ void CreateMeshPyramid(GLMesh& mesh) {
 		9, 10, 11,
 	};
 
-	//Now run it all for v2 and indices2 for the plane
-	//constants for stride
-	const GLuint floatsPerVertex = 3;
-	const GLuint floatsPerNormal = 3;
-	const GLuint floatsPerTexture = 2;
-
-	//generate and bind vao
-	glGenVertexArrays(1, &mesh.vao);
-	glBindVertexArray(mesh.vao);
+	MeshBuilder builder;
+	builder.AddRaw(vertices, sizeof(vertices) / sizeof(vertices[0]) / FLOATS_PER_VERTEX, indices, sizeof(indices) / sizeof(indices[0]));
 
-	//Create and bind 2 vbos for vertices and indices
-	glGenBuffers(2, mesh.vbos);
-	//Activate and bind buffers
-
-	//Rebind buffer and use the next set of vertices and indices
-	glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+	AddMesh(mesh, builder, "pyramid");
+}
 
-	mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+void CreateMeshCylinder(GLMesh& mesh) {
+	//Scene Cylinder, base on y = 0 and top at y = 2
+	uint32_t key = MeshCacheKey(CYLINDER_SEGMENTS, sizeof(CYLINDER_SEGMENTS));
+	if (LoadCachedMesh(mesh, "cylinder.mesh", key)) {
+		return;
+	}
 
-	//establish draw
-	//GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);
-	GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerTexture);
+	MeshBuilder builder;
+	for (unsigned int lod = 0; lod < CYLINDER_LOD_COUNT; lod++) {
+		builder.AddCylinder(glm::vec3(0.0f, 0.0f, 0.0f), 1.0f, 2.0f, CYLINDER_SEGMENTS[lod]);
+		builder.EndLod();
+	}
 
-	//Create attribute pointers
-	glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
-	glEnableVertexAttribArray(1);
-	
-	//for texture
-	glVertexAttribPointer(2, floatsPerTexture, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-	glEnableVertexAttribArray(2);
-	
-	//wireframe render for debug, comment to get solid shapes
-	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	AddMesh(mesh, builder, "cylinder");
+	SaveCachedMesh("cylinder.mesh", key, builder);
 }
 
-void CreateMeshCylinder(GLMesh& mesh) {
+//Appends generated vertices and indices to the shared buffers, same layout as the hand-written meshes
+//the builder is reordered for the vertex cache, overdraw and vertex fetch first, so save the cache after this
+//indices go in at the narrowest type the builder's levels fit
+void AddMesh(GLMesh& mesh, MeshBuilder& builder, const char* name) {
+	VertexCacheStats before, after;
+	OptimizeMesh(builder, before, after);
+	std::cout << std::fixed << std::setprecision(2) << "INFO: Mesh " << name << " ACMR " << before.acmr << " -> " << after.acmr
+		<< ", ATVR " << before.atvr << " -> " << after.atvr << std::defaultfloat << std::endl;
+
+	glm::vec3 boundsMin, boundsMax;
+	builder.GetBounds(boundsMin, boundsMax);
+	std::vector<unsigned char> packedIndices;
+	std::vector<MeshLod> ranges;
+	GLenum indexType = builder.PackIndices(packedIndices, ranges);
+	AddMeshData(mesh, builder.vertices.data(), builder.vertices.size() * sizeof(GLfloat),
+		packedIndices.data(), indexType, builder.indices.size(), ranges.data(), ranges.size(),
+		boundsMin, boundsMax);
+}
 
-	GLfloat zTop = 2.0f;
-	GLfloat zBot = 0.0f;
-
-	//Steps for circular movement
-	GLfloat step1cos = cos(0 * 2 * PI / 10);
-	GLfloat step1sin = sin(0 * 2 * PI / 10);
-	GLfloat step2cos = cos(1 * 2 * PI / 10);
-	GLfloat step2sin = sin(1 * 2 * PI / 10);
-	GLfloat step3cos = cos(2 * 2 * PI / 10);
-	GLfloat step3sin = sin(2 * 2 * PI / 10);
-	GLfloat step4cos = cos(3 * 2 * PI / 10);
-	GLfloat step4sin = sin(3 * 2 * PI / 10);
-	GLfloat step5cos = cos(4 * 2 * PI / 10);
-	GLfloat step5sin = sin(4 * 2 * PI / 10);
-	GLfloat step6cos = cos(5 * 2 * PI / 10);
-	GLfloat step6sin = sin(5 * 2 * PI / 10);
-	GLfloat step7cos = cos(6 * 2 * PI / 10);
-	GLfloat step7sin = sin(6 * 2 * PI / 10);
-	GLfloat step8cos = cos(7 * 2 * PI / 10);
-	GLfloat step8sin = sin(7 * 2 * PI / 10);
-	GLfloat step9cos = cos(8 * 2 * PI / 10);
-	GLfloat step9sin = sin(8 * 2 * PI / 10);
-	GLfloat step10cos = cos(9 * 2 * PI / 10);
-	GLfloat step10sin = sin(9 * 2 * PI / 10);
+//Maps a mesh cache file into the mesh's pending slot, UploadMeshBuffers() copies straight from the
+//mapped pages and closes it. False when there's no usable cache
+bool LoadCachedMesh(GLMesh& mesh, const char* fileName, uint32_t key) {
+	if (!meshCacheEnabled) {
+		return false;
+	}
+	MeshCacheFile& cache = pendingMeshes[pendingMeshCount].cache;
+	if (!cache.Open(fileName, key)) {
+		return false;
+	}
+	const MeshCacheHeader& header = *cache.header;
+	AddMeshData(mesh, cache.Vertices(), cache.VertexBytes(), cache.Indices(), cache.IndexType(), header.indexCount,
+		cache.Lods(), header.lodCount,
+		glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]),
+		glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]));
+	return true;
+}
 
+//Writes the cache file for a generated mesh, a failed write only costs regenerating next run
+void SaveCachedMesh(const char* fileName, uint32_t key, const MeshBuilder& builder) {
+	if (meshCacheEnabled && !WriteMeshCache(fileName, key, builder)) {
+		std::cout << "Failed to write mesh cache " << fileName << std::endl;
+	}
+}
 
-	GLfloat vertices[] = {
-		//Scene Cylinder, Grey
-		step1cos, zTop, step1sin,		step1cos, 1.0f, step1sin,		0.0f, 1.0f,//0
-		step2cos, zTop, step2sin,		step2cos, 1.0f, step2sin,		0.1f, 1.0f,//1
-		step3cos, zTop, step3sin,		step3cos, 1.0f, step3sin,		0.2f, 1.0f,//2
-		step4cos, zTop, step4sin,		step4cos, 1.0f, step4sin,		0.3f, 1.0f,//3
-		step5cos, zTop, step5sin,		step5cos, 1.0f, step5sin,		0.4f, 1.0f,//4
-		step6cos, zTop, step6sin,		step6cos, 1.0f, step6sin,		0.5f, 1.0f,//5
-		step7cos, zTop, step7sin,		step7cos, 1.0f, step7sin,		0.6f, 1.0f,//6
-		step8cos, zTop, step8sin,		step8cos, 1.0f, step8sin,		0.7f, 1.0f,//7
-		step9cos, zTop, step9sin,		step9cos, 1.0f, step9sin,		0.8f, 1.0f,//8
-		step10cos, zTop, step10sin,		step10cos, 1.0f, step10sin,		0.9f, 1.0f,//9
-
-
-		step1cos, zBot, step1sin,		step1cos, -1.0f, step1sin,		0.0f, 0.0f,//10
-		step2cos, zBot, step2sin,		step2cos, -1.0f, step2sin,		0.1f, 0.0f,//11
-		step3cos, zBot, step3sin,		step3cos, -1.0f, step3sin,		0.2f, 0.0f,//12
-		step4cos, zBot, step4sin,		step4cos, -1.0f, step4sin,		0.3f, 0.0f,//13
-		step5cos, zBot, step5sin,		step5cos, -1.0f, step5sin,		0.4f, 0.0f,//14
-		step6cos, zBot, step6sin,		step6cos, -1.0f, step6sin,		0.5f, 0.0f,//15
-		step7cos, zBot, step7sin,		step7cos, -1.0f, step7sin,		0.6f, 0.0f,//16
-		step8cos, zBot, step8sin,		step8cos, -1.0f, step8sin,		0.7f, 0.0f,//17
-		step9cos, zBot, step9sin,		step9cos, -1.0f, step9sin,		0.8f, 0.0f,//18
-		step10cos, zBot, step10sin,		step10cos, -1.0f, step10sin,		0.9f, 0.0f,//19
+//Allocates bytes for the buffer bound to target and writes each piece at its offset, either with
+//glBufferSubData or by allocating immutable storage and copying straight into a write-only mapping
+//of it, which skips the driver's staging copy. Meshes are static so the mapping is released once
+//the copies are done
+void FillMeshBuffer(GLenum target, size_t bytes, const MeshBufferPiece* pieces, size_t pieceCount) {
+	if (mappedMeshUpload && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)) {
+		//dynamic storage keeps glBufferSubData legal for the fallback below
+		glBufferStorage(target, bytes, NULL, GL_MAP_WRITE_BIT | GL_DYNAMIC_STORAGE_BIT);
+		unsigned char* mapped = (unsigned char*)glMapBufferRange(target, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (mapped != nullptr) {
+			for (size_t i = 0; i < pieceCount; i++) {
+				memcpy(mapped + pieces[i].offset, pieces[i].data, pieces[i].bytes);
+			}
+			glUnmapBuffer(target);
+			return;
+		}
+	}
+	else {
+		glBufferData(target, bytes, NULL, GL_STATIC_DRAW);
+	}
+	for (size_t i = 0; i < pieceCount; i++) {
+		glBufferSubData(target, pieces[i].offset, pieces[i].bytes, pieces[i].data);
+	}
+}
 
+//Brings a per-frame buffer up to date with data, uploaded is what the buffer currently holds
+//Only runs of entries that differ are sent, so a frame where little moved uploads little.
+//The buffer grows to twice what's needed when data outgrows it. Returns bytes uploaded
+template <typename T>
+size_t UpdateChangedRanges(GLenum target, GLuint buffer, const std::vector<T>& data, std::vector<T>& uploaded) {
+	//entries this close together go up as one range, fewer calls for a few bytes extra
+	const size_t MERGE_GAP = 4;
+	glBindBuffer(target, buffer);
+	size_t bytes = 0;
+	if (data.size() > uploaded.size()) {
+		//new storage, the whole thing goes up including the zeroed headroom
+		uploaded = data;
+		uploaded.resize(data.size() * 2, T());
+		bytes = uploaded.size() * sizeof(T);
+		glBufferData(target, bytes, uploaded.data(), GL_DYNAMIC_DRAW);
+	}
+	else {
+		size_t i = 0;
+		while (i < data.size()) {
+			if (memcmp(&data[i], &uploaded[i], sizeof(T)) == 0) {
+				i++;
+				continue;
+			}
+			//extend the run until MERGE_GAP entries in a row match
+			size_t first = i;
+			size_t last = i;
+			for (i++; i < data.size() && i - last <= MERGE_GAP; i++) {
+				if (memcmp(&data[i], &uploaded[i], sizeof(T)) != 0) {
+					last = i;
+				}
+			}
+			size_t count = last - first + 1;
+			memcpy(&uploaded[first], &data[first], count * sizeof(T));
+			glBufferSubData(target, first * sizeof(T), count * sizeof(T), &data[first]);
+			bytes += count * sizeof(T);
+		}
+	}
+	glBindBuffer(target, 0);
+	return bytes;
+}
 
-	};
+//Queues one mesh's raw vertex, index and LOD data for the shared buffers
+//indices stay relative to the mesh, baseVertex moves them to its vertices when it's drawn
+//32 bit meshes get their final firstIndex in UploadMeshBuffers(), once the 16 bit section's size is known
+//data from an open cache file in the mesh's pending slot is used in place, anything else is copied
+void AddMeshData(GLMesh& mesh, const GLfloat* vertices, size_t vertexBytes,
+	const void* indices, GLenum indexType, size_t indexCount, const MeshLod* lods, size_t lodCount,
+	glm::vec3 boundsMin, glm::vec3 boundsMax) {
+	PendingMesh& pending = pendingMeshes[pendingMeshCount++];
+	bool mapped = pending.cache.header != nullptr;
+	pending.mesh = &mesh;
+	mesh.indexType = indexType;
+	mesh.nIndices = (GLuint)indexCount;
+	size_t vertexCount = vertexBytes / (FLOATS_PER_VERTEX * sizeof(GLfloat));
+	mesh.baseVertex = (GLint)meshVertexCount;
+	meshVertexCount += vertexCount;
+	if (packedVertices) {
+		//quantized against the same bounds the shaders' mesh table gets
+		pending.vertices.resize(vertexCount * sizeof(PackedVertex));
+		PackVertices(vertices, vertexCount, boundsMin, boundsMax, (PackedVertex*)pending.vertices.data());
+		pending.vertexData = pending.vertices.data();
+		pending.vertexBytes = pending.vertices.size();
+	}
+	else if (mapped) {
+		pending.vertexData = vertices;
+		pending.vertexBytes = vertexBytes;
+	}
+	else {
+		pending.vertices.assign((const unsigned char*)vertices, (const unsigned char*)vertices + vertexBytes);
+		pending.vertexData = pending.vertices.data();
+		pending.vertexBytes = vertexBytes;
+	}
+	size_t indexBytes = indexCount * (indexType == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort));
+	if (indexType == GL_UNSIGNED_INT) {
+		mesh.firstIndex = (GLuint)meshIntIndexCount;
+		meshIntIndexCount += indexCount;
+	}
+	else {
+		mesh.firstIndex = (GLuint)meshShortIndexCount;
+		meshShortIndexCount += indexCount;
+	}
+	if (mapped) {
+		pending.indexData = indices;
+	}
+	else {
+		pending.indices.assign((const unsigned char*)indices, (const unsigned char*)indices + indexBytes);
+		pending.indexData = pending.indices.data();
+	}
+	pending.indexBytes = indexBytes;
 
-	GLushort indices[] = {
-		0, 1, 10,	1, 10, 11,
-		1, 2, 11,	2, 11, 12,
-		2, 3, 12,	3, 12, 13,
-		3, 4, 13,	4, 13, 14,
-		4, 5, 14,	5, 14, 15,
-		5, 6, 15,	6, 15, 16,
-		6, 7, 16,	7, 16, 17,
-		7, 8, 17,	8, 17, 18,
-		8, 9, 18,	9, 18, 19,
-		9, 0, 19,	0, 19, 10,
-
-		0, 1, 2,	0, 2, 3,
-		0, 3, 4,	0, 4, 5,
-		0, 5, 6,	0, 6, 7,
-		0, 7, 8,	0, 8, 9,
-	};
+	//LOD ranges, a mesh without a chain draws everything as one level
+	mesh.nLods = 0;
+	for (size_t i = 0; i < lodCount && i < MAX_MESH_LODS; i++) {
+		mesh.lods[mesh.nLods++] = lods[i];
+	}
+	if (mesh.nLods == 0) {
+		mesh.lods[0].firstIndex = 0;
+		mesh.lods[0].indexCount = mesh.nIndices;
+		mesh.lods[0].baseVertex = 0;
+		mesh.nLods = 1;
+	}
 
-	//Now run it all for v2 and indices2 for the plane
-	//constants for stride
-	const GLuint floatsPerVertex = 3;
-	const GLuint floatsPerNormal = 3;
-	const GLuint floatsPerTexture = 2;
+	//bounding box and the sphere around it
+	mesh.boundsMin = boundsMin;
+	mesh.boundsMax = boundsMax;
+	mesh.boundCenter = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+	mesh.boundRadius = glm::length(mesh.boundsMax - mesh.boundCenter);
+}
 
+//Builds the shared vao and buffers from every mesh added so far, called once after the meshes are created
+void UploadMeshBuffers() {
 	//generate and bind vao
-	glGenVertexArrays(1, &mesh.vao);
-	glBindVertexArray(mesh.vao);
+	glGenVertexArrays(1, &meshVao);
+	glBindVertexArray(meshVao);
 
 	//Create and bind 2 vbos for vertices and indices
-	glGenBuffers(2, mesh.vbos);
-	//Activate and bind buffers
-
-	//Rebind buffer and use the next set of vertices and indices
-	glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+	glGenBuffers(2, meshVbos);
+
+	//16 bit section, padded to a whole 32 bit index, then the 32 bit section
+	//firstIndex counts in the mesh's own index type, so 32 bit meshes move past the padded 16 bit section
+	GLuint intSectionStart = (GLuint)((meshShortIndexCount + 1) / 2);
+	for (unsigned int i = 0; i < MESH_COUNT; i++) {
+		if (meshes[i]->indexType == GL_UNSIGNED_INT) {
+			meshes[i]->firstIndex += intSectionStart;
+		}
+	}
 
-	mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+	size_t vertexSize = packedVertices ? sizeof(PackedVertex) : FLOATS_PER_VERTEX * sizeof(GLfloat);
+	MeshBufferPiece vertexPieces[MESH_COUNT];
+	MeshBufferPiece indexPieces[MESH_COUNT];
+	for (unsigned int i = 0; i < pendingMeshCount; i++) {
+		const GLMesh& mesh = *pendingMeshes[i].mesh;
+		size_t indexSize = mesh.indexType == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort);
+		vertexPieces[i].offset = mesh.baseVertex * vertexSize;
+		vertexPieces[i].bytes = pendingMeshes[i].vertexBytes;
+		vertexPieces[i].data = pendingMeshes[i].vertexData;
+		indexPieces[i].offset = mesh.firstIndex * indexSize;
+		indexPieces[i].bytes = pendingMeshes[i].indexBytes;
+		indexPieces[i].data = pendingMeshes[i].indexData;
+	}
+	size_t vertexBytes = meshVertexCount * vertexSize;
+	glBindBuffer(GL_ARRAY_BUFFER, meshVbos[0]);
+	FillMeshBuffer(GL_ARRAY_BUFFER, vertexBytes, vertexPieces, pendingMeshCount);
+	std::cout << "INFO: Mesh vertices: " << vertexBytes / 1024 << " KB, " << vertexSize << " bytes each" << std::endl;
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshVbos[1]);
+	FillMeshBuffer(GL_ELEMENT_ARRAY_BUFFER, (intSectionStart + meshIntIndexCount) * sizeof(GLuint), indexPieces, pendingMeshCount);
+
+	//the GPU has its copy now, close the cache files and drop the generated data
+	for (unsigned int i = 0; i < pendingMeshCount; i++) {
+		pendingMeshes[i].cache.Close();
+		std::vector<unsigned char>().swap(pendingMeshes[i].vertices);
+		std::vector<unsigned char>().swap(pendingMeshes[i].indices);
+	}
+	pendingMeshCount = 0;
+
+	if (packedVertices) {
+		//normalized integers, the shaders get 0-1 positions and uvs and a -1-1 octahedral normal
+		GLint stride = sizeof(PackedVertex);
+		glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, position));
+		glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, normal));
+		glVertexAttribPointer(2, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, uv));
+	}
+	else {
+		//establish stride
+		GLint stride = sizeof(float) * FLOATS_PER_VERTEX;
 
-	//establish draw
-	//GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor);
-	GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerTexture);
+		//Create attribute pointers
+		glVertexAttribPointer(0, FLOATS_PER_POSITION, GL_FLOAT, GL_FALSE, stride, 0);
+		glVertexAttribPointer(1, FLOATS_PER_NORMAL, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * FLOATS_PER_POSITION));
 
-	//Create attribute pointers
-	glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
+		//for texture
+		glVertexAttribPointer(2, FLOATS_PER_UV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (FLOATS_PER_POSITION + FLOATS_PER_NORMAL)));
+	}
 	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
 	glEnableVertexAttribArray(1);
-	
-	//for texture
-	glVertexAttribPointer(2, floatsPerTexture, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
 	glEnableVertexAttribArray(2);
-	
-	//wireframe render for debug, comment to get solid shapes
-	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-}
-
-//Destroy Mesh once not using
-void DestroyMesh(GLMesh& mesh) {
-	glDeleteVertexArrays(1, &mesh.vao);
-	glDeleteBuffers(2, mesh.vbos);
-}
-
-bool CreateTexture(const char* fileName, GLuint& textureId) {
-	int width, height, channels;
-	unsigned char* image = stbi_load(fileName, &width, &height, &channels, 0);
-	if (image) {
-		flipImageVertically(image, width, height, channels);
 
-		glGenTextures(1, &textureId);
-		glBindTexture(GL_TEXTURE_2D, textureId);
-
-		//texture wrapping
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		//texture filtering
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-		if (channels == 3) {
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-		}
-		else if (channels == 4) {
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-		}
-		else {
-			std::cout << "Not implemented for image with " << channels << " channels\n";
-		}
-
-		glGenerateMipmap(GL_TEXTURE_2D);
-
-		//unbinds the texture
-		stbi_image_free(image);
-		glBindTexture(GL_TEXTURE_2D, 0);
-
-		return true;
+	//Per-instance attributes from the shared instance buffer, advance once per instance
+	//each indirect command's baseInstance picks where its instances start
+	glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+	GLint instanceStride = sizeof(InstanceData);
+	for (GLuint column = 0; column < 4; column++) {
+		GLuint location = INSTANCE_MODEL_LOCATION + column;
+		glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, instanceStride, (void*)(offsetof(InstanceData, model) + sizeof(glm::vec4) * column));
+		glEnableVertexAttribArray(location);
+		glVertexAttribDivisor(location, 1);
 	}
-	else {
-		std::cout << "Texture Creation Error" << std::endl;
-		return false;
+	glVertexAttribPointer(INSTANCE_COLOR_LOCATION, 4, GL_FLOAT, GL_FALSE, instanceStride, (void*)offsetof(InstanceData, color));
+	glEnableVertexAttribArray(INSTANCE_COLOR_LOCATION);
+	glVertexAttribDivisor(INSTANCE_COLOR_LOCATION, 1);
+	for (GLuint column = 0; column < 3; column++) {
+		GLuint location = INSTANCE_NORMAL_LOCATION + column;
+		glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, instanceStride, (void*)(offsetof(InstanceData, normalMatrix) + sizeof(glm::vec3) * column));
+		glEnableVertexAttribArray(location);
+		glVertexAttribDivisor(location, 1);
+	}
+	glVertexAttribIPointer(INSTANCE_MESH_LOCATION, 1, GL_UNSIGNED_INT, instanceStride, (void*)offsetof(InstanceData, mesh));
+	glEnableVertexAttribArray(INSTANCE_MESH_LOCATION);
+	glVertexAttribDivisor(INSTANCE_MESH_LOCATION, 1);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//Dequantization table, the float layout gets an identity entry for every mesh
+	MeshData meshData;
+	for (unsigned int i = 0; i < MESH_TABLE_SIZE; i++) {
+		bool packed = packedVertices && i < MESH_COUNT;
+		meshData.positionOffsets[i] = packed ? glm::vec4(meshes[i]->boundsMin, 0.0f) : glm::vec4(0.0f);
+		meshData.positionScales[i] = packed ? glm::vec4(meshes[i]->boundsMax - meshes[i]->boundsMin, 0.0f) : glm::vec4(1.0f);
 	}
+	meshData.octahedralNormals = packedVertices ? 1 : 0;
+	meshData.padding[0] = meshData.padding[1] = meshData.padding[2] = 0;
+	glGenBuffers(1, &meshUbo);
+	glBindBuffer(GL_UNIFORM_BUFFER, meshUbo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(MeshData), &meshData, GL_STATIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, MESH_UBO_BINDING, meshUbo);
 }
 
-void DestroyTexture(GLuint textureId) {
-	glGenTextures(1, &textureId);
+//Destroy the shared mesh buffers once not using
+void DestroyMeshBuffers() {
+	glDeleteVertexArrays(1, &meshVao);
+	glDeleteBuffers(2, meshVbos);
+	glDeleteBuffers(1, &meshUbo);
 }
 
 //Create shader for vert and frag
 bool CreateShaderProgram(const char* vertShaderSource,
-	const char* fragShaderSource, GLuint& programId) {
+	const char* fragShaderSource, GLuint& programId, UniformCache& uniforms) {
+	//a binary from an earlier run skips compiling entirely
+	const char* sources[2] = { vertShaderSource, fragShaderSource };
+	uint32_t key = programCache.Key(sources, 2);
+	programId = programCache.Load(key);
+	if (programId != 0) {
+		CacheUniformLocations(programId, uniforms);
+		glUseProgram(programId);
+		return true;
+	}
+
 	//error variables
 	int success = 0;
 	char infoLog[512];
@@ -1478,6 +2579,7 @@ bool CreateShaderProgram(const char* vertShaderSource,
 	//Attach compiled shaders to program
 	glAttachShader(programId, vertShaderId);
 	glAttachShader(programId, fragShaderId);
+	programCache.PrepareLink(programId);
 	glLinkProgram(programId);
 	//error check
 	glGetProgramiv(programId, GL_LINK_STATUS, &success);
@@ -1488,11 +2590,50 @@ bool CreateShaderProgram(const char* vertShaderSource,
 		return false;
 	}
 
+	//next run loads this instead
+	programCache.Save(programId, key);
+
+	//look up every uniform once so Render() never asks the driver by name
+	CacheUniformLocations(programId, uniforms);
+
 	//execute the now-completed shader program
 	glUseProgram(programId);
 	return true;
 }
 
+//Introspect the linked program and store the location of each active uniform
+void CacheUniformLocations(GLuint programId, UniformCache& uniforms) {
+	GLint count = 0;
+	GLint maxLength = 0;
+	glGetProgramiv(programId, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(programId, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+	uniforms.locations.clear();
+	std::string name(maxLength > 0 ? maxLength : 1, '\0');
+	for (GLint i = 0; i < count; i++) {
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(programId, (GLuint)i, maxLength, &length, &size, &type, &name[0]);
+		std::string uniformName(name.c_str(), length);
+
+		//block members have no location, they are fed through the uniform buffer
+		GLint location = glGetUniformLocation(programId, uniformName.c_str());
+		if (location == -1) {
+			continue;
+		}
+		//arrays are reported as name[0], store them under the plain name too
+		size_t bracket = uniformName.find('[');
+		if (bracket != std::string::npos) {
+			uniforms.locations[uniformName.substr(0, bracket)] = location;
+		}
+		uniforms.locations[uniformName] = location;
+	}
+
+	uniforms.textureScale = uniforms.Get("textureScale");
+	uniforms.uTexture = uniforms.Get("uTexture");
+}
+
 void DestroyShaderProgram(GLuint programId) {
 	glDeleteProgram(programId);
 }
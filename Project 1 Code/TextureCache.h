@@ -0,0 +1,736 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <GL/glew.h>
+
+#include "stb_image.h"
+#include "TextureContainer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+//Texture function to correct image flip at load
+inline void flipImageVertically(unsigned char* image, int width, int height, int channels) {
+	for (int i = 0; i < height / 2; i++) {
+		int index1 = i * width * channels;
+		int index2 = (height - 1 - i) * width * channels;
+
+		for (int j = width * channels; j > 0; j--) {
+			unsigned char tmp = image[index1];
+			image[index1] = image[index2];
+			image[index2] = tmp;
+			index1++;
+			index2++;
+		}
+	}
+}
+
+//Texture cache keyed by file path
+//Each image is decoded once on a worker thread and uploaded once on the GL thread,
+//every request for the same path hands back the same texture id
+//A cooked .ctex next to the image (see TextureCooker.cpp) is used instead when the driver has S3TC,
+//its compressed levels go straight to the GPU with no decode and no runtime mip generation
+//Images can also go into one shared GL_TEXTURE_2D_ARRAY through GetLayer(), so objects with different
+//images still share one binding. The array is block compressed when every layer has a cooked file at
+//the layer size (TextureCooker --size), otherwise it is RGBA8 and each image is resampled on the worker
+class TextureCache {
+public:
+	//cache statistics
+	unsigned int hits;
+	unsigned int misses;
+	//textures still waiting on a decode or an upload
+	unsigned int pending;
+	//textures that came from cooked files
+	unsigned int cooked;
+
+	//Constructor, worker threads are started on the first request
+	TextureCache(unsigned int workerCount = 0) : hits(0), misses(0), pending(0), cooked(0),
+		numWorkers(workerCount), placeholderPixel{ 128, 128, 128, 255 }, pbo(0), cookedSupport(-1),
+		arrayTexture(0), arrayFormat(0), layerSize(0), layerLevels(0), layerCapacity(0), stopping(false) {
+		staging.active = false;
+	}
+
+	~TextureCache() {
+		Shutdown();
+	}
+
+	//returns the texture for a file, only queuing a decode the first time the path is seen
+	//the id is valid straight away and shows a 1x1 placeholder until Update() uploads the image
+	bool GetTexture(const char* fileName, GLuint& textureId) {
+		std::unordered_map<std::string, GLuint>::const_iterator found = textures.find(fileName);
+		if (found != textures.end()) {
+			hits++;
+			textureId = found->second;
+			return true;
+		}
+
+		misses++;
+		StartWorkers();
+		//checked here since the constructor runs before there's a context
+		if (cookedSupport < 0) {
+			cookedSupport = GLEW_EXT_texture_compression_s3tc ? 1 : 0;
+		}
+
+		//Placeholder so the object can be drawn before its image is ready
+		glGenTextures(1, &textureId);
+		glBindTexture(GL_TEXTURE_2D, textureId);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholderPixel);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		textures[fileName] = textureId;
+		pending++;
+
+		//hand the decode to the pool
+		DecodeJob job;
+		job.fileName = fileName;
+		job.textureId = textureId;
+		job.image = nullptr;
+		job.width = job.height = job.channels = 0;
+		job.tryCooked = cookedSupport == 1;
+		job.layer = -1;
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			decodeQueue.push_back(job);
+		}
+		queueReady.notify_one();
+		return true;
+	}
+
+	//Makes the shared texture array, size x size per layer with a full mip chain
+	//its storage waits for the next Update(), once every layer's cooked file has been checked
+	void CreateArray(int size, unsigned int layerCount) {
+		layerSize = size;
+		layerCapacity = layerCount;
+		layerLevels = 1;
+		while ((size >> layerLevels) > 0) {
+			layerLevels++;
+		}
+		glGenTextures(1, &arrayTexture);
+	}
+
+	//Returns the array layer holding a file, only queuing a load the first time the path is seen
+	//the layer shows the placeholder until its image is uploaded, fails once every layer is taken
+	bool GetLayer(const char* fileName, unsigned int& layer) {
+		std::unordered_map<std::string, unsigned int>::const_iterator found = layers.find(fileName);
+		if (found != layers.end()) {
+			hits++;
+			layer = found->second;
+			return true;
+		}
+		if (arrayTexture == 0 || layers.size() >= layerCapacity) {
+			std::cout << "No texture array layer left for " << fileName << std::endl;
+			return false;
+		}
+
+		misses++;
+		if (cookedSupport < 0) {
+			cookedSupport = GLEW_EXT_texture_compression_s3tc ? 1 : 0;
+		}
+		layer = (unsigned int)layers.size();
+		layers[fileName] = layer;
+		pending++;
+
+		PendingLayer entry;
+		entry.fileName = fileName;
+		entry.layer = layer;
+		entry.cookedFormat = cookedSupport == 1 ? ReadCookedFormat(fileName) : 0;
+		pendingLayers.push_back(entry);
+		if (arrayFormat != 0) {
+			QueueLayers();
+		}
+		return true;
+	}
+
+	//the shared array, 0 until CreateArray()
+	GLuint ArrayTexture() const {
+		return arrayTexture;
+	}
+
+	//Called once per frame on the GL thread
+	//copies finished decodes into a pixel buffer, at most byteBudget bytes a frame. An image bigger than
+	//the budget is copied over several frames and only replaces its placeholder once all of it is in
+	void Update(size_t byteBudget) {
+		if (arrayFormat == 0 && !pendingLayers.empty()) {
+			AllocateArray();
+		}
+		size_t copied = 0;
+		while (copied < byteBudget) {
+			if (!staging.active) {
+				DecodeJob job;
+				{
+					std::lock_guard<std::mutex> lock(doneMutex);
+					if (doneQueue.empty()) {
+						return;
+					}
+					job = std::move(doneQueue.front());
+					doneQueue.pop_front();
+				}
+				if (job.cookedData.empty() && job.layerData.empty() && job.image == nullptr) {
+					//object keeps drawing with the placeholder
+					std::cout << "Failed to load texture " << job.fileName << std::endl;
+					pending--;
+					continue;
+				}
+				size_t size = (size_t)job.width * job.height * job.channels;
+				if (!job.cookedData.empty()) {
+					size = job.cookedData.size();
+				}
+				else if (!job.layerData.empty()) {
+					size = job.layerData.size();
+				}
+				BeginStaging(job, size);
+			}
+
+			copied += StageChunk(byteBudget - copied);
+			if (staging.copied == staging.size) {
+				if (staging.job.layer >= 0) {
+					UploadLayer(staging.job, StagedBase());
+				}
+				else {
+					Upload(staging.job, StagedBase());
+				}
+				stbi_image_free(staging.job.image);
+				std::vector<unsigned char>().swap(staging.job.cookedData);
+				std::vector<unsigned char>().swap(staging.job.layerData);
+				staging.active = false;
+				pending--;
+			}
+		}
+	}
+
+	//blocks until every queued texture is uploaded, for callers that need final images
+	void Flush() {
+		while (pending > 0) {
+			Update((size_t)-1);
+			if (pending > 0) {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	//number of textures currently held on the GPU, array layers included
+	size_t Size() const {
+		return textures.size() + layers.size();
+	}
+
+	void PrintStats() const {
+		std::cout << "INFO: Texture cache: " << textures.size() << " textures, " << layers.size() << " array layers ("
+			<< cooked << " cooked), " << hits << " hits, " << misses << " misses" << std::endl;
+	}
+
+	//stops the decode threads, anything still queued is dropped
+	void Shutdown() {
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			stopping = true;
+			decodeQueue.clear();
+		}
+		queueReady.notify_all();
+		for (size_t i = 0; i < workers.size(); i++) {
+			workers[i].join();
+		}
+		workers.clear();
+
+		std::lock_guard<std::mutex> lock(doneMutex);
+		for (size_t i = 0; i < doneQueue.size(); i++) {
+			stbi_image_free(doneQueue[i].image);
+		}
+		doneQueue.clear();
+		if (staging.active) {
+			stbi_image_free(staging.job.image);
+			staging.job.cookedData.clear();
+			staging.job.layerData.clear();
+			staging.active = false;
+		}
+	}
+
+	//frees every cached texture, ids handed out before this are no longer valid
+	void Clear() {
+		for (std::unordered_map<std::string, GLuint>::iterator it = textures.begin(); it != textures.end(); ++it) {
+			glDeleteTextures(1, &it->second);
+		}
+		textures.clear();
+		if (arrayTexture != 0) {
+			glDeleteTextures(1, &arrayTexture);
+			arrayTexture = 0;
+		}
+		arrayFormat = 0;
+		layers.clear();
+		pendingLayers.clear();
+		if (pbo != 0) {
+			glDeleteBuffers(1, &pbo);
+			pbo = 0;
+		}
+	}
+
+private:
+	//one image moving from the decode pool to the GL thread
+	struct DecodeJob {
+		std::string fileName;
+		GLuint textureId;
+		unsigned char* image;
+		int width;
+		int height;
+		int channels;
+		bool tryCooked;							//look for a .ctex before decoding the image
+		std::vector<unsigned char> cookedData;	//whole cooked file, empty when the image was decoded
+		int layer;								//array layer, -1 for a texture of its own
+		int layerSize;
+		std::vector<unsigned char> layerData;	//RGBA mip chain at the layer size, largest level first
+	};
+
+	//array layer waiting for the array's storage, see AllocateArray()
+	struct PendingLayer {
+		std::string fileName;
+		unsigned int layer;
+		GLenum cookedFormat;		//block format of a cooked file that fits the layer, 0 if there isn't one
+	};
+
+	//job being copied into the pixel buffer, see Update()
+	struct Staging {
+		bool active;
+		DecodeJob job;
+		size_t size;
+		size_t copied;
+		bool mapped;		//false once a map failed, the upload then reads the job's own memory
+	};
+
+	unsigned int numWorkers;
+	unsigned char placeholderPixel[4];
+	GLuint pbo;
+	int cookedSupport;		//-1 until the first request checks the driver
+	std::unordered_map<std::string, GLuint> textures;
+	Staging staging;
+	//shared texture array
+	GLuint arrayTexture;
+	GLenum arrayFormat;		//GL_RGBA8 or a cooked block format, 0 until AllocateArray()
+	int layerSize;
+	int layerLevels;
+	unsigned int layerCapacity;
+	std::unordered_map<std::string, unsigned int> layers;
+	std::vector<PendingLayer> pendingLayers;
+
+	//worker pool
+	std::vector<std::thread> workers;
+	std::mutex queueMutex;
+	std::condition_variable queueReady;
+	std::deque<DecodeJob> decodeQueue;
+	bool stopping;
+	std::mutex doneMutex;
+	std::deque<DecodeJob> doneQueue;
+
+	void StartWorkers() {
+		if (!workers.empty()) {
+			return;
+		}
+		unsigned int count = numWorkers;
+		if (count == 0) {
+			//leave a core for the render thread
+			count = std::thread::hardware_concurrency();
+			count = count > 1 ? count - 1 : 1;
+			count = count > 4 ? 4 : count;
+		}
+		stopping = false;
+		for (unsigned int i = 0; i < count; i++) {
+			workers.push_back(std::thread(&TextureCache::WorkerLoop, this));
+		}
+	}
+
+	//Decode thread, reads the file and runs stb_image + flip without touching GL
+	void WorkerLoop() {
+		while (true) {
+			DecodeJob job;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueReady.wait(lock, [this] { return stopping || !decodeQueue.empty(); });
+				if (stopping) {
+					return;
+				}
+				job = decodeQueue.front();
+				decodeQueue.pop_front();
+			}
+
+			//cooked file first, nothing to decode if it's there and valid
+			//a layer of a block compressed array can't fall back to the image, it keeps the placeholder
+			if (job.tryCooked && (LoadCooked(job) || job.layer >= 0)) {
+				std::lock_guard<std::mutex> lock(doneMutex);
+				doneQueue.push_back(std::move(job));
+				continue;
+			}
+
+			std::ifstream file(job.fileName.c_str(), std::ios::binary);
+			std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			if (job.layer >= 0) {
+				BuildLayer(job, bytes);
+				std::lock_guard<std::mutex> lock(doneMutex);
+				doneQueue.push_back(std::move(job));
+				continue;
+			}
+			if (!bytes.empty()) {
+				job.image = stbi_load_from_memory(bytes.data(), (int)bytes.size(),
+					&job.width, &job.height, &job.channels, 0);
+			}
+			if (job.image != nullptr && job.channels != 3 && job.channels != 4) {
+				std::cout << "Not implemented for image with " << job.channels << " channels\n";
+				stbi_image_free(job.image);
+				job.image = nullptr;
+			}
+			if (job.image != nullptr) {
+				flipImageVertically(job.image, job.width, job.height, job.channels);
+			}
+
+			std::lock_guard<std::mutex> lock(doneMutex);
+			doneQueue.push_back(std::move(job));
+		}
+	}
+
+	//reads the job's .ctex into cookedData, false (and nothing kept) if it's missing or invalid
+	bool LoadCooked(DecodeJob& job) {
+		std::string cookedName = CookedTextureFileName(job.fileName);
+		std::ifstream file(cookedName.c_str(), std::ios::binary);
+		if (!file) {
+			return false;
+		}
+		job.cookedData.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		const CookedTextureHeader* header;
+		const CookedTextureLevel* levels;
+		if (!ParseCookedTexture(job.cookedData.data(), job.cookedData.size(), header, levels)) {
+			std::cout << "Ignoring invalid cooked texture " << cookedName << std::endl;
+			job.cookedData.clear();
+			return false;
+		}
+		return true;
+	}
+
+	//Decodes an array layer as RGBA and resamples it to the layer size, then builds the mip chain
+	//the GL thread only copies the result, so no glGenerateMipmap over the whole array per layer
+	static void BuildLayer(DecodeJob& job, const std::vector<unsigned char>& bytes) {
+		int width = 0, height = 0, channels = 0;
+		unsigned char* image = bytes.empty() ? nullptr :
+			stbi_load_from_memory(bytes.data(), (int)bytes.size(), &width, &height, &channels, 4);
+		if (image == nullptr) {
+			return;
+		}
+		flipImageVertically(image, width, height, 4);
+
+		//halve big images first so the bilinear pass below never skips source pixels
+		std::vector<unsigned char> source(image, image + (size_t)width * height * 4);
+		stbi_image_free(image);
+		while (width >= job.layerSize * 2 && height >= job.layerSize * 2) {
+			std::vector<unsigned char> half((size_t)(width / 2) * (height / 2) * 4);
+			Downsample(source.data(), width, height, half.data());
+			source.swap(half);
+			width /= 2;
+			height /= 2;
+		}
+
+		//level 0, bilinear with texel centers lined up
+		size_t total = 0;
+		for (int size = job.layerSize; size > 0; size /= 2) {
+			total += (size_t)size * size * 4;
+		}
+		job.layerData.resize(total);
+		unsigned char* level = job.layerData.data();
+		float scaleX = (float)width / job.layerSize;
+		float scaleY = (float)height / job.layerSize;
+		for (int y = 0; y < job.layerSize; y++) {
+			float sy = std::max((y + 0.5f) * scaleY - 0.5f, 0.0f);
+			int y0 = std::min((int)sy, height - 1);
+			int y1 = std::min(y0 + 1, height - 1);
+			float fy = sy - y0;
+			for (int x = 0; x < job.layerSize; x++) {
+				float sx = std::max((x + 0.5f) * scaleX - 0.5f, 0.0f);
+				int x0 = std::min((int)sx, width - 1);
+				int x1 = std::min(x0 + 1, width - 1);
+				float fx = sx - x0;
+				const unsigned char* p00 = &source[((size_t)y0 * width + x0) * 4];
+				const unsigned char* p01 = &source[((size_t)y0 * width + x1) * 4];
+				const unsigned char* p10 = &source[((size_t)y1 * width + x0) * 4];
+				const unsigned char* p11 = &source[((size_t)y1 * width + x1) * 4];
+				unsigned char* out = &level[((size_t)y * job.layerSize + x) * 4];
+				for (int c = 0; c < 4; c++) {
+					float top = p00[c] + (p01[c] - p00[c]) * fx;
+					float bottom = p10[c] + (p11[c] - p10[c]) * fx;
+					out[c] = (unsigned char)(top + (bottom - top) * fy + 0.5f);
+				}
+			}
+		}
+
+		//rest of the chain, each level a 2x2 average of the one above like glGenerateMipmap
+		for (int size = job.layerSize; size > 1; size /= 2) {
+			unsigned char* next = level + (size_t)size * size * 4;
+			Downsample(level, size, size, next);
+			level = next;
+		}
+	}
+
+	//2x2 box filter of an RGBA image into one half the size
+	static void Downsample(const unsigned char* source, int width, int height, unsigned char* destination) {
+		int halfWidth = width / 2;
+		int halfHeight = height / 2;
+		for (int y = 0; y < halfHeight; y++) {
+			const unsigned char* row0 = source + (size_t)(y * 2) * width * 4;
+			const unsigned char* row1 = row0 + (size_t)width * 4;
+			for (int x = 0; x < halfWidth; x++) {
+				for (int c = 0; c < 4; c++) {
+					int sum = row0[x * 8 + c] + row0[x * 8 + 4 + c] + row1[x * 8 + c] + row1[x * 8 + 4 + c];
+					destination[((size_t)y * halfWidth + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+				}
+			}
+		}
+	}
+
+	//block format of a file's .ctex when, going by its header alone, it fills a whole layer:
+	//layer sized and square with the full mip chain. 0 if it's missing or doesn't fit
+	GLenum ReadCookedFormat(const char* fileName) const {
+		std::ifstream file(CookedTextureFileName(fileName).c_str(), std::ios::binary);
+		CookedTextureHeader header;
+		if (!file || !file.read((char*)&header, sizeof(header)) ||
+			memcmp(header.identifier, COOKED_TEXTURE_IDENTIFIER, sizeof(header.identifier)) != 0 ||
+			CookedBlockBytes(header.glInternalFormat) == 0 || header.pixelWidth != (uint32_t)layerSize ||
+			header.pixelHeight != (uint32_t)layerSize || header.levelCount != (uint32_t)layerLevels) {
+			return 0;
+		}
+		return header.glInternalFormat;
+	}
+
+	//Gives the array its storage, filled with the placeholder color, and queues the layers asked for so far
+	//the array is block compressed only if every one of them has a fitting cooked file of the same format,
+	//a single image without one would otherwise be left on the placeholder
+	void AllocateArray() {
+		arrayFormat = pendingLayers[0].cookedFormat;
+		for (size_t i = 1; i < pendingLayers.size(); i++) {
+			if (pendingLayers[i].cookedFormat != arrayFormat) {
+				arrayFormat = 0;
+			}
+		}
+		if (arrayFormat == 0) {
+			arrayFormat = GL_RGBA8;
+			if (cookedSupport == 1) {
+				std::cout << "INFO: Texture array is RGBA8, cook every image with TextureCooker --size "
+					<< layerSize << " for a block compressed one" << std::endl;
+			}
+		}
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, arrayTexture);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, layerLevels, arrayFormat, layerSize, layerSize, layerCapacity);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		if (arrayFormat == GL_RGBA8) {
+			for (int level = 0; level < layerLevels; level++) {
+				glClearTexImage(arrayTexture, level, GL_RGBA, GL_UNSIGNED_BYTE, placeholderPixel);
+			}
+		}
+		else {
+			//glClearTexImage can't write block formats, so every block is a solid one of the placeholder:
+			//a BC1 color block with both endpoints at the color, BC3 puts an alpha block first
+			uint16_t color = (uint16_t)(((placeholderPixel[0] >> 3) << 11) | ((placeholderPixel[1] >> 2) << 5) | (placeholderPixel[2] >> 3));
+			unsigned char block[16] = {};
+			uint32_t blockBytes = CookedBlockBytes(arrayFormat);
+			unsigned char* colorBlock = block + blockBytes - 8;
+			if (blockBytes == 16) {
+				block[0] = block[1] = placeholderPixel[3];
+			}
+			colorBlock[0] = colorBlock[2] = (unsigned char)(color & 0xFF);
+			colorBlock[1] = colorBlock[3] = (unsigned char)(color >> 8);
+			std::vector<unsigned char> blocks;
+			int size = layerSize;
+			for (int level = 0; level < layerLevels; level++) {
+				size_t bytes = (size_t)CookedLevelBytes(arrayFormat, size, size) * layerCapacity;
+				blocks.resize(bytes);
+				for (size_t offset = 0; offset < bytes; offset += blockBytes) {
+					memcpy(&blocks[offset], block, blockBytes);
+				}
+				glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, 0, size, size, layerCapacity,
+					arrayFormat, (GLsizei)bytes, blocks.data());
+				size = size > 1 ? size / 2 : 1;
+			}
+		}
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		QueueLayers();
+	}
+
+	//hands the layers waiting in pendingLayers to the pool, cooked or decoded to match the array
+	void QueueLayers() {
+		StartWorkers();
+		bool compressed = arrayFormat != GL_RGBA8;
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			for (size_t i = 0; i < pendingLayers.size(); i++) {
+				const PendingLayer& entry = pendingLayers[i];
+				if (compressed && entry.cookedFormat != arrayFormat) {
+					//requested after the array was made compressed, nothing fits so it keeps the placeholder
+					std::cout << "No cooked texture of the array's size and format for " << entry.fileName << std::endl;
+					pending--;
+					continue;
+				}
+				DecodeJob job;
+				job.fileName = entry.fileName;
+				job.textureId = arrayTexture;
+				job.image = nullptr;
+				job.width = job.height = job.channels = 0;
+				job.tryCooked = compressed;
+				job.layer = (int)entry.layer;
+				job.layerSize = layerSize;
+				decodeQueue.push_back(job);
+			}
+		}
+		pendingLayers.clear();
+		queueReady.notify_all();
+	}
+
+	//starts copying size bytes of a job into the pixel buffer
+	//the old storage is orphaned so we never wait on the previous upload
+	void BeginStaging(DecodeJob& job, size_t size) {
+		if (pbo == 0) {
+			glGenBuffers(1, &pbo);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		staging.active = true;
+		staging.job = std::move(job);
+		staging.size = size;
+		staging.copied = 0;
+		staging.mapped = true;
+	}
+
+	//Copies up to budget more bytes of the staged job into the pixel buffer, returns bytes copied
+	//nothing reads the buffer until the whole job is in, so the map doesn't have to wait on the GPU
+	size_t StageChunk(size_t budget) {
+		size_t chunk = std::min(staging.size - staging.copied, budget);
+		if (staging.mapped && chunk > 0) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+			void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, staging.copied, chunk,
+				GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+			if (mapped != nullptr) {
+				memcpy(mapped, StagingSource() + staging.copied, chunk);
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			}
+			else {
+				//mapping failed, the job's memory goes to GL directly instead
+				staging.mapped = false;
+			}
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+		staging.copied += chunk;
+		return chunk;
+	}
+
+	//bytes of the staged job that go into the pixel buffer, the cooked file, layer chain or decoded pixels
+	const unsigned char* StagingSource() const {
+		if (!staging.job.cookedData.empty()) {
+			return staging.job.cookedData.data();
+		}
+		return staging.job.layerData.empty() ? staging.job.image : staging.job.layerData.data();
+	}
+
+	//Binds the filled pixel buffer and returns the base that source offsets are added to: zero for
+	//offsets into the buffer, or the client memory itself when the buffer couldn't be mapped
+	uintptr_t StagedBase() {
+		if (!staging.mapped) {
+			return (uintptr_t)StagingSource();
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+		return 0;
+	}
+
+	//replaces the placeholder with the decoded pixels or the cooked levels
+	void Upload(const DecodeJob& job, uintptr_t base) {
+		bool isCooked = !job.cookedData.empty();
+		//LoadCooked() checked the file already, a failed parse here still keeps the placeholder
+		const CookedTextureHeader* header = nullptr;
+		const CookedTextureLevel* levels = nullptr;
+		if (isCooked && !ParseCookedTexture(job.cookedData.data(), job.cookedData.size(), header, levels)) {
+			std::cout << "Ignoring invalid cooked texture for " << job.fileName << std::endl;
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			return;
+		}
+
+		glBindTexture(GL_TEXTURE_2D, job.textureId);
+		if (isCooked) {
+			//every level was built offline, nothing left to generate
+			GLsizei width = header->pixelWidth;
+			GLsizei height = header->pixelHeight;
+			for (uint32_t level = 0; level < header->levelCount; level++) {
+				glCompressedTexImage2D(GL_TEXTURE_2D, level, header->glInternalFormat, width, height, 0,
+					(GLsizei)levels[level].byteLength, (const void*)(base + levels[level].byteOffset));
+				width = width > 1 ? width / 2 : 1;
+				height = height > 1 ? height / 2 : 1;
+			}
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header->levelCount - 1);
+			cooked++;
+		}
+		else {
+			const void* pixels = (const void*)base;
+			//RGB rows aren't 4 byte aligned for every width
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			if (job.channels == 3) {
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, job.width, job.height, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+			}
+			else {
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, job.width, job.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+			}
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			glGenerateMipmap(GL_TEXTURE_2D);
+		}
+
+		//unbinds the texture
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	//copies a finished layer's mip chain, resampled or cooked, into its slice of the array
+	//a cooked file that changed since GetLayer() read its header no longer fits and keeps the placeholder
+	void UploadLayer(const DecodeJob& job, uintptr_t base) {
+		bool isCooked = !job.cookedData.empty();
+		const CookedTextureHeader* header = nullptr;
+		const CookedTextureLevel* levels = nullptr;
+		if (isCooked && (!ParseCookedTexture(job.cookedData.data(), job.cookedData.size(), header, levels) ||
+			header->glInternalFormat != arrayFormat || header->pixelWidth != (uint32_t)layerSize ||
+			header->pixelHeight != (uint32_t)layerSize || header->levelCount != (uint32_t)layerLevels)) {
+			std::cout << "Ignoring cooked texture for " << job.fileName << ", it doesn't fit the array" << std::endl;
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			return;
+		}
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, arrayTexture);
+		size_t offset = 0;
+		int size = layerSize;
+		for (int level = 0; level < layerLevels; level++) {
+			if (isCooked) {
+				glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, job.layer, size, size, 1, arrayFormat,
+					(GLsizei)levels[level].byteLength, (const void*)(base + levels[level].byteOffset));
+			}
+			else {
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, job.layer, size, size, 1,
+					GL_RGBA, GL_UNSIGNED_BYTE, (const void*)(base + offset));
+				offset += (size_t)size * size * 4;
+			}
+			size = size > 1 ? size / 2 : 1;
+		}
+		if (isCooked) {
+			cooked++;
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	}
+};
+#endif
@@ -0,0 +1,85 @@
+#ifndef TEXTURECONTAINER_H
+#define TEXTURECONTAINER_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+//Cooked texture container written by TextureCooker and read by TextureCache
+//Laid out after KTX2 without the parts this project doesn't use (supercompression, DFD, key/values):
+//	identifier | header | level index | level data
+//Levels are block compressed and stored largest first, the level index gives each level's bytes
+const unsigned char COOKED_TEXTURE_IDENTIFIER[12] = { 0xAB, 'C', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+//glInternalFormat values, same numbers as the GL enums so the loader can pass them straight through
+const uint32_t COOKED_FORMAT_BC1 = 0x83F0;	//GL_COMPRESSED_RGB_S3TC_DXT1_EXT, 8 bytes per 4x4 block
+const uint32_t COOKED_FORMAT_BC3 = 0x83F3;	//GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, 16 bytes per 4x4 block
+
+struct CookedTextureHeader {
+	unsigned char identifier[12];
+	uint32_t glInternalFormat;
+	uint32_t pixelWidth;
+	uint32_t pixelHeight;
+	uint32_t levelCount;
+	uint32_t reserved;			//keeps the level index 8 byte aligned
+};
+
+struct CookedTextureLevel {
+	uint64_t byteOffset;		//from the start of the file
+	uint64_t byteLength;
+};
+
+//bytes in one 4x4 block for a cooked format, 0 for formats the container doesn't hold
+inline uint32_t CookedBlockBytes(uint32_t format) {
+	if (format == COOKED_FORMAT_BC1) {
+		return 8;
+	}
+	if (format == COOKED_FORMAT_BC3) {
+		return 16;
+	}
+	return 0;
+}
+
+//compressed size of one level, partial blocks at the edges still take a whole block
+inline uint64_t CookedLevelBytes(uint32_t format, uint32_t width, uint32_t height) {
+	return (uint64_t)((width + 3) / 4) * ((height + 3) / 4) * CookedBlockBytes(format);
+}
+
+//cooked file that goes with a source image, the same path with the extension swapped for .ctex
+inline std::string CookedTextureFileName(const std::string& imageFileName) {
+	size_t dot = imageFileName.find_last_of('.');
+	size_t slash = imageFileName.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+		return imageFileName + ".ctex";
+	}
+	return imageFileName.substr(0, dot) + ".ctex";
+}
+
+//Checks a whole cooked file in memory, on success header and levels point into data
+inline bool ParseCookedTexture(const unsigned char* data, size_t size,
+	const CookedTextureHeader*& header, const CookedTextureLevel*& levels) {
+	if (size < sizeof(CookedTextureHeader)) {
+		return false;
+	}
+	const CookedTextureHeader* candidate = (const CookedTextureHeader*)data;
+	if (memcmp(candidate->identifier, COOKED_TEXTURE_IDENTIFIER, sizeof(COOKED_TEXTURE_IDENTIFIER)) != 0 ||
+		CookedBlockBytes(candidate->glInternalFormat) == 0 || candidate->levelCount == 0 ||
+		size < sizeof(CookedTextureHeader) + (uint64_t)candidate->levelCount * sizeof(CookedTextureLevel)) {
+		return false;
+	}
+	const CookedTextureLevel* index = (const CookedTextureLevel*)(data + sizeof(CookedTextureHeader));
+	uint32_t width = candidate->pixelWidth;
+	uint32_t height = candidate->pixelHeight;
+	for (uint32_t level = 0; level < candidate->levelCount; level++) {
+		if (index[level].byteLength != CookedLevelBytes(candidate->glInternalFormat, width, height) ||
+			index[level].byteOffset + index[level].byteLength > size) {
+			return false;
+		}
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+	header = candidate;
+	levels = index;
+	return true;
+}
+#endif
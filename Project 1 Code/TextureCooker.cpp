@@ -0,0 +1,529 @@
+//Offline texture cooker
+//Decodes images with stb_image, builds a gamma-correct mip chain and block compresses every level
+//into a .ctex container (TextureContainer.h) that TextureCache uploads without decoding anything
+//
+//usage: TextureCooker [--bc1 | --bc3] [--threads N] [--size N] image...
+//each image is written next to itself with a .ctex extension, the format defaults to BC1 for
+//images without alpha and BC3 for images with it
+//--size resamples every image to N x N first, the scene's texture array only takes cooked layers
+//of its own layer size (TEXTURE_LAYER_SIZE in Source.cpp)
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "TextureContainer.h"
+
+//One mip level in linear light, 4 floats per pixel (alpha is already linear)
+struct LinearImage {
+	int width;
+	int height;
+	std::vector<float> pixels;
+};
+
+//sRGB byte to linear, tabulated since every source pixel goes through it
+float srgbToLinear[256];
+
+void BuildSrgbTable() {
+	for (int i = 0; i < 256; i++) {
+		float c = i / 255.0f;
+		srgbToLinear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+	}
+}
+
+unsigned char LinearToSrgb(float c) {
+	c = c < 0.0f ? 0.0f : (c > 1.0f ? 1.0f : c);
+	float s = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+	return (unsigned char)(s * 255.0f + 0.5f);
+}
+
+//Source image to linear RGBA, flipped bottom to top to match what TextureCache does at load
+LinearImage ToLinear(const unsigned char* image, int width, int height, int channels) {
+	LinearImage level;
+	level.width = width;
+	level.height = height;
+	level.pixels.resize((size_t)width * height * 4);
+	for (int y = 0; y < height; y++) {
+		const unsigned char* row = image + (size_t)(height - 1 - y) * width * channels;
+		float* out = &level.pixels[(size_t)y * width * 4];
+		for (int x = 0; x < width; x++) {
+			out[x * 4 + 0] = srgbToLinear[row[x * channels + 0]];
+			out[x * 4 + 1] = srgbToLinear[row[x * channels + 1]];
+			out[x * 4 + 2] = srgbToLinear[row[x * channels + 2]];
+			out[x * 4 + 3] = channels == 4 ? row[x * channels + 3] / 255.0f : 1.0f;
+		}
+	}
+	return level;
+}
+
+//Next mip down, each pixel is the average of a 2x2 box in linear light
+//odd edges repeat the last row or column
+LinearImage Downsample(const LinearImage& source) {
+	LinearImage level;
+	level.width = source.width > 1 ? source.width / 2 : 1;
+	level.height = source.height > 1 ? source.height / 2 : 1;
+	level.pixels.resize((size_t)level.width * level.height * 4);
+	for (int y = 0; y < level.height; y++) {
+		int y0 = y * 2 < source.height ? y * 2 : source.height - 1;
+		int y1 = y * 2 + 1 < source.height ? y * 2 + 1 : source.height - 1;
+		for (int x = 0; x < level.width; x++) {
+			int x0 = x * 2 < source.width ? x * 2 : source.width - 1;
+			int x1 = x * 2 + 1 < source.width ? x * 2 + 1 : source.width - 1;
+			for (int c = 0; c < 4; c++) {
+				float sum = source.pixels[((size_t)y0 * source.width + x0) * 4 + c] +
+					source.pixels[((size_t)y0 * source.width + x1) * 4 + c] +
+					source.pixels[((size_t)y1 * source.width + x0) * 4 + c] +
+					source.pixels[((size_t)y1 * source.width + x1) * 4 + c];
+				level.pixels[((size_t)y * level.width + x) * 4 + c] = sum * 0.25f;
+			}
+		}
+	}
+	return level;
+}
+
+//Resamples to size x size in linear light, halving first so the bilinear pass never skips pixels
+LinearImage Resample(LinearImage source, int size) {
+	while (source.width >= size * 2 && source.height >= size * 2) {
+		source = Downsample(source);
+	}
+	LinearImage level;
+	level.width = size;
+	level.height = size;
+	level.pixels.resize((size_t)size * size * 4);
+	float scaleX = (float)source.width / size;
+	float scaleY = (float)source.height / size;
+	for (int y = 0; y < size; y++) {
+		float sy = std::max((y + 0.5f) * scaleY - 0.5f, 0.0f);
+		int y0 = std::min((int)sy, source.height - 1);
+		int y1 = std::min(y0 + 1, source.height - 1);
+		float fy = sy - y0;
+		for (int x = 0; x < size; x++) {
+			float sx = std::max((x + 0.5f) * scaleX - 0.5f, 0.0f);
+			int x0 = std::min((int)sx, source.width - 1);
+			int x1 = std::min(x0 + 1, source.width - 1);
+			float fx = sx - x0;
+			for (int c = 0; c < 4; c++) {
+				float p00 = source.pixels[((size_t)y0 * source.width + x0) * 4 + c];
+				float p01 = source.pixels[((size_t)y0 * source.width + x1) * 4 + c];
+				float p10 = source.pixels[((size_t)y1 * source.width + x0) * 4 + c];
+				float p11 = source.pixels[((size_t)y1 * source.width + x1) * 4 + c];
+				float top = p00 + (p01 - p00) * fx;
+				float bottom = p10 + (p11 - p10) * fx;
+				level.pixels[((size_t)y * size + x) * 4 + c] = top + (bottom - top) * fy;
+			}
+		}
+	}
+	return level;
+}
+
+//Back to 8 bit sRGB for the block encoder
+std::vector<unsigned char> ToSrgb(const LinearImage& level) {
+	std::vector<unsigned char> bytes(level.pixels.size());
+	for (size_t i = 0; i < level.pixels.size(); i += 4) {
+		bytes[i + 0] = LinearToSrgb(level.pixels[i + 0]);
+		bytes[i + 1] = LinearToSrgb(level.pixels[i + 1]);
+		bytes[i + 2] = LinearToSrgb(level.pixels[i + 2]);
+		float a = level.pixels[i + 3];
+		bytes[i + 3] = (unsigned char)((a < 0.0f ? 0.0f : (a > 1.0f ? 1.0f : a)) * 255.0f + 0.5f);
+	}
+	return bytes;
+}
+
+//Block compression
+//---------------------------------------------------------------------------------
+uint16_t PackColor565(const float color[3]) {
+	int r = (int)(color[0] * 31.0f / 255.0f + 0.5f);
+	int g = (int)(color[1] * 63.0f / 255.0f + 0.5f);
+	int b = (int)(color[2] * 31.0f / 255.0f + 0.5f);
+	r = r < 0 ? 0 : (r > 31 ? 31 : r);
+	g = g < 0 ? 0 : (g > 63 ? 63 : g);
+	b = b < 0 ? 0 : (b > 31 ? 31 : b);
+	return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+void UnpackColor565(uint16_t packed, float color[3]) {
+	int r = (packed >> 11) & 31;
+	int g = (packed >> 5) & 63;
+	int b = packed & 31;
+	color[0] = (float)((r << 3) | (r >> 2));
+	color[1] = (float)((g << 2) | (g >> 4));
+	color[2] = (float)((b << 3) | (b >> 2));
+}
+
+//picks the nearest of the four palette entries for every pixel, returns the total squared error
+float ChooseColorIndices(const unsigned char* block, uint16_t color0, uint16_t color1, unsigned int indices[16]) {
+	float palette[4][3];
+	UnpackColor565(color0, palette[0]);
+	UnpackColor565(color1, palette[1]);
+	for (int c = 0; c < 3; c++) {
+		palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+		palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+	}
+	float error = 0.0f;
+	for (int i = 0; i < 16; i++) {
+		float best = 1.0e30f;
+		for (unsigned int p = 0; p < 4; p++) {
+			float dr = block[i * 4 + 0] - palette[p][0];
+			float dg = block[i * 4 + 1] - palette[p][1];
+			float db = block[i * 4 + 2] - palette[p][2];
+			float distance = dr * dr + dg * dg + db * db;
+			if (distance < best) {
+				best = distance;
+				indices[i] = p;
+			}
+		}
+		error += best;
+	}
+	return error;
+}
+
+//Least squares endpoints for a fixed set of indices
+bool RefineEndpoints(const unsigned char* block, const unsigned int indices[16], float end0[3], float end1[3]) {
+	//weight of endpoint 0 for each palette index
+	const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+	float aa = 0.0f, bb = 0.0f, ab = 0.0f;
+	float ax[3] = { 0.0f, 0.0f, 0.0f };
+	float bx[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++) {
+		float a = weights[indices[i]];
+		float b = 1.0f - a;
+		aa += a * a;
+		bb += b * b;
+		ab += a * b;
+		for (int c = 0; c < 3; c++) {
+			ax[c] += a * block[i * 4 + c];
+			bx[c] += b * block[i * 4 + c];
+		}
+	}
+	float determinant = aa * bb - ab * ab;
+	if (fabsf(determinant) < 1.0e-6f) {
+		return false;
+	}
+	for (int c = 0; c < 3; c++) {
+		end0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+		end1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+	}
+	return true;
+}
+
+//BC1 color block from 16 RGBA pixels, always four-color mode so it's valid inside BC3 too
+//endpoints start at the extremes along the block's principal axis, then get one least squares pass
+void EncodeColorBlock(const unsigned char* block, unsigned char* out) {
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 3; c++) {
+			mean[c] += block[i * 4 + c];
+		}
+	}
+	for (int c = 0; c < 3; c++) {
+		mean[c] /= 16.0f;
+	}
+
+	//covariance and a few power iterations for the principal axis
+	float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++) {
+		float r = block[i * 4 + 0] - mean[0];
+		float g = block[i * 4 + 1] - mean[1];
+		float b = block[i * 4 + 2] - mean[2];
+		cov[0] += r * r;
+		cov[1] += r * g;
+		cov[2] += r * b;
+		cov[3] += g * g;
+		cov[4] += g * b;
+		cov[5] += b * b;
+	}
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	for (int iteration = 0; iteration < 4; iteration++) {
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float length = sqrtf(x * x + y * y + z * z);
+		if (length < 1.0e-6f) {
+			break;
+		}
+		axis[0] = x / length;
+		axis[1] = y / length;
+		axis[2] = z / length;
+	}
+
+	int minIndex = 0;
+	int maxIndex = 0;
+	float minDot = 1.0e30f;
+	float maxDot = -1.0e30f;
+	for (int i = 0; i < 16; i++) {
+		float d = block[i * 4 + 0] * axis[0] + block[i * 4 + 1] * axis[1] + block[i * 4 + 2] * axis[2];
+		if (d < minDot) {
+			minDot = d;
+			minIndex = i;
+		}
+		if (d > maxDot) {
+			maxDot = d;
+			maxIndex = i;
+		}
+	}
+	float end0[3], end1[3];
+	for (int c = 0; c < 3; c++) {
+		end0[c] = block[maxIndex * 4 + c];
+		end1[c] = block[minIndex * 4 + c];
+	}
+
+	uint16_t color0 = PackColor565(end0);
+	uint16_t color1 = PackColor565(end1);
+	unsigned int indices[16];
+	float error = ChooseColorIndices(block, color0, color1, indices);
+
+	float refined0[3], refined1[3];
+	if (color0 != color1 && RefineEndpoints(block, indices, refined0, refined1)) {
+		unsigned int refinedIndices[16];
+		uint16_t refinedColor0 = PackColor565(refined0);
+		uint16_t refinedColor1 = PackColor565(refined1);
+		float refinedError = ChooseColorIndices(block, refinedColor0, refinedColor1, refinedIndices);
+		if (refinedError < error) {
+			color0 = refinedColor0;
+			color1 = refinedColor1;
+			memcpy(indices, refinedIndices, sizeof(indices));
+		}
+	}
+
+	//four-color mode needs color0 > color1, swapping the endpoints swaps indices 0/1 and 2/3
+	if (color0 < color1) {
+		uint16_t swap = color0;
+		color0 = color1;
+		color1 = swap;
+		for (int i = 0; i < 16; i++) {
+			indices[i] ^= 1;
+		}
+	}
+	else if (color0 == color1) {
+		for (int i = 0; i < 16; i++) {
+			indices[i] = 0;
+		}
+	}
+
+	uint32_t bits = 0;
+	for (int i = 0; i < 16; i++) {
+		bits |= indices[i] << (i * 2);
+	}
+	out[0] = (unsigned char)(color0 & 0xFF);
+	out[1] = (unsigned char)(color0 >> 8);
+	out[2] = (unsigned char)(color1 & 0xFF);
+	out[3] = (unsigned char)(color1 >> 8);
+	out[4] = (unsigned char)(bits & 0xFF);
+	out[5] = (unsigned char)((bits >> 8) & 0xFF);
+	out[6] = (unsigned char)((bits >> 16) & 0xFF);
+	out[7] = (unsigned char)(bits >> 24);
+}
+
+//BC3 alpha block, eight-value mode between the block's min and max alpha
+void EncodeAlphaBlock(const unsigned char* block, unsigned char* out) {
+	int alpha0 = 0;
+	int alpha1 = 255;
+	for (int i = 0; i < 16; i++) {
+		int a = block[i * 4 + 3];
+		alpha0 = a > alpha0 ? a : alpha0;
+		alpha1 = a < alpha1 ? a : alpha1;
+	}
+
+	uint64_t bits = 0;
+	if (alpha0 != alpha1) {
+		float palette[8];
+		palette[0] = (float)alpha0;
+		palette[1] = (float)alpha1;
+		for (int p = 1; p < 7; p++) {
+			palette[p + 1] = ((7 - p) * alpha0 + p * alpha1) / 7.0f;
+		}
+		for (int i = 0; i < 16; i++) {
+			float best = 1.0e30f;
+			uint64_t index = 0;
+			for (int p = 0; p < 8; p++) {
+				float distance = fabsf(block[i * 4 + 3] - palette[p]);
+				if (distance < best) {
+					best = distance;
+					index = (uint64_t)p;
+				}
+			}
+			bits |= index << (i * 3);
+		}
+	}
+	out[0] = (unsigned char)alpha0;
+	out[1] = (unsigned char)alpha1;
+	for (int i = 0; i < 6; i++) {
+		out[2 + i] = (unsigned char)((bits >> (i * 8)) & 0xFF);
+	}
+}
+
+//Compresses one level, block rows are split across threads
+//pixels at the right and bottom edges are repeated to fill partial blocks
+std::vector<unsigned char> CompressLevel(const std::vector<unsigned char>& pixels, int width, int height,
+	uint32_t format, unsigned int threadCount) {
+	int blocksX = (width + 3) / 4;
+	int blocksY = (height + 3) / 4;
+	uint32_t blockBytes = CookedBlockBytes(format);
+	std::vector<unsigned char> out((size_t)blocksX * blocksY * blockBytes);
+
+	auto encodeRows = [&](int firstRow, int lastRow) {
+		unsigned char block[16 * 4];
+		for (int by = firstRow; by < lastRow; by++) {
+			for (int bx = 0; bx < blocksX; bx++) {
+				for (int y = 0; y < 4; y++) {
+					int sy = by * 4 + y < height ? by * 4 + y : height - 1;
+					for (int x = 0; x < 4; x++) {
+						int sx = bx * 4 + x < width ? bx * 4 + x : width - 1;
+						memcpy(&block[(y * 4 + x) * 4], &pixels[((size_t)sy * width + sx) * 4], 4);
+					}
+				}
+				unsigned char* target = &out[((size_t)by * blocksX + bx) * blockBytes];
+				if (format == COOKED_FORMAT_BC3) {
+					EncodeAlphaBlock(block, target);
+					EncodeColorBlock(block, target + 8);
+				}
+				else {
+					EncodeColorBlock(block, target);
+				}
+			}
+		}
+	};
+
+	unsigned int count = threadCount < (unsigned int)blocksY ? threadCount : (unsigned int)blocksY;
+	if (count <= 1) {
+		encodeRows(0, blocksY);
+		return out;
+	}
+	std::vector<std::thread> workers;
+	for (unsigned int t = 0; t < count; t++) {
+		int firstRow = (int)((uint64_t)blocksY * t / count);
+		int lastRow = (int)((uint64_t)blocksY * (t + 1) / count);
+		workers.push_back(std::thread(encodeRows, firstRow, lastRow));
+	}
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+	return out;
+}
+
+//Cooks one image, format 0 picks from the image's channels and size 0 keeps the image's own size
+bool CookTexture(const std::string& fileName, uint32_t format, int size, unsigned int threadCount) {
+	int width, height, channels;
+	unsigned char* image = stbi_load(fileName.c_str(), &width, &height, &channels, 0);
+	if (!image) {
+		std::cout << "Failed to load texture " << fileName << std::endl;
+		return false;
+	}
+	if (channels != 3 && channels != 4) {
+		std::cout << "Not implemented for image with " << channels << " channels\n";
+		stbi_image_free(image);
+		return false;
+	}
+	if (format == 0) {
+		format = channels == 4 ? COOKED_FORMAT_BC3 : COOKED_FORMAT_BC1;
+	}
+
+	//full mip chain down to 1x1
+	std::vector<std::vector<unsigned char> > levels;
+	LinearImage level = ToLinear(image, width, height, channels);
+	stbi_image_free(image);
+	if (size > 0) {
+		level = Resample(level, size);
+		width = height = size;
+	}
+	while (true) {
+		levels.push_back(CompressLevel(ToSrgb(level), level.width, level.height, format, threadCount));
+		if (level.width == 1 && level.height == 1) {
+			break;
+		}
+		level = Downsample(level);
+	}
+
+	CookedTextureHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.identifier, COOKED_TEXTURE_IDENTIFIER, sizeof(header.identifier));
+	header.glInternalFormat = format;
+	header.pixelWidth = (uint32_t)width;
+	header.pixelHeight = (uint32_t)height;
+	header.levelCount = (uint32_t)levels.size();
+
+	std::vector<CookedTextureLevel> index(levels.size());
+	uint64_t offset = sizeof(header) + sizeof(CookedTextureLevel) * index.size();
+	uint64_t total = 0;
+	for (size_t i = 0; i < levels.size(); i++) {
+		index[i].byteOffset = offset;
+		index[i].byteLength = levels[i].size();
+		offset += levels[i].size();
+		total += levels[i].size();
+	}
+
+	std::string outName = CookedTextureFileName(fileName);
+	FILE* file = fopen(outName.c_str(), "wb");
+	if (file == NULL) {
+		std::cout << "Failed to write " << outName << std::endl;
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(index.data(), sizeof(CookedTextureLevel), index.size(), file) == index.size();
+	for (size_t i = 0; ok && i < levels.size(); i++) {
+		ok = fwrite(levels[i].data(), 1, levels[i].size(), file) == levels[i].size();
+	}
+	fclose(file);
+	if (!ok) {
+		std::cout << "Failed to write " << outName << std::endl;
+		remove(outName.c_str());
+		return false;
+	}
+
+	std::cout << "INFO: " << fileName << " -> " << outName << " (" << width << "x" << height << ", "
+		<< (format == COOKED_FORMAT_BC3 ? "BC3" : "BC1") << ", " << levels.size() << " levels, "
+		<< total << " bytes)" << std::endl;
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	BuildSrgbTable();
+
+	uint32_t format = 0;
+	int size = 0;
+	unsigned int threadCount = std::thread::hardware_concurrency();
+	threadCount = threadCount > 0 ? threadCount : 1;
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; i++) {
+		std::string option = argv[i];
+		if (option == "--bc1") {
+			format = COOKED_FORMAT_BC1;
+		}
+		else if (option == "--bc3") {
+			format = COOKED_FORMAT_BC3;
+		}
+		else if (option == "--threads" && i + 1 < argc) {
+			threadCount = (unsigned int)strtoul(argv[++i], NULL, 10);
+			threadCount = threadCount > 0 ? threadCount : 1;
+		}
+		else if (option == "--size" && i + 1 < argc) {
+			size = atoi(argv[++i]);
+			if (size <= 0) {
+				std::cout << "--size needs a positive size" << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+		else {
+			files.push_back(option);
+		}
+	}
+	if (files.empty()) {
+		std::cout << "usage: TextureCooker [--bc1 | --bc3] [--threads N] [--size N] image..." << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < files.size(); i++) {
+		ok = CookTexture(files[i], format, size, threadCount) && ok;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}